@@ -0,0 +1,44 @@
+#!/bin/sh
+
+# benchmark ericstract on synthetic packages from omtgen, one workload per kind of record and a mixed one.
+# reports source MB/s and records/s end to end, best of BENCH_RUNS, for each number of jobs.
+# binwalk is not run (-E), it would dominate the measure.
+# usage: bench_ericstract.sh [workload...]
+
+trace() { echo "$ $*" >&2; "$@"; }
+
+BENCH_DIR=${BENCH_DIR:-/tmp/ericstract_bench}
+BENCH_JOBS=${BENCH_JOBS:-"1 2 4 $(nproc)"}
+BENCH_SIZE=${BENCH_SIZE:-256}		# KB per leaf part
+BENCH_FILES=${BENCH_FILES:-4}		# files per kind of record
+BENCH_RUNS=${BENCH_RUNS:-3}
+WORKLOADS=${*:-"raw meta archive xplf rpdo multipart mixed"}
+
+set -e
+
+trace make with_gcc omtgen >&2
+mkdir -p $BENCH_DIR
+
+printf "%-10s %5s %9s %9s %9s %10s %11s\n" workload jobs MB records seconds MB/s records/s
+for w in $WORKLOADS; do
+	pkg=$BENCH_DIR/pkg_$w
+	rm -rf $pkg
+	./omtgen -w $w -n $BENCH_FILES -s $BENCH_SIZE $pkg > /dev/null
+	bytes=$(cat $pkg/* | wc -c)
+	for j in $(echo $BENCH_JOBS | tr ' ' '\n' | sort -nu); do
+		best=0
+		for r in $(seq $BENCH_RUNS); do
+			rm -rf $BENCH_DIR/out
+			start=$(date +%s%N)
+			./ericstract -E -j $j -o $BENCH_DIR/out $pkg > $BENCH_DIR/log
+			ns=$(($(date +%s%N) - start))
+			[ $best -eq 0 -o $ns -lt $best ] && best=$ns
+		done
+		records=$(grep "total number of records" $BENCH_DIR/log | cut -d: -f2)
+		awk -v w="$w" -v j="$j" -v b="$bytes" -v r="$records" -v ns="$best" 'BEGIN {
+			s = ns / 1e9
+			printf "%-10s %5d %9.1f %9d %9.3f %10.1f %11.0f\n", w, j, b / 1e6, r, s, b / 1e6 / s, r / s
+		}'
+	done
+done
+rm -rf $BENCH_DIR/out
@@ -24,9 +24,11 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <ctype.h>
 #include <string.h>
 #include <sys/wait.h>
@@ -40,8 +42,28 @@
 #include <sys/mman.h>
 #include <limits.h>
 #include <endian.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <spawn.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
 
 #include "zlib.h"
+#include <lzma.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <tmmintrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CARVE_SSSE3
+#define CRC_SIMD
+#endif
 
 /*
  * Upgrade Packages in OMT format consist of multiple files each containing a tree of imbricated headers and data.
@@ -73,6 +95,7 @@
  * CRC:
  * At the end of each record and each file, a 4-byte CRC is present.
  * It is unclear at this point how the CRC is computed (CRC32, ADLER32, maybe something else).
+ * With --verify, common checksums are tried on the records to find the one used, see crc_discover().
  */
 
 #define CRC_LEN 4 * sizeof(uint8_t)
@@ -151,28 +174,177 @@ struct __attribute__((__packed__)) header_rpdo {
 	uint16_t unknown2;
 };
 
+/*
+ * Formats found inside records content, extracted by the carver instead of binwalk.
+ */
+
+struct __attribute__((__packed__)) header_uimage {
+	uint32_t magic;					/* 27051956 */
+	uint32_t hcrc;					/* crc32 of this header, with hcrc set to 0 */
+	uint32_t time;
+	uint32_t size;					/* data length, after this header */
+	uint32_t load;
+	uint32_t ep;
+	uint32_t dcrc;
+	uint8_t	 os;
+	uint8_t	 arch;
+	uint8_t	 type;
+	uint8_t	 comp;					/* 0 none, 1 gzip, 2 bzip2, 3 lzma */
+	char	 name[32];
+};
+
+struct __attribute__((__packed__)) header_cpio {
+	char	 magic[6];				/* ascii 070701, or 070702 with checksums */
+	char	 ino[8];				/* next fields are ascii hexadecimal */
+	char	 mode[8];
+	char	 uid[8];
+	char	 gid[8];
+	char	 nlink[8];
+	char	 mtime[8];
+	char	 filesize[8];
+	char	 devmajor[8];
+	char	 devminor[8];
+	char	 rdevmajor[8];
+	char	 rdevminor[8];
+	char	 namesize[8];			/* including the terminating null byte */
+	char	 check[8];
+	/* next is file name, then file data, both padded to 4 bytes */
+};
+
+#define TAR_BLOCK 512
+
+struct __attribute__((__packed__)) header_tar {
+	char	 name[100];				/* not nul terminated when full */
+	char	 mode[8];				/* numeric fields are ascii octal */
+	char	 uid[8];
+	char	 gid[8];
+	char	 size[12];				/* or base-256 when the high bit of the first byte is set */
+	char	 mtime[12];
+	char	 chksum[8];
+	char	 typeflag;
+	char	 linkname[100];
+	char	 magic[6];				/* ustar */
+	char	 version[2];
+	char	 uname[32];
+	char	 gname[32];
+	char	 devmajor[8];
+	char	 devminor[8];
+	char	 prefix[155];			/* ustar directory of name */
+	char	 pad[12];
+	/* next is file data, padded to TAR_BLOCK */
+};
+
+/*
+ * Index of the record tree, written with -i and used by mapping it, without parsing.
+ * It is made of a header, the records in tree order, and a table of nul terminated strings.
+ * Integers are in host byte order.
+ */
+
+#define INDEX_MAGIC "ERXIDX01"
+#define INDEX_NONE 0xffffffff
+#define INDEX_SEQ_START 0x1			/* first part of a reassembled archive, it's decoded content is the whole archive */
+#define INDEX_CARVER_LZMA 0xff
+
+struct __attribute__((__packed__)) index_header {
+	char	 magic[8];
+	uint32_t records_count;
+	uint32_t upgrade_dir;			/* offset in the strings table */
+	uint64_t strings_off;			/* from file start */
+	uint64_t strings_size;
+	/* next is records table */
+};
+
+struct __attribute__((__packed__)) index_rec {
+	uint32_t parent;				/* position of the parent record, INDEX_NONE for source files */
+	uint32_t source;				/* position of the source file record */
+	uint32_t base;					/* record which decoded content holds this one, INDEX_NONE for the source file */
+	uint32_t seq_next;				/* next part of a reassembled archive, or INDEX_NONE */
+	uint32_t name;					/* offsets in the strings table, 0 is an empty string */
+	uint32_t out_filename;
+	uint32_t magic;					/* first 4 bytes */
+	uint32_t type;					/* type of normal records */
+	uint8_t	 rec_type;				/* enum rec_type */
+	uint8_t	 depth;
+	uint8_t	 comp;					/* enum index_comp */
+	uint8_t	 carver;				/* position in carvers[] for INDEX_CARVE */
+	uint32_t flags;
+	uint64_t offset;				/* in the decoded content of base or in the source file, -1 if unknown */
+	uint64_t size;
+	uint64_t comp_size;				/* compressed length, 0 if not compressed */
+	uint64_t decomp_size;			/* decoded content length */
+};
+
+/* index being built from the record tree */
+struct index_build {
+	struct index_rec *recs;
+	struct record **order;
+	size_t count;
+	size_t alloc;
+	char *strings;
+	size_t strings_size;
+	size_t strings_alloc;
+};
+
+/* index mapped for queries */
+struct index_map {
+	uint8_t *map;
+	size_t size;
+	struct index_header *h;
+	struct index_rec *recs;
+	char *strings;
+};
+
 /*
  * This program parses Upgrade File recursively and stores all records in 'struct record'.
  */
 
-#define REC_CHILD_MAX 255
 #define REC_DEPTH_MAX 25
-#define REC_REASSEMBLY_MAX 255
-#define REC_BINWALK_MAX 1024
+#define BINWALK_TIMEOUT 3600
+#define TIMEVAL_SEC(tv) ((tv).tv_sec + (tv).tv_usec / 1e6)
 #define Z_CHUNK_SIZE 262144
+#define Z_RATIO_MAX 1032			/* maximum deflate compression ratio, to validate decompressed size hints */
+#define Z_STREAM_WINDOW 8388608		/* output written between two releases of memory, when decompressing to a file */
+#define Z_STREAM_HEAD 4096			/* output kept in memory, when decompressing to a file */
+#define XZ_MEMLIMIT 268435456		/* memory usage limit of the lzma decoder */
+#define CARVE_SIZE_MIN 16			/* smallest content extracted by the carver */
+#define CARVE_PROBE_SIZE 4096		/* output decoded to validate a compressed stream */
+#define CACHE_KEY_LEN 64
+#define CACHE_SIZE_MAX 4096			/* default maximum cache size in MB */
+#define DEDUP_BUCKETS 65536
+#define OUTPUT_LOCKS 64				/* locks of the table of output paths, each one covers a share of it's buckets */
+#define CRC_DISCOVER_RECORDS 64		/* records on which the checksum algorithm is searched */
+#define ARENA_CHUNK_SIZE 1048576	/* allocation unit of the arena holding the record tree */
+#define ARENA_CHUNK_RECS 1024		/* records per chunk of the arena */
+#define PROF_SLOTS 48				/* profile counters: functions, handlers and carvers */
+#define PROF_BUCKETS 10				/* input size histogram, powers of 4 from 1 KB */
+#define PROF_DEPTH (REC_DEPTH_MAX * 3)	/* nested timings per thread */
+#define WRITER_ENTRIES 256			/* io_uring queue size of the output writer */
+#define WRITER_BUDGET 67108864		/* bytes queued to the output writer and not written yet */
+#define WRITER_FILES 256			/* output files queued to the writer and not closed yet, at most a quarter of the descriptors limit */
+#define WRITER_CHUNK 1073741824		/* largest write submitted at once */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL 2					/* highest log level compiled in, 1 for info only, 2 for verbose */
+#endif
 
 struct record {
 	uint8_t *ptr;
 	size_t size;
+	char *src_path;				/* file containing ptr, opened to copy it's slices without reading them, or NULL */
+	off_t src_off;				/* offset of ptr in src_path */
+	ino_t src_ino;				/* source file of root records, or their container, as it was mapped */
+	struct timespec src_mtime;
 	unsigned int depth;
 	char *filename;
 	char *out_filename;			/* part of the filename, to be concatenated from other record filenames in the tree */
 	char *out_filename_full;	/* filename as created on disk */
 	const char *out_fileext;
 	int part;
+	uint8_t rec_type;			/* enum rec_type of the header dispatched, REC_RAW for unknown and carved records */
+	unsigned int index;			/* position in parent childs, or in source files for root records */
 	struct record *parent;
-	struct record *childs[REC_CHILD_MAX];
+	struct record **childs;		/* array in the arena, grown by doubling */
 	unsigned int childs_count;
+	unsigned int childs_alloc;
 	struct { /* decoded from record header */
 		uint32_t size;
 		uint32_t type;
@@ -183,11 +355,95 @@ struct record {
 	struct { /* archive extract and reassembly */
 		uint8_t *buf;
 		size_t size;
+		int mapped;				/* buf is a mapping of the output file, or of a memory file */
 		struct record *seq_next;
 		struct record *seq_prev;
+		uint8_t *seq_buf;			/* reassembled content, on sequence start: mapping of it's output file */
+		size_t seq_size;
 	} extract;
+	struct logbuf *log;			/* buffered output, when extracting with multiple jobs */
+	uint8_t *content;			/* content of the output file, scanned by the carver */
+	size_t content_size;
+	struct carver *carve;		/* format of a record found by the carver */
+	struct record *base;		/* record which decoded content holds ptr, NULL for the source file */
+	off_t base_off;				/* offset of ptr in the decoded content of base or in the source file, -1 if unknown */
+	unsigned int pos;			/* position in the index */
+	unsigned int round;			/* reassembly round which extracted the record, 0 for the source files */
+	int shadowed;				/* the last file opened by the record is written by a later one, rec_open() gave a memory file */
+	struct package *package;	/* upgrade directory of a source file, NULL for other records */
+	int writes;					/* output files queued to the writer and not written yet */
+};
+
+/*
+ * memory of the record tree and of it's strings, released at once when extraction is done.
+ * records get their own chunks, so that the resources they hold can be released by walking them.
+ * each extraction worker fills it's own arena, merged in the main one by sched_wait().
+ */
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((aligned(16)));
+};
+
+struct arena {
+	struct arena_chunk *chunks;	/* strings and child lists, the first one is being filled */
+	struct arena_chunk *recs;	/* records, the first one is being filled */
 };
 
+/*
+ * checksum algorithms tried on the 2 CRCs at the end of records.
+ * each one is a kernel updating a 32 bits register, with an initial value and a final xor.
+ */
+enum crc_kernel { CRC_REFLECTED, CRC_CASTAGNOLI, CRC_MSB, CRC_ADLER };
+
+struct crc_algo {
+	const char *name;
+	enum crc_kernel kernel;
+	uint32_t init;
+	uint32_t xorout;
+};
+
+/* algorithm, range of the record and byte order matching one of the CRCs */
+struct crc_match {
+	int found;
+	unsigned int algo;
+	unsigned int coverage;
+	int le;
+	unsigned int count;
+};
+
+/*
+ * log output of a record tree, kept in memory while workers run in parallel.
+ * records extracted as separate tasks log to their own buffer, inserted at 'pos' in the buffer of the task
+ * that created them, so that the final output reads as a serial extraction.
+ */
+struct logbuf {
+	FILE *f;
+	char *buf;
+	size_t size;
+	size_t pos;
+	struct logbuf *childs;
+	struct logbuf *childs_last;
+	struct logbuf *next;
+};
+
+/* work on a record, run by the scheduler */
+struct task {
+	void (*run)(struct record *);
+	struct record *rec;
+};
+
+/* tasks queue of an extraction worker: the owner works at the tail, others steal from the head */
+struct deque {
+	pthread_mutex_t lock;
+	struct task *tasks;
+	size_t head;
+	size_t tail;
+	size_t alloc;
+};
+
+
 enum extract_res {
 	EXTRACT_FAILED_NO_HANDLER = 0,
 	EXTRACT_FAILED_NOT_IMPLEMENTED,
@@ -199,6 +455,15 @@ enum extract_res {
 	EXTRACT_USE_BINWALK,
 };
 
+/* how the decoded content of an index record is obtained from it's bytes */
+enum index_comp {
+	INDEX_RAW = 0,
+	INDEX_ARCHIVE_PART,
+	INDEX_XZ,
+	INDEX_RPDO,
+	INDEX_CARVE,
+};
+
 enum rec_type {
 	REC_RAW = 0,
 	REC_NORMAL,
@@ -219,16 +484,92 @@ struct magic {
 	enum extract_res (*handler)(struct record *); /* handler function */
 };
 
+/* formats extracted by the carver, found by their signature in records content */
+struct carver {
+	char *name;
+	char *sig;
+	size_t sig_len;
+	size_t (*probe)(uint8_t *, size_t, uint8_t **, size_t *);	/* length found at ptr or 0, NULL if left to binwalk */
+	enum extract_res (*handler)(struct record *);
+	const char *ext;
+};
+
+/* dispatch key of a magic, sorted for lookup by magic or by type */
+struct magic_key {
+	uint32_t key;
+	unsigned int prio;	/* position in the table, lower wins when both magic and type match */
+	struct magic *m;
+};
+
 /* global configuration */
 static struct conf {
 	int no_binwalk;
 	char *extract_dir_base;
 	int only_list;
 	int verbose;
+	unsigned int jobs;
+	unsigned int binwalk_jobs;
+	unsigned int binwalk_timeout;
+	char *magic_file;
+	int carve;
+	char *cache_dir;
+	off_t cache_max;
+	int dedup;
+	int resume;
+	char *index_path;
+	char *query;
+	int query_dump;
+	FILE *events;
+	int verify;
+	int profile;
+	char *profile_json;
+	int recursive;
+	int sync_writes;
 } conf;
 
-/* global statistics */
-static struct stats {
+/* verbose logging, arguments are only evaluated when enabled, compiled out with -DLOG_LEVEL=1 */
+#define verb(depth, ...) do { if (LOG_LEVEL >= 2 && conf.verbose) verb_log(depth, __VA_ARGS__); } while (0)
+
+/* NDJSON event, written to the events file in a single call so that lines of concurrent threads do not mix */
+struct event {
+	char buf[PATH_MAX * 3];
+	size_t len;				/* sizeof(buf) when truncated, the event is then dropped */
+};
+#define EVENT_TAIL 512		/* room left in an event after a string field, for the fields that follow */
+
+/* profile counters slots, handlers and carvers follow in the order of their tables */
+enum prof_slot {
+	PROF_EXTRACT,
+	PROF_INFLATE,
+	PROF_XZ,
+	PROF_WRITE,
+	PROF_REASSEMBLY,
+	PROF_CARVE,
+	PROF_BINWALK,
+	PROF_HANDLERS,
+};
+
+/* time and bytes spent in a function or handler, with --profile. self times exclude nested profiled calls */
+struct prof_counter {
+	uint64_t calls;
+	uint64_t wall_ns;
+	uint64_t self_ns;
+	uint64_t cpu_ns;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t hist[PROF_BUCKETS];
+};
+
+/* a profiled call in progress */
+struct prof_frame {
+	uint64_t wall;
+	uint64_t cpu;
+	uint64_t child_wall;
+	uint64_t child_cpu;
+};
+
+/* statistics, one set per extraction worker, summed in stats_total at the end */
+struct stats {
 	int records_count;
 	int unknown_records;
 	unsigned int max_depth;
@@ -238,26 +579,258 @@ static struct stats {
 	struct record *met;
 	struct record *zfj;
 	unsigned int warnings;
-} stats;
+	int carved;
+	int cache_hits;
+	int deduplicated;
+	int crc_checked;
+	int crc_errors;
+	struct prof_counter prof[PROF_SLOTS];
+};
+
+/* an upgrade directory, extracted to it's own subdirectory of the output directory in batch mode */
+struct package {
+	char *upgrade_dir;
+	char *name;					/* output subdirectory */
+	char *dir;					/* output directory */
+	struct record **roots;		/* source files, in directory order */
+	unsigned int count;
+	unsigned int alloc;
+	unsigned int skipped;
+	size_t binwalk_count;		/* records added to the binwalk list */
+	struct stats stats;
+	struct stats binwalk_stats;	/* written by the binwalk thread only */
+	struct stats writer_stats;	/* written by the writer thread only */
+	struct logbuf *log;			/* buffered output of the scan, in batch mode */
+	uint8_t *container;			/* mapping of a tar or cpio file holding the Upgrade Files, or NULL */
+	size_t container_size;
+	ino_t container_ino;		/* container file as it was mapped */
+	struct timespec container_mtime;
+	int compressed;				/* container decompressed to a memory file, members have no offset */
+};
+
+static struct packages {
+	struct package *list;
+	unsigned int count;
+	unsigned int alloc;
+	unsigned int next;			/* next package to scan */
+	unsigned int scanning;		/* scan threads running */
+	int batch;					/* several upgrade directories, or -R */
+} packages;
+
+struct worker {
+	pthread_t thread;
+	unsigned int id;
+	struct stats *stats;		/* one set per package */
+	struct deque tasks;
+	struct arena arena;
+};
+
+/* work-stealing scheduler for record extraction tasks, used when jobs > 1 */
+static struct sched {
+	struct worker *workers;
+	unsigned int count;
+	unsigned long pending;		/* tasks queued or running */
+	unsigned long queued;		/* tasks waiting in a deque */
+	unsigned int sleeping;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_mutex_t lists_lock;	/* protects reassembly and binwalk lists */
+} sched = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .lists_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct stats stats_total;
+static __thread struct stats *stats = &stats_total;
+static __thread struct logbuf *logbuf = NULL;
+static __thread struct worker *worker = NULL;
+static __thread struct prof_frame prof_stack[PROF_DEPTH];
+static __thread unsigned int prof_depth = 0;
+static struct arena arena_main;
+static __thread struct arena *arena = &arena_main;
+static __thread z_stream *zstrm = NULL;		/* inflate context of the thread, reused using inflateReset() */
+static char indent_spaces[(REC_DEPTH_MAX+2)*4+1];	/* filled with spaces at startup */
+
+/* dispatch tables of extract handlers, built at startup from magics[] and the magic file */
+static struct dispatch {
+	struct magic *table;
+	size_t count;
+	struct magic_key *by_magic;
+	size_t by_magic_count;
+	struct magic_key *by_type;
+	size_t by_type_count;
+} dispatch;
 
 /* records set for reassembly */
 static struct reassembly {
-	struct record *recs[REC_REASSEMBLY_MAX];
+	struct record **recs;
 	size_t count;
+	size_t alloc;
 } reassembly;
 
-/* records set for extraction using binwalk */
+/* records set for extraction using binwalk, run by the job server thread while extraction goes on */
 static struct binwalk {
-	struct record *recs[REC_BINWALK_MAX];
-	int pids[REC_BINWALK_MAX];
-	int status[REC_BINWALK_MAX];
+	struct record **recs;
 	size_t count;
-	size_t running;
-} binwalk;
+	size_t alloc;
+	size_t taken;		/* records already taken by the job server */
+	int closed;			/* extraction is done, no more records will be added */
+	int efd;			/* eventfd waking up the job server, -1 if it is not running */
+	pthread_t thread;
+	struct stats stats;
+	struct logbuf *log;
+} binwalk = { .efd = -1 };
+
+/* an output file queued to the writer, closed and released once written */
+struct write_req {
+	int fd;
+	uint8_t *buf;
+	size_t size;
+	size_t done;				/* bytes written */
+	int copy;					/* buf is a slice of the source file of rec, copied by the kernel when possible */
+	int owned;					/* buf is a copy, freed once written */
+	int closing;
+	int error;
+	struct record *rec;
+	char *path;
+	struct write_req *next;
+};
+
+/*
+ * output writer, a thread submitting the writes and closes of output files to an io_uring in batches,
+ * so that extraction does not wait for the filesystem. files are written directly when io_uring is not available.
+ */
+static struct writer {
+	int ring;					/* io_uring descriptor, -1 if the writer is not running */
+	uint8_t *sq_map;
+	uint8_t *cq_map;
+	size_t sq_map_size;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_tail, *sq_mask, *sq_array;
+	uint32_t *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	struct write_req *queue;	/* queued, not submitted yet */
+	struct write_req **queue_tail;
+	size_t inflight;			/* bytes queued and not written yet, bounded by WRITER_BUDGET */
+	unsigned int files;			/* output files queued and not closed yet, bounded by files_max */
+	unsigned int files_max;
+	int closed;					/* extraction is done, no more files will be queued */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;		/* a file is queued, or the writer is closed */
+	pthread_cond_t done;		/* a file is written */
+} writer = { .ring = -1, .queue_tail = &writer.queue, .lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+/* files written in this run by content, identical ones are linked to the first one with -D */
+struct dedup_entry {
+	char key[CACHE_KEY_LEN];
+	char *path;
+	struct record *rec;			/* record which wrote it, waited for when queued to the writer */
+	struct dedup_entry *next;
+};
+
+static struct dedup {
+	struct dedup_entry **buckets;
+	pthread_mutex_t lock;
+} dedup = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * output paths written in this run, with the record owning each one. when records share a path, the one extracted
+ * last in a serial run owns it whatever the number of jobs, so that the content of the file does not depend on timing.
+ */
+struct output_entry {
+	char *path;
+	struct record *rec;
+	struct output_entry *next;
+};
+
+static struct outputs {
+	struct output_entry *buckets[DEDUP_BUCKETS];
+	pthread_mutex_t locks[OUTPUT_LOCKS];
+} outputs = { .locks = { [0 ... OUTPUT_LOCKS-1] = PTHREAD_MUTEX_INITIALIZER } };
+
+/* a source file, as recorded in the manifest of the extract directory with -r */
+struct manifest_source {
+	char *name;
+	off_t size;
+	struct timespec mtime;
+	uint64_t crc;				/* crc64 of the file */
+	unsigned int gen;			/* incremented each time the file is extracted again, older outputs are dropped */
+	int done;					/* extraction of the file went through */
+	char *seqs;					/* first 7 letters of the multi-part archives found in the file, each followed by '\n' */
+	int present;				/* found in the upgrade directory of this run */
+	int changed;				/* new or modified since it was extracted */
+	int extract;				/* to be extracted in this run */
+	struct manifest_source *next;
+	struct manifest_source *list_next;
+};
+
+/* a file written to the extract directory, as recorded in the manifest */
+struct manifest_output {
+	char *path;					/* relative to the extract directory */
+	struct manifest_source *src;
+	unsigned int gen;
+	off_t offset;				/* offset of the content in the source file, -1 if it is not a slice of it */
+	off_t size;
+	uint32_t crc;
+	int binwalk;				/* handed to binwalk */
+	int binwalk_done;			/* binwalk went through on this content */
+	struct manifest_output *next;
+	struct manifest_output *list_next;
+};
+
+static struct manifest {
+	FILE *f;					/* journal, appended to as files are written */
+	pthread_mutex_t lock;		/* protects the journal and the tables */
+	struct manifest_source **sources;
+	struct manifest_source *sources_list;
+	struct manifest_source **sources_tail;
+	struct manifest_output **outputs;
+	struct manifest_output *outputs_list;
+	struct manifest_output **outputs_tail;
+	unsigned int unchanged;
+} manifest = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define CRC_ALGOS 7
+#define CRC_COVERAGES 3
+/* checksum verification, candidates are counted on the first records then the best one is checked on all */
+static struct crc {
+	uint32_t table_castagnoli[256];
+	uint32_t table_msb[256];
+	uint32_t (*castagnoli)(uint32_t, const uint8_t *, size_t);
+	int pclmul;
+	unsigned int samples;
+	unsigned int counts[2][CRC_ALGOS][CRC_COVERAGES][2];	/* [crc][algo][coverage][little endian] */
+	struct crc_match match[2];
+} crc;
+
+/* a binwalk process, largest waiting files are started first */
+struct binwalk_job {
+	struct record *rec;
+	struct package *package;
+	off_t size;
+	char key[CACHE_KEY_LEN];	/* key of the file content, empty if not cached nor deduplicated */
+	enum { BINWALK_PENDING, BINWALK_RUNNING, BINWALK_DONE } state;
+	size_t dup_of;		/* job run on identical content, which results are linked to this one, or -1 */
+	pid_t pid;
+	int pidfd;			/* -1 if pidfds are not supported, the process is then polled */
+	struct timespec start;
+	int timed_out;
+	int status;
+	struct rusage ru;
+};
 
 void usageexit(void);
+void dispatch_init(char *);
+void dispatch_load(char *);
+struct magic *dispatch_lookup(uint32_t, uint32_t);
+int magic_key_cmp(const void *, const void *);
+int magic_key_find(const void *, const void *);
+size_t magic_keys_sort(struct magic_key *, size_t);
+int magic_parse(char *, char *);
 enum extract_res rec_extract(struct record *, unsigned int);
 enum extract_res rec_extract_new(struct record *, int, uint8_t *, size_t, unsigned int);
+struct record *rec_new(struct record *, int, uint8_t *, size_t);
 enum extract_res rec_handler_zfj(struct record *);
 enum extract_res rec_handler_ucf(struct record *);
 enum extract_res rec_handler_met(struct record *);
@@ -266,19 +839,193 @@ enum extract_res rec_handler_xplf(struct record *);
 enum extract_res rec_handler_blob(struct record *);
 enum extract_res rec_handler_rpdo(struct record *);
 enum extract_res rec_handler_lmclist(struct record *);
+enum extract_res rec_handler_xz(struct record *);
 enum extract_res rec_handler_archive(struct record *);
 enum extract_res rec_handler_archive_part(struct record *);
 enum extract_res rec_handler_raw(struct record *);
 char *rec_header_ascii(struct record *);
 void rec_out_filename(struct record *, const char *, size_t, const char *);
 void rec_write(struct record *, unsigned int, uint8_t *, size_t);
-void rec_free(struct record *);
-uint8_t *z_inflate(uint8_t *, size_t, size_t *);
-void sigchld_binwalk(int);
+void rec_write_file(struct record *, unsigned int, uint8_t *, size_t);
+int rec_out_path(struct record *, unsigned int, char *);
+int rec_open(struct record *, unsigned int, char *);
+int rec_after(struct record *, struct record *);
+int output_claim(struct record *, char *, int *);
+struct record *output_owner(char *);
+void outputs_free(void);
+int file_copy(int, int, off_t, size_t);
+int rec_copy(struct record *, int, uint8_t *, size_t);
+void writer_run(void);
+void writer_wait(void);
+void writer_queue(struct record *, int, uint8_t *, size_t, char *);
+void writer_wait_rec(struct record *);
+void *writer_serve(void *);
+void writer_prep(struct write_req *);
+int writer_complete(struct write_req *, int);
+int file_write(int, uint8_t *, size_t);
+int file_writev(int, struct iovec *, int);
+void cache_key(char *, uint8_t *, size_t, char *);
+uint8_t *cache_get(char *, int, size_t *);
+void cache_put(char *, uint8_t *, size_t, int);
+int cache_get_binwalk(char *, char *, char *);
+void cache_put_binwalk(char *, char *, char *);
+int cache_entry_cmp(const void *, const void *);
+void cache_evict(void);
+int tree_copy(char *, char *, int);
+void tree_remove(char *);
+off_t tree_size(char *);
+char *dedup_find(char *);
+void dedup_add(char *, char *, struct record *);
+void dedup_free(void);
+uint32_t dedup_hash(char *);
+int dedup_link(struct record *, char *, int, char *);
+uint8_t *dedup_get(struct record *, char *, int *, char *, size_t *);
+void manifest_open(void);
+void manifest_close(void);
+void manifest_apply(char *);
+void manifest_log(char *, ...);
+struct manifest_source *manifest_source_get(char *, int);
+struct manifest_output *manifest_output_get(char *, int);
+unsigned int manifest_check(struct record **, unsigned int);
+int manifest_seqs_shared(char *, char *);
+void manifest_done(struct record **, unsigned int);
+void manifest_output_add(struct record *, char *, uint8_t *, size_t, uint32_t);
+int manifest_unchanged(char *, size_t, uint32_t);
+int manifest_binwalk_done(char *, char *);
+char *manifest_relpath(char *);
+struct record *rec_root(struct record *);
+void crc_init(void);
+uint32_t crc_update(unsigned int, uint32_t, const uint8_t *, size_t);
+uint32_t crc_reflected(uint32_t, const uint8_t *, size_t);
+uint32_t crc_castagnoli_table(uint32_t, const uint8_t *, size_t);
+uint32_t crc_msb(uint32_t, const uint8_t *, size_t);
+int crc_walk(struct record *, uint8_t *, size_t, unsigned int, int (*)(struct record *, uint8_t *, size_t, size_t));
+int crc_sample(struct record *, uint8_t *, size_t, size_t);
+int crc_check(struct record *, uint8_t *, size_t, size_t);
+void crc_discover(struct record **, unsigned int);
+int crc_verify(struct record **, unsigned int);
+uint32_t crc_castagnoli_sse42(uint32_t, const uint8_t *, size_t);
+uint32_t crc_reflected_pclmul(uint32_t, const uint8_t *, size_t);
+void rec_release(struct record *);
+void *arena_alloc(size_t);
+char *arena_strdup(const char *);
+struct record *arena_rec(void);
+struct arena_chunk *arena_chunk_new(struct arena_chunk *, size_t);
+void arena_merge(struct arena *, struct arena *);
+void arena_free(struct arena *);
+int rec_cmp_tree(const void *, const void *);
+void index_write(char *, struct record **, unsigned int, char *);
+void index_add(struct index_build *, struct record *, uint32_t, uint32_t);
+uint32_t index_string(struct index_build *, const char *, size_t);
+int index_query(char *, char *, int);
+int index_valid(struct index_map *);
+uint8_t *index_content(struct index_map *, uint32_t, size_t *);
+uint8_t *index_decode(struct index_map *, uint32_t, size_t *);
+uint8_t *index_bytes(struct index_map *, uint32_t);
+void reassembly_add(struct record *);
+void reassembly_link(size_t);
+uint32_t reassembly_hash(char *);
+void reassembly_run(struct record *);
+void binwalk_add(struct record *);
+void binwalk_run(void);
+void *binwalk_serve(void *);
+void binwalk_wait(void);
+void binwalk_wake(void);
+void binwalk_start(struct binwalk_job *, char *);
+void binwalk_key(struct binwalk_job *, char *);
+struct binwalk_job *binwalk_orig(struct binwalk_job *, size_t, struct binwalk_job *);
+void binwalk_dedup(struct binwalk_job *, struct binwalk_job *);
+int binwalk_job_cmp_tree(const void *, const void *);
+void binwalk_event(struct binwalk_job *, double);
+double timespec_elapsed(struct timespec *, struct timespec *);
+void sched_init(void);
+void sched_wait(void);
+void sched_files(struct record **, unsigned int, void (*)(struct record *));
+void sched_reassemble(size_t, size_t);
+void sched_push(void (*)(struct record *), struct record *);
+int sched_take(struct task *);
+void *sched_worker(void *);
+void task_extract(struct record *);
+void task_reassemble(struct record *);
+void task_verify(struct record *);
+void deque_push(struct deque *, struct task *);
+int deque_pop(struct deque *, struct task *);
+int deque_steal(struct deque *, struct task *);
+void stats_add(struct stats *, struct stats *);
+void package_add(char *, char *);
+int package_cmp(const void *, const void *);
+int package_named(unsigned int, char *);
+void packages_walk(int, char *, char *);
+void package_scan(struct package *);
+struct record *package_source(struct package *, char *, char *, uint8_t *, size_t);
+size_t container_ext(char *);
+void container_scan(struct package *, int);
+void container_tar(struct package *);
+void container_cpio(struct package *);
+void container_member(struct package *, char *, uint8_t *, size_t, size_t);
+uint64_t tar_number(const char *, size_t);
+int tar_valid(struct header_tar *);
+void *packages_scan_worker(void *);
+void packages_scan(void);
+void packages_prepare(void);
+void packages_total(void);
+void packages_free(void);
+void summary_print(struct stats *, unsigned int, unsigned int, size_t);
+void summary_event(struct stats *, unsigned int, unsigned int, size_t, char *);
+void prof_begin(void);
+unsigned int prof_bucket(uint64_t);
+void prof_end(enum prof_slot, uint64_t, uint64_t);
+uint64_t prof_clock(clockid_t);
+enum prof_slot prof_handler(enum extract_res (*)(struct record *));
+enum prof_slot prof_carver(struct carver *);
+char *prof_name(enum prof_slot, char *, size_t);
+void prof_report(struct stats *, double);
+void prof_json(struct stats *, double, char *);
+struct logbuf *logbuf_new(void);
+void logbuf_print(struct logbuf *, FILE *);
+void logbuf_free(struct logbuf *);
+FILE *logout(void);
+uint8_t *z_inflate(uint8_t *, size_t, size_t, int, int, size_t *, size_t *);
+uint8_t *z_inflate_stream(uint8_t *, size_t, size_t, int, int, size_t *, size_t *);
+uint8_t *xz_decode(uint8_t *, size_t, int, int, size_t *, size_t *);
+uint8_t *xz_decode_stream(uint8_t *, size_t, int, int, size_t *, size_t *);
+unsigned int jobs_share(void);
+void carve_init(void);
+int carve(struct record *);
+uint8_t *carve_next_bytes(uint8_t *, uint8_t *);
+uint8_t *carve_next_ssse3(uint8_t *, uint8_t *);
+struct record *carve_add(struct record *, struct carver *, uint8_t *, size_t, uint8_t *, size_t, const char *, size_t);
+void carve_out_filename(struct record *);
+size_t carve_probe_zlib(uint8_t *, size_t, uint8_t **, size_t *);
+size_t carve_probe_xz(uint8_t *, size_t, uint8_t **, size_t *);
+size_t carve_probe_lzma(uint8_t *, size_t, uint8_t **, size_t *);
+size_t carve_probe_uimage(uint8_t *, size_t, uint8_t **, size_t *);
+size_t carve_probe_cpio(uint8_t *, size_t, uint8_t **, size_t *);
+size_t carve_probe_elf(uint8_t *, size_t, uint8_t **, size_t *);
+size_t carve_probe_bit(uint8_t *, size_t, uint8_t **, size_t *);
+enum extract_res rec_handler_carve_decompress(struct record *);
+enum extract_res rec_handler_carve_raw(struct record *);
+enum extract_res rec_handler_uimage(struct record *);
+enum extract_res rec_handler_cpio(struct record *);
+enum extract_res rec_handler_cpio_file(struct record *);
+size_t cpio_hex(char *);
+uint64_t elf_get(uint8_t *, int, int);
+uint8_t *z_grow(uint8_t *, size_t, size_t, int);
+z_stream *z_stream_get(void);
+void z_stream_free(void);
 char *indent(int);
 void xwarnx(char *fmt, ...);
 void info(unsigned int, char *fmt, ...);
-void verb(unsigned int, char *fmt, ...);
+void verb_log(unsigned int, char *fmt, ...);
+void event_begin(struct event *, const char *, struct record *);
+void event_printf(struct event *, const char *, ...);
+void event_str(struct event *, const char *, const char *);
+void event_num(struct event *, const char *, long);
+void event_end(struct event *);
+void event_record(struct record *, struct magic *, enum extract_res);
+void event_file(struct record *, char *, size_t);
+void event_warning(char *);
+void rec_name(struct record *, struct magic *, char *, size_t);
 void *xmalloc(size_t);
 char *ascii(uint8_t *, int);
 
@@ -300,6 +1047,7 @@ static struct magic magics[] = {
 	{ "BLOB",			NULL,	REC_BLOB,		rec_handler_blob },
 	{ "RPDO",			NULL,	REC_RPDO,		rec_handler_rpdo },
 	{ "\x01\0\0\0",		NULL,	REC_RAW,		rec_handler_lmclist },
+	{ "\xfd" "7zX",		NULL,	REC_RAW,		rec_handler_xz },
 	//{ "\x3D\x60\x00\x01",NULL,	REC_NORMAL,		rec_handler_raw },
 	{ "CPR0",			NULL,	REC_ARCHIVE,	rec_handler_archive },
 	//{ "DXPR",			NULL,	REC_NORMAL,		rec_handler_raw },
@@ -307,15 +1055,128 @@ static struct magic magics[] = {
 	{ NULL,				NULL,	REC_RAW,		NULL },
 };
 
+static struct carver carvers[] = {
+	/* name,		signature,			len,	probe,				handler,						ext */
+	{ "uimage",		"\x27\x05\x19\x56",	4,		carve_probe_uimage,	rec_handler_uimage,				"uimage" },
+	{ "cpio",		"070701",			6,		carve_probe_cpio,	rec_handler_cpio,				"cpio" },
+	{ "cpio",		"070702",			6,		carve_probe_cpio,	rec_handler_cpio,				"cpio" },
+	{ "gzip",		"\x1f\x8b\x08",		3,		carve_probe_zlib,	rec_handler_carve_decompress,	NULL },
+	{ "zlib",		"\x78\x9c",			2,		carve_probe_zlib,	rec_handler_carve_decompress,	NULL },
+	{ "zlib",		"\x78\xda",			2,		carve_probe_zlib,	rec_handler_carve_decompress,	NULL },
+	{ "zlib",		"\x78\x01",			2,		carve_probe_zlib,	rec_handler_carve_decompress,	NULL },
+	{ "zlib",		"\x78\x5e",			2,		carve_probe_zlib,	rec_handler_carve_decompress,	NULL },
+	{ "xz",			"\xfd" "7zXZ\0",		6,		carve_probe_xz,		rec_handler_carve_decompress,	NULL },
+	{ "elf",		"\x7f" "ELF",			4,		carve_probe_elf,	rec_handler_carve_raw,			"elf" },
+	{ "bitstream",	"\x00\x09\x0f\xf0\x0f\xf0\x0f\xf0\x0f\xf0\x00\x00\x01", 13, carve_probe_bit, rec_handler_carve_raw, "bit" },
+	/* recognised only, records containing them still go through binwalk */
+	{ "squashfs",	"hsqs",				4,		NULL,				NULL,							NULL },
+	{ "squashfs",	"sqsh",				4,		NULL,				NULL,							NULL },
+	{ "cramfs",		"\x45\x3d\xcd\x28",	4,		NULL,				NULL,							NULL },
+	{ "ubi",		"UBI#",				4,		NULL,				NULL,							NULL },
+	{ "zip",		"PK\x03\x04",			4,		NULL,				NULL,							NULL },
+	{ "bzip2",		"BZh91AY&SY",		10,		NULL,				NULL,							NULL },
+	{ "lz4",		"\x04\x22\x4d\x18",	4,		NULL,				NULL,							NULL },
+	{ "zstd",		"\x28\xb5\x2f\xfd",	4,		NULL,				NULL,							NULL },
+	{ NULL,			NULL,				0,		NULL,				NULL,							NULL },
+};
+
+/* formats not found by signature, but inside other carved formats */
+static struct carver carver_lzma = { "lzma", NULL, 0, carve_probe_lzma, rec_handler_carve_decompress, NULL };
+static struct carver carver_cpio_file = { "cpio file", NULL, 0, NULL, rec_handler_cpio_file, NULL };
+
+/* first two bytes of carvers signatures, to skip most positions with a single lookup */
+static uint8_t carve_prefix[65536];
+#ifdef CARVE_SSSE3
+/*
+ * nibbles of the two first bytes of signatures, each signature is assigned one of 8 buckets.
+ * a position is a candidate when the 4 nibbles lookups have a bucket in common, checked 16 positions at a time.
+ */
+static uint8_t carve_nibbles[4][16] __attribute__((aligned(16)));
+#endif
+static uint8_t *(*carve_next)(uint8_t *, uint8_t *) = carve_next_bytes;
+
+/* names usable in the magic file */
+static struct {
+	char *name;
+	enum extract_res (*handler)(struct record *);
+} handler_names[] = {
+	{ "xplf",			rec_handler_xplf },
+	{ "zfj",			rec_handler_zfj },
+	{ "raw",			rec_handler_raw },
+	{ "decapsulate",	rec_handler_decapsulate },
+	{ "archive_part",	rec_handler_archive_part },
+	{ "ucf",			rec_handler_ucf },
+	{ "met",			rec_handler_met },
+	{ "archive",		rec_handler_archive },
+	{ "blob",			rec_handler_blob },
+	{ "rpdo",			rec_handler_rpdo },
+	{ "lmclist",		rec_handler_lmclist },
+	{ "xz",				rec_handler_xz },
+	{ NULL,				NULL },
+};
+
+static char *extract_res_names[] = { "no_handler", "not_implemented", "depth_max", "decompression_failed",
+	"done", "parts", "parts_dump", "binwalk" };
+
+static char *index_comp_names[] = { "raw", "archive part", "xz", "rpdo", "carved" };
+
+static struct crc_algo crc_algos[CRC_ALGOS] = {
+	{ "crc32",			CRC_REFLECTED,	0xffffffff,	0xffffffff },
+	{ "crc32/jamcrc",	CRC_REFLECTED,	0xffffffff,	0 },
+	{ "crc32c",			CRC_CASTAGNOLI,	0xffffffff,	0xffffffff },
+	{ "crc32/bzip2",	CRC_MSB,		0xffffffff,	0xffffffff },
+	{ "crc32/mpeg-2",	CRC_MSB,		0xffffffff,	0 },
+	{ "crc32/posix",	CRC_MSB,		0,			0xffffffff },
+	{ "adler32",		CRC_ADLER,		1,			0 },
+};
+
+/* range of the record covered by a CRC: the whole record, or the content after the offsets table, up to the CRCs */
+static char *crc_coverage_names[CRC_COVERAGES] = { "record", "content", "record and first crc" };
+
+static struct {
+	char *name;
+	enum rec_type rec;
+} rec_type_names[] = {
+	{ "raw",			REC_RAW },
+	{ "normal",			REC_NORMAL },
+	{ "archive",		REC_ARCHIVE },
+	{ "archive_part",	REC_ARCHIVE_PART },
+	{ "xplf",			REC_XPLF },
+	{ "blob",			REC_BLOB },
+	{ "rpdo",			REC_RPDO },
+	{ "vep",			REC_VEP },
+	{ NULL,				0 },
+};
+
 __attribute__((__noreturn__)) void
 usageexit(void)
 {
-	printf("usage: ericstract [-Elv] [-o <directory>] <upgrade_directory>\n");
+	printf("usage: ericstract [-cDElRrVv] [-b <jobs>] [-C <cache_directory>] [-e <events_file>] [-i <index_file>] [-j <jobs>] [-M <megabytes>] [-m <magic_file>] [-o <directory>] [-t <seconds>] [--profile[=<json_file>]] [--sync-writes] <upgrade_directory>...\n");
+	printf("       ericstract -i <index_file> -q <name> | -x <name>\n");
 	printf("extractor for Upgrade Packages in OMT format\n");
+	printf("several upgrade directories are extracted together, each to a subdirectory of the output directory\n");
+	printf("an upgrade directory can also be a tar or cpio file of the Upgrade Files, possibly compressed with gzip or xz\n");
+	printf("-b  number of parallel binwalk processes, default half the processors plus one\n");
+	printf("-c  extract known formats found in unknown records, run binwalk only on the rest\n");
+	printf("-C  cache decompressed content and binwalk results in this directory, to reuse them in later runs\n");
+	printf("-D  write identical content once, as reflinks or hardlinks, and run binwalk once on it\n");
 	printf("-E  do not run binwalk to finish extraction\n");
+	printf("-e  write record, file, binwalk and warning events to this file as NDJSON\n");
+	printf("-i  write an index of the record tree to this file, or read it with -q and -x\n");
+	printf("-j  number of parallel extraction jobs, default 1\n");
+	printf("-M  maximum cache size in MB, least recently used entries are removed first, default %d\n", CACHE_SIZE_MAX);
+	printf("-m  load additional record types from file\n");
 	printf("-o  output directory\n");
+	printf("-q  list the records of the index which name or output file name contains name\n");
 	printf("-l  only list content, no extraction\n");
+	printf("-R  extract every directory holding files, and every tar or cpio file, under the upgrade directories\n");
+	printf("-r  keep a manifest in the output directory, skip unchanged files and resume interrupted extractions\n");
+	printf("-t  binwalk timeout per file in seconds, 0 for none, default %d\n", BINWALK_TIMEOUT);
+	printf("-V, --verify  find the algorithm of the records CRCs and verify them, without extracting\n");
+	printf("--profile[=<json_file>]  print where time went per function, handler and carver, and write it as JSON\n");
+	printf("--sync-writes  write output files from the extraction jobs, without the io_uring writer\n");
 	printf("-v  verbose logging\n");
+	printf("-x  like -q, and write the decoded content of the first record found to stdout\n");
 	exit(1);
 }
 
@@ -323,248 +1184,1055 @@ int
 main(int argc, char **argv)
 {
 	char *upgrade_dir, *extract_dir_base = NULL;
-	DIR *dir;
 	struct stat fstat;
-	struct dirent *de;
 	struct record *rec;
-	struct record *records_root[REC_CHILD_MAX];
-	unsigned int source_files = 0, skipped_files = 0, n;
-	struct header_rec *h;
-	uint8_t *ptr;
-	int ch;
+	struct record **records_root = NULL;
+	struct package *pkg;
+	unsigned int source_files = 0, skipped_files = 0, roots, n;
+	size_t reassembled, n2;
+	int ch, res, fd;
+	struct timespec start, end;
+	static struct option long_options[] = {
+		{ "verify",		no_argument,		NULL,	'V' },
+		{ "profile",	optional_argument,	NULL,	'P' },
+		{ "sync-writes",	no_argument,	NULL,	'S' },
+		{ NULL,			0,					NULL,	0 },
+	};
 
 	bzero(&conf, sizeof(conf));
-	bzero(&stats, sizeof(stats));
+	memset(indent_spaces, ' ', sizeof(indent_spaces) - 1);
+	bzero(&stats_total, sizeof(stats_total));
 	bzero(&reassembly, sizeof(reassembly));
+	conf.jobs = 1;
+	conf.binwalk_timeout = BINWALK_TIMEOUT;
+	conf.cache_max = (off_t)CACHE_SIZE_MAX << 20;
 
-	while ((ch = getopt(argc, argv, "Eo:lv")) != -1) {
+	while ((ch = getopt_long(argc, argv, "b:cC:DEe:i:j:M:m:o:lq:Rrt:Vvx:", long_options, NULL)) != -1) {
 		switch (ch) {
+			case 'b':
+				conf.binwalk_jobs = atoi(optarg);
+				if (conf.binwalk_jobs < 1)
+					usageexit();
+				break;
+			case 'c':
+				conf.carve = 1;
+				break;
+			case 'C':
+				conf.cache_dir = optarg;
+				break;
+			case 'D':
+				conf.dedup = 1;
+				break;
 			case 'E':
 				conf.no_binwalk = 1;
 				break;
+			case 'e':
+				conf.events = fopen(optarg, "w");
+				if (!conf.events)
+					err(1, "could not open events file %s", optarg);
+				setvbuf(conf.events, NULL, _IOFBF, 65536);
+				break;
+			case 'i':
+				conf.index_path = optarg;
+				break;
+			case 'j':
+				conf.jobs = atoi(optarg);
+				if (conf.jobs < 1)
+					usageexit();
+				break;
+			case 'M':
+				conf.cache_max = (off_t)atoi(optarg) << 20;
+				break;
+			case 'm':
+				conf.magic_file = optarg;
+				break;
 			case 'o':
 				extract_dir_base = optarg;
 				break;
 			case 'l':
 				conf.only_list = 1;
 				break;
+			case 'q':
+				conf.query = optarg;
+				break;
+			case 'R':
+				conf.recursive = 1;
+				break;
+			case 'r':
+				conf.resume = 1;
+				break;
+			case 't':
+				conf.binwalk_timeout = atoi(optarg);
+				break;
+			case 'V':
+				conf.verify = 1;
+				break;
+			case 'P':
+				conf.profile = 1;
+				conf.profile_json = optarg;
+				break;
+			case 'S':
+				conf.sync_writes = 1;
+				break;
 			case 'v':
 				conf.verbose++;
 				break;
+			case 'x':
+				conf.query = optarg;
+				conf.query_dump = 1;
+				break;
 			default:
 				usageexit();
 		}
 	}
 	argc -= optind;
 	argv += optind;
+	if (conf.query) {
+		if (!conf.index_path)
+			usageexit();
+		return index_query(conf.index_path, conf.query, conf.query_dump);
+	}
 	if (argc < 1)
 		usageexit();
+	packages.batch = argc > 1 || conf.recursive;
+	if (packages.batch && (conf.index_path || conf.resume || conf.verify))
+		errx(1, "-i, -r and --verify take a single upgrade directory");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	dispatch_init(conf.magic_file);
+	if (conf.carve)
+		carve_init();
 
-	upgrade_dir = realpath(argv[0], NULL);
-	if (!upgrade_dir)
-		errx(1, "upgrade directory does not exist");
+	for (n=0; n<(unsigned int)argc; n++) {
+		upgrade_dir = realpath(argv[n], NULL);
+		if (!upgrade_dir)
+			errx(1, "upgrade directory does not exist");
+		if (conf.recursive) {
+			if ((fd = open(upgrade_dir, O_RDONLY | O_DIRECTORY)) == -1)
+				errx(1, "could not open directory");
+			packages_walk(fd, upgrade_dir, basename(upgrade_dir));
+			free(upgrade_dir);
+		} else
+			package_add(upgrade_dir, strndup(basename(upgrade_dir), strlen(basename(upgrade_dir)) - container_ext(basename(upgrade_dir))));
+	}
+	if (conf.recursive)
+		qsort(packages.list, packages.count, sizeof(struct package), package_cmp);
 	if (!extract_dir_base)
 		extract_dir_base = "extract";
-	if (stat(extract_dir_base, &fstat) == -1 && !conf.only_list) {
+	if (stat(extract_dir_base, &fstat) == -1 && !conf.only_list && !conf.verify) {
 		mkdir(extract_dir_base, 0700);
 	}
 	conf.extract_dir_base = realpath(extract_dir_base, NULL);
+	if (conf.cache_dir) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s/data", conf.cache_dir);
+		if ((mkdir(conf.cache_dir, 0700) == -1 && errno != EEXIST) || (mkdir(path, 0700) == -1 && errno != EEXIST))
+			err(1, "could not create cache directory %s", path);
+		snprintf(path, sizeof(path), "%s/binwalk", conf.cache_dir);
+		if (mkdir(path, 0700) == -1 && errno != EEXIST)
+			err(1, "could not create cache directory %s", path);
+	}
+	if (conf.resume && !conf.only_list && !conf.verify)
+		manifest_open();
+	if (!conf.only_list && !conf.no_binwalk && !conf.verify)
+		binwalk_run();
+	if (!conf.only_list && !conf.verify && !conf.sync_writes)
+		writer_run();
+
+	packages_scan();
+	packages_prepare();
+	for (n=0; n<packages.count; n++) {
+		source_files += packages.list[n].count;
+		skipped_files += packages.list[n].skipped;
+	}
+	records_root = xmalloc((source_files + 1) * sizeof(struct record *));
+	for (n=0, roots=0; n<packages.count; n++) {
+		for (n2=0; n2<packages.list[n].count; n2++) {
+			rec = packages.list[n].roots[n2];
+			rec->index = roots;
+			records_root[roots++] = rec;
+		}
+	}
+	if (conf.verify) {
+		res = crc_verify(records_root, source_files);
+		packages_total();
+		printf("\nsource upgrade files       : %d\n", source_files);
+		printf("skipped files              : %d\n", skipped_files);
+		printf("verified crcs              : %d\n", stats->crc_checked);
+		printf("crc errors                 : %d\n", stats->crc_errors);
+		printf("warnings                   : %d\n", stats->warnings);
+		printf("upgrade directory          : %s\n", packages.list[0].upgrade_dir);
+		if (conf.profile) {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			prof_report(stats, timespec_elapsed(&start, &end));
+			if (conf.profile_json)
+				prof_json(stats, timespec_elapsed(&start, &end), conf.profile_json);
+		}
+		res = res != 0 || stats->crc_errors;
+		arena_free(&arena_main);
+		free(records_root);
+		packages_free();
+		free(conf.extract_dir_base);
+		return res;
+	}
+	roots = source_files;
+	if (manifest.f)
+		roots = manifest_check(records_root, source_files);
+
+	verb(0, "[+] %s records\n", (conf.only_list) ? "listing" : "extracting");
+	if (conf.jobs > 1) {
+		verb(0, "[+] extracting %d source files using %d jobs\n", roots, conf.jobs);
+		sched_files(records_root, roots, task_extract);
+	} else {
+		for (n=0; n<roots; n++) {
+			rec = records_root[n];
+			stats = &rec->package->stats;
+			if (packages.batch && rec == rec->package->roots[0])
+				info(0, "package %s\n", rec->package->upgrade_dir);
+			info(0, "file %s [%li]\n", rec->filename, rec->size);
+			rec_extract(rec, 1);
+		}
+		stats = &stats_total;
+	}
+
+	/* reassembled archives can contain more archive parts to reassemble, repeat until no new part is found */
+	for (reassembled = 0; reassembled < reassembly.count; reassembled = n) {
+		n = reassembly.count;
+		qsort(reassembly.recs + reassembled, n - reassembled, sizeof(struct record *), rec_cmp_tree);
+		verb(0, "[+] looking for sequences for reassembly in %d records\n", n - reassembled);
+		reassembly_link(reassembled);
+
+		verb(0, "[+] performing reassembly from sequences start\n");
+		if (conf.jobs > 1) {
+			sched_reassemble(reassembled, n);
+		} else {
+			for (n2=reassembled; n2<n; n2++) {
+				if (reassembly.recs[n2]->extract.seq_prev)
+					continue;
+				stats = &rec_root(reassembly.recs[n2])->package->stats;
+				reassembly_run(reassembly.recs[n2]);
+			}
+			stats = &stats_total;
+		}
+	}
+	writer_wait();
+	if (manifest.f)
+		manifest_done(records_root, roots);
+	binwalk_wait();
+	if (conf.cache_dir)
+		cache_evict();
+	manifest_close();
+	if (conf.index_path)
+		index_write(conf.index_path, records_root, roots, packages.list[0].upgrade_dir);
+
+	/* each package has it's summary in batch mode, the last one is the total */
+	for (n=0; packages.batch && n<packages.count; n++) {
+		pkg = &packages.list[n];
+		summary_print(&pkg->stats, pkg->count, pkg->skipped, pkg->binwalk_count);
+		printf("upgrade directory          : %s\n", pkg->upgrade_dir);
+		printf("extract directory          : %s\n", pkg->dir ? pkg->dir : extract_dir_base);
+	}
+	packages_total();
+	summary_print(stats, source_files, skipped_files, binwalk.count);
+	if (packages.batch)
+		printf("packages                   : %u\n", packages.count);
+	else
+		printf("upgrade directory          : %s\n", packages.list[0].upgrade_dir);
+	printf("extract directory          : %s\n", extract_dir_base);
+	if (conf.profile) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		prof_report(stats, timespec_elapsed(&start, &end));
+		if (conf.profile_json)
+			prof_json(stats, timespec_elapsed(&start, &end), conf.profile_json);
+	}
+
+	if (!conf.only_list)
+		verb(0, "[*] done, extracted %d files to %s\n", stats->extract_ok, extract_dir_base);
+	if (conf.events) {
+		for (n=0; packages.batch && n<packages.count; n++) {
+			pkg = &packages.list[n];
+			summary_event(&pkg->stats, pkg->count, pkg->skipped, pkg->binwalk_count, pkg->upgrade_dir);
+		}
+		summary_event(stats, source_files, skipped_files, binwalk.count, NULL);
+		if (fclose(conf.events) == EOF)
+			warn("could not write events file");
+	}
+
+	arena_free(&arena_main);
+	free(records_root);
+	free(reassembly.recs);
+	free(binwalk.recs);
+	dedup_free();
+	outputs_free();
+	packages_free();
+	free(conf.extract_dir_base);
+	z_stream_free();
+	free(dispatch.by_magic);
+	free(dispatch.by_type);
+	free(dispatch.table);
+
+	return 0;
+}
+
+/* add an upgrade directory to extract, name is it's output subdirectory in batch mode */
+void
+package_add(char *upgrade_dir, char *name)
+{
+	struct package *pkg;
+
+	if (packages.count == packages.alloc) {
+		packages.alloc = packages.alloc ? packages.alloc * 2 : 16;
+		packages.list = realloc(packages.list, packages.alloc * sizeof(struct package));
+		if (!packages.list)
+			err(1, "realloc");
+	}
+	pkg = &packages.list[packages.count++];
+	bzero(pkg, sizeof(struct package));
+	pkg->upgrade_dir = upgrade_dir;
+	pkg->name = name;
+}
+
+int
+package_cmp(const void *a, const void *b)
+{
+	const struct package *pa = a, *pb = b;
+
+	return strcmp(pa->upgrade_dir, pb->upgrade_dir);
+}
+
+/* a package among the first count ones is extracted to the subdirectory name */
+int
+package_named(unsigned int count, char *name)
+{
+	unsigned int n;
+
+	for (n=0; n<count; n++) {
+		if (!strcmp(packages.list[n].name, name))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+ * with -R, add the directories under path holding files, and the tar and cpio files, as packages, named after
+ * their path from the upgrade directory given, with '/' replaced by '_'. symbolic links to directories are not followed.
+ */
+void
+packages_walk(int dfd, char *path, char *name)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct statx stx;
+	char sub_path[PATH_MAX], sub_name[NAME_MAX+1];
+	unsigned char type;
+	size_t ext;
+	int fd, files = 0;
+
+	dir = fdopendir(dfd);
+	if (!dir) {
+		xwarnx("could not open directory, skipping: %s\n", path);
+		close(dfd);
+		return;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		type = de->d_type;
+		if (type == DT_UNKNOWN && statx(dfd, de->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) == 0)
+			type = S_ISDIR(stx.stx_mode) ? DT_DIR : DT_REG;
+		ext = (type == DT_REG) ? container_ext(de->d_name) : 0;
+		if (type != DT_DIR && !ext) {
+			files++;
+			continue;
+		}
+		if (snprintf(sub_path, sizeof(sub_path), "%s/%s", path, de->d_name) >= (int)sizeof(sub_path)
+				|| snprintf(sub_name, sizeof(sub_name), "%s_%.*s", name, (int)(strlen(de->d_name) - ext), de->d_name) >= (int)sizeof(sub_name)) {
+			xwarnx("path too long, skipping: %s/%s\n", path, de->d_name);
+			continue;
+		}
+		if (ext) {
+			package_add(strdup(sub_path), strdup(sub_name));
+			continue;
+		}
+		fd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		if (fd == -1) {
+			xwarnx("could not open directory, skipping: %s\n", sub_path);
+			continue;
+		}
+		packages_walk(fd, sub_path, sub_name);
+	}
+	closedir(dir);
+	if (files)
+		package_add(strdup(path), strdup(name));
+}
+
+/* find the Upgrade Files of a package, each one becomes a root record */
+void
+package_scan(struct package *pkg)
+{
+	DIR *dir;
+	struct dirent *de;
+	struct statx stx;
+	struct stat st;
+	struct record *rec;
+	char path[PATH_MAX];
+	uint8_t *ptr;
+	int dfd, f;
 
-	dir = opendir(upgrade_dir);
-	if (!dir)
+	dfd = open(pkg->upgrade_dir, O_RDONLY);
+	if (dfd == -1)
+		errx(1, "could not open directory");
+	if (statx(dfd, "", AT_EMPTY_PATH, STATX_TYPE, &stx) == 0 && S_ISREG(stx.stx_mode)) {
+		container_scan(pkg, dfd);
+		return;
+	}
+	if (!(dir = fdopendir(dfd)))
 		errx(1, "could not open directory");
 
 	verb(0, "[+] reading files in upgrade directory\n");
 
 	while ((de = readdir(dir)) != NULL) {
-		int f;
-		char filepath[PATH_MAX];
-
 		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
 			continue;
-		snprintf(filepath, sizeof(filepath), "%s/%s", upgrade_dir, de->d_name);
-		if (stat(filepath, &fstat) == -1) {
+		if (statx(dfd, de->d_name, 0, STATX_TYPE | STATX_SIZE, &stx) == -1) {
 			xwarnx("could not stat file, skipping: %s\n", de->d_name);
-			skipped_files++;
+			pkg->skipped++;
 			continue;
 		}
-		if ((fstat.st_mode & S_IFMT) != S_IFREG) {
+		if (!S_ISREG(stx.stx_mode)) {
 			info(0, "not a regular file, skipping: %s\n", de->d_name);
-			skipped_files++;
+			pkg->skipped++;
 			continue;
 		}
-		if (fstat.st_size < sizeof(struct header_rec)) {
+		if (stx.stx_size < sizeof(struct header_rec)) {
 			xwarnx("file too small, skipping: %s\n", de->d_name);
-			skipped_files++;
+			pkg->skipped++;
 			continue;
 		}
-		f = open(filepath, O_RDONLY);
-		if (!f) {
+		f = openat(dfd, de->d_name, O_RDONLY);
+		if (f == -1) {
 			xwarnx("could not open file: %s, skipping\n", de->d_name);
-			skipped_files++;
+			pkg->skipped++;
 			continue;
 		}
-		ptr = mmap(0, fstat.st_size, PROT_READ, MAP_PRIVATE, f, 0);
-		if (!ptr) {
+		ptr = mmap(0, stx.stx_size, PROT_READ, MAP_PRIVATE, f, 0);
+		if (ptr == MAP_FAILED || fstat(f, &st) == -1) {
 			xwarnx("could not mmap file, skipping: %s\n", de->d_name);
 			close(f);
-			skipped_files++;
+			pkg->skipped++;
 			continue;
 		}
-		h = (struct header_rec *)ptr;
-		if (strncmp(h->name, de->d_name, 8)) {
-			info(0, "not an Upgrade File, skipping: %s\n", de->d_name);
-			close(f);
-			skipped_files++;
-			continue;
-		}
-		if (be32toh(h->size) != fstat.st_size) {
-			xwarnx("file size (%ld) different from header->size (%u), skipping: %s\n", fstat.st_size, be32toh(h->size), de->d_name);
-			close(f);
-			skipped_files++;
+		/* the mapping stays valid, the file is opened again when slices are copied from it */
+		close(f);
+		rec = package_source(pkg, de->d_name, de->d_name, ptr, stx.stx_size);
+		if (!rec) {
+			munmap(ptr, stx.stx_size);
 			continue;
 		}
-
-		rec = xmalloc(sizeof(struct record));
-		rec->ptr = ptr;
-		rec->filename = strdup(de->d_name);
-		rec->out_filename = strdup(de->d_name);
-		rec->size = fstat.st_size;
-
-		records_root[source_files] = rec;
-		source_files++;
-		close(f);
+		if (snprintf(path, sizeof(path), "%s/%s", pkg->upgrade_dir, de->d_name) < (int)sizeof(path))
+			rec->src_path = arena_strdup(path);
+		rec->src_ino = st.st_ino;
+		rec->src_mtime = st.st_mtim;
 	}
 	closedir(dir);
+}
 
-	verb(0, "[+] %s records\n", (conf.only_list) ? "listing" : "extracting");
-	for (n=0; n<source_files; n++) {
-		rec = records_root[n];
-		info(0, "file %s [%li]\n", rec->filename, rec->size);
-		rec_extract(rec, 1);
+/*
+ * a file of a package, at path in it's upgrade directory or container, becomes a root record if it is an Upgrade
+ * File: the name in it's header is it's file name, and the size in it's header is it's size. NULL when skipped.
+ */
+struct record *
+package_source(struct package *pkg, char *path, char *name, uint8_t *ptr, size_t size)
+{
+	struct header_rec *h = (struct header_rec *)ptr;
+	struct record *rec;
+
+	if (strncmp(h->name, name, 8)) {
+		info(0, "not an Upgrade File, skipping: %s\n", path);
+		pkg->skipped++;
+		return NULL;
+	}
+	if (be32toh(h->size) != size) {
+		xwarnx("file size (%ld) different from header->size (%u), skipping: %s\n", (long)size, be32toh(h->size), path);
+		pkg->skipped++;
+		return NULL;
 	}
 
-	if (reassembly.count > 0) {
-		struct record *rec2;
-		uint8_t *buf;
-		unsigned int n2, buf_size;
+	rec = arena_rec();
+	rec->ptr = ptr;
+	rec->filename = arena_strdup(name);
+	rec->out_filename = arena_strdup(name);
+	rec->size = size;
+	rec->depth = 1;
+	rec->index = pkg->count;
+	rec->package = pkg;
 
-		verb(0, "[+] looking for sequences for reassembly in %d records\n", reassembly.count);
-		for (n=0; n<reassembly.count; n++) {
-			rec = reassembly.recs[n];
-			for (n2=0; n2<reassembly.count; n2++) {
-				if (n2 == n)
-					continue;
-				rec2 = reassembly.recs[n2];
-				if (!strncmp(rec2->parent->h.name, rec->parent->h.name, 7)
-						&& (rec2->parent->h.name[7] == rec->parent->h.name[7] + 1)
-						&& (strcmp((char *)rec2->extract.buf, "XPLF") != 0)) {
-					/* archive name start by the same 7 letters
-					 * and filename 8th letter is +1 (like in B=A+1), mark as next in sequence
-					 * and the content does not start by an XPLF header */
-					verb(1, "file sequence detected: %s is followed by %s\n", rec->parent->h.name, rec2->parent->h.name);
-					rec2->extract.seq_prev = rec;
-					rec->extract.seq_next = rec2;
-					break;
-				}
-			}
-		}
+	if (pkg->count == pkg->alloc) {
+		pkg->alloc = pkg->alloc ? pkg->alloc * 2 : 64;
+		pkg->roots = realloc(pkg->roots, pkg->alloc * sizeof(struct record *));
+		if (!pkg->roots)
+			err(1, "realloc");
+	}
+	pkg->roots[pkg->count++] = rec;
+	return rec;
+}
 
-		verb(0, "[+] performing reassembly from sequences start\n");
-		for (n=0; n<reassembly.count; n++) {
-			rec = reassembly.recs[n];
-			if (rec->extract.seq_prev)
-				continue;
-			if (!rec->extract.seq_next) {
-				xwarnx("reassembly: orphaned archive found: %s\n", rec->parent->h.name);
-			}
-			info(0, "reassembling archive %s\n", rec->parent->h.name);
-			rec->depth = 0;
-			rec_out_filename(rec, rec->parent->h.name, HEADER_ARCHIVE_NAME_LEN, NULL);
-			buf = NULL;
-			buf_size = 0;
-			while (rec) {
-				info(1, "concat %s\n", rec->parent->h.name);
-				buf_size += rec->extract.size;
-				buf = realloc(buf, buf_size);
-				memcpy((buf+buf_size) - rec->extract.size, rec->extract.buf, rec->extract.size);
-				rec = rec->extract.seq_next;
-			}
-			rec = reassembly.recs[n];
-			rec_write(rec, 0, buf, buf_size);
-			rec_extract_new(rec, 0, buf, buf_size, 1);
-			free(buf);
-		}
+/* length of the tar or cpio extension ending a file name, 0 if none */
+size_t
+container_ext(char *name)
+{
+	static const char *exts[] = { ".tar", ".tar.gz", ".tgz", ".tar.xz", ".txz", ".cpio", ".cpio.gz", ".cpio.xz", NULL };
+	size_t len = strlen(name), ext;
+	unsigned int n;
+
+	for (n=0; exts[n]; n++) {
+		ext = strlen(exts[n]);
+		if (len > ext && !strcasecmp(name + len - ext, exts[n]))
+			return ext;
 	}
+	return 0;
+}
 
-	if (!conf.only_list && !conf.no_binwalk && binwalk.count > 0) {
-		int pid, fd;
-		char path[PATH_MAX], log[PATH_MAX];
-		unsigned int tasks = (sysconf(_SC_NPROCESSORS_ONLN) / 2) + 1;
-		sigset_t wait_sigchld;
-
-		signal(SIGCHLD, sigchld_binwalk);
-		sigfillset(&wait_sigchld);
-		sigdelset(&wait_sigchld, SIGCHLD);
-
-		verb(0, "[+] running binwalk on %d files using %d parallel tasks\n", binwalk.count, tasks);
-		for (n=0; n<binwalk.count; n++) {
-			rec = binwalk.recs[n];
-			snprintf(path, sizeof(path), "%s/%s", extract_dir_base, rec->out_filename_full);
-			snprintf(log, sizeof(log), "%s/_%s.binwalk.log", extract_dir_base, rec->out_filename_full);
-			pid = fork();
-			if (pid < 0) {
-				xwarnx("could not fork: %s\n", strerror(errno));
-			} else if (pid > 0) {
-				info(0, "running binwalk on %s\n", path);
-				binwalk.pids[n] = pid;
-				binwalk.running++;
-			} else {
-				chdir(extract_dir_base);
-				fd = open(log, O_WRONLY | O_CREAT, 0600);
-				dup2(fd, 1);
-				dup2(fd, 2);
-				execlp("binwalk", "binwalk", "-eMv", path, NULL);
-				perror("exec binwalk failed:");
-				exit(0);
-			}
-			if (binwalk.running >= tasks)
-				sigsuspend(&wait_sigchld);
+/*
+ * read the Upgrade Files of a package from the tar or cpio file fd, mapped once. members of an uncompressed
+ * container are views into the mapping, a compressed one is decompressed to a memory file first.
+ */
+void
+container_scan(struct package *pkg, int fd)
+{
+	struct stat st;
+	uint8_t *ptr, *out;
+	size_t out_size, used;
+	int out_fd;
+
+	verb(0, "[+] reading files in container\n");
+
+	if (fstat(fd, &st) == -1)
+		err(1, "fstat");
+	if (st.st_size == 0)
+		errx(1, "empty container: %s", pkg->upgrade_dir);
+	ptr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ptr == MAP_FAILED)
+		err(1, "could not mmap container %s", pkg->upgrade_dir);
+	close(fd);
+	pkg->container = ptr;
+	pkg->container_size = st.st_size;
+	pkg->container_ino = st.st_ino;
+	pkg->container_mtime = st.st_mtim;
+
+	if ((st.st_size >= 3 && !memcmp(ptr, "\x1f\x8b\x08", 3)) || (st.st_size >= 6 && !memcmp(ptr, "\xfd" "7zXZ\0", 6))) {
+		if ((out_fd = memfd_create("container", 0)) == -1)
+			err(1, "memfd_create");
+		if (ptr[0] == 0x1f)
+			out = z_inflate(ptr, st.st_size, 0, out_fd, 1, &out_size, &used);
+		else
+			out = xz_decode(ptr, st.st_size, 0, out_fd, &out_size, &used);
+		if (!out || out_size == 0)
+			errx(1, "could not decompress container %s", pkg->upgrade_dir);
+		munmap(ptr, st.st_size);
+		close(out_fd);
+		pkg->container = out;
+		pkg->container_size = out_size;
+		pkg->compressed = 1;
+	}
+
+	if (pkg->container_size >= sizeof(struct header_tar) && tar_valid((struct header_tar *)pkg->container))
+		container_tar(pkg);
+	else if (carve_probe_cpio(pkg->container, pkg->container_size, NULL, NULL))
+		container_cpio(pkg);
+	else
+		errx(1, "not a directory, tar or cpio file: %s", pkg->upgrade_dir);
+}
+/*
+ * index the members of a tar container in one pass: ustar, with GNU long names and pax path records.
+ * directories are not reported, other members that are not regular files are skipped.
+ */
+void
+container_tar(struct package *pkg)
+{
+	struct header_tar *th;
+	uint8_t *buf = pkg->container;
+	char path[PATH_MAX], *rp, *end;
+	size_t size = pkg->container_size, off = 0, member_size, len;
+	int long_name = 0;
+
+	while (off + sizeof(struct header_tar) <= size) {
+		th = (struct header_tar *)(buf + off);
+		if (!tar_valid(th)) {
+			/* two zero blocks end the archive */
+			if (th->name[0] != '\0')
+				xwarnx("invalid tar header at 0x%zx, ignoring the rest of %s\n", off, pkg->upgrade_dir);
+			break;
 		}
-		while (binwalk.running > 0) {
-			info(0, "waiting for %d binwalk instances to finish\n", binwalk.running);
-			sigsuspend(&wait_sigchld); // race condition is possible, we could wait forever if last binwalk process just terminated
+		off += sizeof(struct header_tar);
+		member_size = tar_number(th->size, sizeof(th->size));
+		if (member_size > size - off) {
+			xwarnx("truncated tar member at 0x%zx, ignoring the rest of %s\n", off - sizeof(struct header_tar), pkg->upgrade_dir);
+			break;
 		}
-		for (n=0; n<binwalk.count; n++) {
-			if (binwalk.status[n] != 0) {
-				xwarnx("binwalk exited with error %d on %s\n", binwalk.status[n], binwalk.recs[n]->out_filename_full);
+		switch (th->typeflag) {
+		case 'L':		/* GNU long name of the next member */
+			len = strnlen((char *)buf + off, member_size);
+			snprintf(path, sizeof(path), "%.*s", (int)len, buf + off);
+			long_name = 1;
+			break;
+		case 'x':		/* pax records of the next member, "<length> <key>=<value>\n" */
+			for (rp = (char *)buf + off; rp < (char *)buf + off + member_size; rp += len) {
+				len = strtoul(rp, &end, 10);
+				if (len == 0 || *end != ' ' || rp + len > (char *)buf + off + member_size)
+					break;
+				if (!strncmp(end + 1, "path=", 5) && rp + len - (end + 6) > 0) {
+					snprintf(path, sizeof(path), "%.*s", (int)(rp + len - (end + 6) - 1), end + 6);
+					long_name = 1;
+				}
+			}
+			break;
+		case 'g':		/* pax global records and GNU long link name */
+		case 'K':
+			break;
+		default:
+			if (!long_name) {
+				if (th->prefix[0] != '\0' && !memcmp(th->magic, "ustar", 5))
+					snprintf(path, sizeof(path), "%.*s/%.*s", (int)strnlen(th->prefix, sizeof(th->prefix)), th->prefix,
+							(int)strnlen(th->name, sizeof(th->name)), th->name);
+				else
+					snprintf(path, sizeof(path), "%.*s", (int)strnlen(th->name, sizeof(th->name)), th->name);
 			}
+			long_name = 0;
+			if (th->typeflag == '0' || th->typeflag == '\0' || th->typeflag == '7')
+				container_member(pkg, path, buf + off, member_size, off);
+			else if (th->typeflag != '5') {
+				info(0, "not a regular file, skipping: %s\n", path);
+				pkg->skipped++;
+			}
+		}
+		off += (member_size + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1);
+	}
+}
+
+/* index the members of a cpio newc container in one pass, up to it's trailer */
+void
+container_cpio(struct package *pkg)
+{
+	struct header_cpio *h;
+	uint8_t *buf = pkg->container;
+	char path[PATH_MAX], *name;
+	size_t off = 0, end, namesize, filesize;
+	uint32_t mode;
+
+	end = carve_probe_cpio(buf, pkg->container_size, NULL, NULL);
+	while (off + sizeof(struct header_cpio) <= end) {
+		h = (struct header_cpio *)(buf + off);
+		namesize = cpio_hex(h->namesize);
+		filesize = cpio_hex(h->filesize);
+		mode = cpio_hex(h->mode);
+		name = (char *)(h + 1);
+		off += (sizeof(struct header_cpio) + namesize + 3) & ~3;
+		if (namesize == sizeof("TRAILER!!!") && !memcmp(name, "TRAILER!!!", namesize))
+			break;
+		snprintf(path, sizeof(path), "%.*s", (int)strnlen(name, namesize), name);
+		if ((mode & S_IFMT) == S_IFREG)
+			container_member(pkg, path, buf + off, filesize, off);
+		else if ((mode & S_IFMT) != S_IFDIR) {
+			info(0, "not a regular file, skipping: %s\n", path);
+			pkg->skipped++;
+		}
+		off += (filesize + 3) & ~3;
+	}
+}
+
+/* a regular file of a container at off, a view of it's mapping, checked like the files of an upgrade directory */
+void
+container_member(struct package *pkg, char *path, uint8_t *ptr, size_t size, size_t off)
+{
+	struct record *rec;
+	char *name;
+
+	name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	if (size < sizeof(struct header_rec)) {
+		xwarnx("file too small, skipping: %s\n", path);
+		pkg->skipped++;
+		return;
+	}
+	rec = package_source(pkg, path, name, ptr, size);
+	if (!rec)
+		return;
+	/* members of a compressed container are only in memory */
+	if (!pkg->compressed)
+		rec->src_path = pkg->upgrade_dir;
+	rec->src_off = off;
+	rec->src_ino = pkg->container_ino;
+	rec->src_mtime = pkg->container_mtime;
+	rec->base_off = pkg->compressed ? -1 : (off_t)off;
+}
+
+/* numeric field of a tar header: octal, or base-256 when the high bit of it's first byte is set */
+uint64_t
+tar_number(const char *field, size_t len)
+{
+	uint64_t v = 0;
+	size_t n = 0;
+
+	if ((uint8_t)field[0] & 0x80) {
+		v = field[0] & 0x7f;
+		for (n = 1; n < len; n++)
+			v = (v << 8) | (uint8_t)field[n];
+		return v;
+	}
+	while (n < len && field[n] == ' ')
+		n++;
+	for (; n < len && field[n] >= '0' && field[n] <= '7'; n++)
+		v = (v << 3) | (field[n] - '0');
+	return v;
+}
+
+/* a tar header is valid when it's checksum matches the sum of it's bytes, counting the checksum field as spaces */
+int
+tar_valid(struct header_tar *th)
+{
+	uint8_t *p = (uint8_t *)th;
+	uint64_t sum = 0;
+	size_t n;
+
+	for (n = 0; n < sizeof(struct header_tar); n++)
+		sum += p[n];
+	for (n = 0; n < sizeof(th->chksum); n++)
+		sum += ' ' - (uint8_t)th->chksum[n];
+	return th->chksum[0] != '\0' && sum == tar_number(th->chksum, sizeof(th->chksum));
+}
+
+/* scan thread, taking packages until none is left. arg is it's arena, NULL in the main thread */
+void *
+packages_scan_worker(void *arg)
+{
+	struct package *pkg;
+	unsigned int n;
+
+	if (arg)
+		arena = arg;
+	while ((n = __atomic_fetch_add(&packages.next, 1, __ATOMIC_SEQ_CST)) < packages.count) {
+		pkg = &packages.list[n];
+		stats = &pkg->stats;
+		logbuf = pkg->log;
+		package_scan(pkg);
+	}
+	stats = &stats_total;
+	logbuf = NULL;
+	if (arg) {
+		__atomic_sub_fetch(&packages.scanning, 1, __ATOMIC_SEQ_CST);
+		z_stream_free();
+	}
+	return NULL;
+}
+
+/* scan the packages for Upgrade Files, in parallel with multiple jobs */
+void
+packages_scan(void)
+{
+	pthread_t *threads;
+	struct arena *arenas;
+	unsigned int count = conf.jobs < packages.count ? conf.jobs : packages.count, n;
+
+	if (packages.batch)
+		verb(0, "[+] scanning %u upgrade directories using %u jobs\n", packages.count, count);
+	for (n=0; packages.batch && n<packages.count; n++)
+		packages.list[n].log = logbuf_new();
+	if (count <= 1) {
+		packages_scan_worker(NULL);
+		return;
+	}
+	threads = xmalloc(count * sizeof(pthread_t));
+	arenas = xmalloc(count * sizeof(struct arena));
+	packages.scanning = count;
+	for (n=0; n<count; n++) {
+		if (pthread_create(&threads[n], NULL, packages_scan_worker, &arenas[n]) != 0)
+			err(1, "pthread_create");
+	}
+	for (n=0; n<count; n++) {
+		pthread_join(threads[n], NULL);
+		arena_merge(&arena_main, &arenas[n]);
+	}
+	free(threads);
+	free(arenas);
+}
+
+/*
+ * once scanned, in batch mode: print the logs of the scan, drop the directories found by -R that hold
+ * no Upgrade File, and create the output subdirectories, with a numbered suffix for names already taken.
+ */
+void
+packages_prepare(void)
+{
+	struct package *pkg;
+	char path[PATH_MAX], name[NAME_MAX+1], *base;
+	unsigned int n, n2, kept = 0, suffix;
+
+	if (!packages.batch) {
+		packages.list[0].dir = conf.extract_dir_base ? strdup(conf.extract_dir_base) : NULL;
+		return;
+	}
+	for (n=0; n<packages.count; n++) {
+		pkg = &packages.list[n];
+		if (conf.recursive && pkg->count == 0) {
+			logbuf_free(pkg->log);
+			free(pkg->upgrade_dir);
+			free(pkg->name);
+			continue;
 		}
+		logbuf_print(pkg->log, stdout);
+		pkg->log = NULL;
+		packages.list[kept++] = *pkg;
+	}
+	packages.count = kept;
+	for (n=0; n<packages.count; n++) {
+		pkg = &packages.list[n];
+		for (n2=0; n2<pkg->count; n2++)
+			pkg->roots[n2]->package = pkg;
+		base = *pkg->name ? pkg->name : "root";
+		snprintf(name, sizeof(name), "%s", base);
+		for (suffix = 2; package_named(n, name); suffix++)
+			snprintf(name, sizeof(name), "%.200s-%u", base, suffix);
+		free(pkg->name);
+		pkg->name = strdup(name);
+		if (!conf.extract_dir_base)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", conf.extract_dir_base, pkg->name) >= (int)sizeof(path))
+			errx(1, "output directory path too long: %s/%s", conf.extract_dir_base, pkg->name);
+		pkg->dir = strdup(path);
+		if (!conf.only_list && mkdir(path, 0700) == -1 && errno != EEXIST)
+			err(1, "could not create directory %s", path);
+	}
+}
+
+/* sum the statistics of all packages */
+void
+packages_total(void)
+{
+	unsigned int n;
+
+	for (n=0; n<packages.count; n++)
+		stats_add(&stats_total, &packages.list[n].stats);
+}
+
+void
+packages_free(void)
+{
+	unsigned int n;
+
+	for (n=0; n<packages.count; n++) {
+		if (packages.list[n].container)
+			munmap(packages.list[n].container, packages.list[n].container_size);
+		free(packages.list[n].upgrade_dir);
+		free(packages.list[n].name);
+		free(packages.list[n].dir);
+		free(packages.list[n].roots);
 	}
+	free(packages.list);
+}
 
+/* summary of an extraction, followed by the directories lines printed by the caller */
+void
+summary_print(struct stats *st, unsigned int source_files, unsigned int skipped_files, size_t binwalk_count)
+{
 	printf("\nsource upgrade files       : %d\n", source_files);
 	printf("skipped files              : %d\n", skipped_files);
-	printf("total number of records    : %d\n", stats.records_count);
-	printf("unknown records            : %d\n", stats.unknown_records);
-	printf("records use binwalk        : %lu\n", binwalk.count);
-	printf("maximum depth detected     : %u\n", stats.max_depth);
-	printf("Upgrade File Info (ZFJ)    : %d\n", stats.zfj ? stats.zfj->h.records_count : 0);
-	printf("Upgrade Control File (UCF) : %d\n", stats.ucf ? stats.ucf->h.records_count : 0);
-	printf("Metadata File (MET)        : %d\n", stats.met ? stats.met->h.records_count : 0);
-	printf("extracted files            : %d\n", stats.extract_ok);
-	printf("warnings                   : %d\n", stats.warnings);
-	printf("upgrade directory          : %s\n", upgrade_dir);
-	printf("extract directory          : %s\n", extract_dir_base);
+	if (conf.resume)
+		printf("unchanged files            : %d\n", manifest.unchanged);
+	printf("total number of records    : %d\n", st->records_count);
+	printf("unknown records            : %d\n", st->unknown_records);
+	printf("records use binwalk        : %lu\n", binwalk_count);
+	if (conf.carve)
+		printf("records carved             : %d\n", st->carved);
+	if (conf.cache_dir)
+		printf("cache hits                 : %d\n", st->cache_hits);
+	if (conf.dedup)
+		printf("records deduplicated       : %d\n", st->deduplicated);
+	printf("maximum depth detected     : %u\n", st->max_depth);
+	printf("Upgrade File Info (ZFJ)    : %d\n", st->zfj ? st->zfj->h.records_count : 0);
+	printf("Upgrade Control File (UCF) : %d\n", st->ucf ? st->ucf->h.records_count : 0);
+	printf("Metadata File (MET)        : %d\n", st->met ? st->met->h.records_count : 0);
+	printf("extracted files            : %d\n", st->extract_ok);
+	printf("warnings                   : %d\n", st->warnings);
+}
 
-	if (!conf.only_list)
-		verb(0, "[*] done, extracted %d files to %s\n", stats.extract_ok, extract_dir_base);
+/* summary event, of a package in batch mode or of the whole run when upgrade_dir is NULL */
+void
+summary_event(struct stats *st, unsigned int source_files, unsigned int skipped_files, size_t binwalk_count, char *upgrade_dir)
+{
+	struct event ev;
+
+	event_begin(&ev, "summary", NULL);
+	if (upgrade_dir)
+		event_str(&ev, "upgrade_dir", upgrade_dir);
+	event_num(&ev, "source_files", source_files);
+	event_num(&ev, "skipped_files", skipped_files);
+	event_num(&ev, "records", st->records_count);
+	event_num(&ev, "unknown_records", st->unknown_records);
+	event_num(&ev, "binwalk_records", binwalk_count);
+	event_num(&ev, "max_depth", st->max_depth);
+	event_num(&ev, "extracted_files", st->extract_ok);
+	event_num(&ev, "warnings", st->warnings);
+	event_end(&ev);
+}
+
+/*
+ * dispatch_init - build the lookup tables of extract handlers
+ * entries of the magic file come first, so they can override the built-in ones
+ */
+void
+dispatch_init(char *magic_file)
+{
+	struct magic *m;
+	size_t n;
 
-	for (n=0; n<source_files; n++) {
-		rec_free(records_root[n]);
+	if (magic_file)
+		dispatch_load(magic_file);
+	for (m = magics; m->magic || m->type; m++) {
+		dispatch.table = realloc(dispatch.table, (dispatch.count + 1) * sizeof(struct magic));
+		if (!dispatch.table)
+			err(1, "realloc");
+		dispatch.table[dispatch.count++] = *m;
 	}
-	free(upgrade_dir);
-	free(conf.extract_dir_base);
 
+	dispatch.by_magic = xmalloc(dispatch.count * sizeof(struct magic_key));
+	dispatch.by_type = xmalloc(dispatch.count * sizeof(struct magic_key));
+	for (n = 0; n < dispatch.count; n++) {
+		m = &dispatch.table[n];
+		if (m->magic)
+			dispatch.by_magic[dispatch.by_magic_count++] = (struct magic_key){ be32toh(*(uint32_t *)m->magic), n, m };
+		if (m->type)
+			dispatch.by_type[dispatch.by_type_count++] = (struct magic_key){ be32toh(*(uint32_t *)m->type), n, m };
+	}
+
+	dispatch.by_magic_count = magic_keys_sort(dispatch.by_magic, dispatch.by_magic_count);
+	dispatch.by_type_count = magic_keys_sort(dispatch.by_type, dispatch.by_type_count);
+	verb(0, "[+] %lu record types, %lu magics and %lu types\n", dispatch.count, dispatch.by_magic_count, dispatch.by_type_count);
+}
+
+/*
+ * dispatch_load - read additional record types from a magic file
+ * each line is "<magic|type> <value> <record type> <handler>", value being 4 characters where \xNN can be used
+ */
+void
+dispatch_load(char *magic_file)
+{
+	char line[256], what[16], value[64], rec[32], handler[32];
+	struct magic m;
+	FILE *f;
+	int lineno = 0, n;
+
+	f = fopen(magic_file, "r");
+	if (!f)
+		err(1, "could not open magic file %s", magic_file);
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+			continue;
+		if (sscanf(line, "%15s %63s %31s %31s", what, value, rec, handler) != 4)
+			errx(1, "%s:%d: expected <magic|type> <value> <record type> <handler>", magic_file, lineno);
+		bzero(&m, sizeof(m));
+		if (!strcmp(what, "magic"))
+			m.magic = xmalloc(4);
+		else if (!strcmp(what, "type"))
+			m.type = xmalloc(4);
+		else
+			errx(1, "%s:%d: unknown key %s, expected magic or type", magic_file, lineno, what);
+		if (magic_parse(value, m.magic ? m.magic : m.type) == -1)
+			errx(1, "%s:%d: value must be 4 characters: %s", magic_file, lineno, value);
+		for (n = 0; rec_type_names[n].name && strcmp(rec_type_names[n].name, rec); n++);
+		if (!rec_type_names[n].name)
+			errx(1, "%s:%d: unknown record type %s", magic_file, lineno, rec);
+		m.rec = rec_type_names[n].rec;
+		for (n = 0; handler_names[n].name && strcmp(handler_names[n].name, handler); n++);
+		if (!handler_names[n].name)
+			errx(1, "%s:%d: unknown handler %s", magic_file, lineno, handler);
+		m.handler = handler_names[n].handler;
+
+		dispatch.table = realloc(dispatch.table, (dispatch.count + 1) * sizeof(struct magic));
+		if (!dispatch.table)
+			err(1, "realloc");
+		dispatch.table[dispatch.count++] = m;
+		verb(0, "[+] loaded %s %s: %s %s\n", what, value, rec, handler);
+	}
+	fclose(f);
+}
+
+/* parse a 4 characters magic value, with \xNN escapes */
+int
+magic_parse(char *value, char *out)
+{
+	unsigned int c;
+	int len = 0;
+
+	while (*value) {
+		if (len == 4)
+			return -1;
+		if (value[0] == '\\' && value[1] == 'x') {
+			if (sscanf(value+2, "%2x", &c) != 1 || !isxdigit(value[2]) || !isxdigit(value[3]))
+				return -1;
+			out[len++] = c;
+			value += 4;
+		} else {
+			out[len++] = *value++;
+		}
+	}
+	return len == 4 ? 0 : -1;
+}
+
+/* find the handler of a record from it's magic or type, the first in table order wins */
+struct magic *
+dispatch_lookup(uint32_t magic, uint32_t type)
+{
+	struct magic_key key, *km, *kt;
+
+	key.key = magic;
+	km = bsearch(&key, dispatch.by_magic, dispatch.by_magic_count, sizeof(struct magic_key), magic_key_find);
+	key.key = type;
+	kt = bsearch(&key, dispatch.by_type, dispatch.by_type_count, sizeof(struct magic_key), magic_key_find);
+	if (km && kt)
+		return km->prio < kt->prio ? km->m : kt->m;
+	if (km)
+		return km->m;
+	if (kt)
+		return kt->m;
+	return NULL;
+}
+
+/* sort keys for lookup, keeping only the first entry in table order of each key */
+size_t
+magic_keys_sort(struct magic_key *keys, size_t count)
+{
+	size_t n, kept = 0;
+
+	qsort(keys, count, sizeof(struct magic_key), magic_key_cmp);
+	for (n = 0; n < count; n++) {
+		if (kept > 0 && keys[kept-1].key == keys[n].key)
+			continue;
+		keys[kept++] = keys[n];
+	}
+	return kept;
+}
+
+/* compare magic keys by key, then by position in the table */
+int
+magic_key_cmp(const void *a, const void *b)
+{
+	const struct magic_key *ka = a, *kb = b;
+
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
+	return (ka->prio > kb->prio) - (ka->prio < kb->prio);
+}
+
+/* compare magic keys by key only, for lookup */
+int
+magic_key_find(const void *a, const void *b)
+{
+	const struct magic_key *ka = a, *kb = b;
+
+	if (ka->key != kb->key)
+		return ka->key < kb->key ? -1 : 1;
 	return 0;
 }
 
@@ -582,79 +2250,95 @@ rec_extract(struct record *rec, unsigned int depth)
 	struct header_blob *hb = (struct header_blob *)rec->ptr;
 	uint32_t magic = be32toh(((uint32_t *)rec->ptr)[0]);
 	uint32_t type = be32toh(h->type);
-	struct magic *m;
+	struct magic *m = NULL;
 	uint8_t *part;
 	size_t part_size;
 	unsigned int n;
 
-	stats.records_count++;
+	stats->records_count++;
 	rec->depth = depth;
-	if (depth > stats.max_depth)
-		stats.max_depth = depth;
-	if (depth > REC_DEPTH_MAX)
+	if (depth > stats->max_depth)
+		stats->max_depth = depth;
+	if (depth > REC_DEPTH_MAX) {
+		if (conf.events)
+			event_record(rec, NULL, EXTRACT_FAILED_DEPTH_MAX_REACHED);
 		return EXTRACT_FAILED_DEPTH_MAX_REACHED;
+	}
+	if (conf.profile)
+		prof_begin();
 
-	/* call handler based on magic or type */
-	for (n=0; magics[n].magic || magics[n].type; n++) {
-		m = &magics[n];
-		if ((m->magic && magic == be32toh(*(uint32_t *)m->magic))
-				|| (m->type && type == be32toh(*(uint32_t *)m->type))) {
-			switch (m->rec) {
-			case REC_NORMAL:
-				rec->h.name = h->name;
-				rec->h.size = be32toh(h->size);
-				rec->h.type = be32toh(h->type);
-				rec->h.records_count = be32toh(h->records_count);
-				rec->h.offsets = (uint32_t *)(rec->ptr + sizeof(struct header_rec));
-				info(depth, "record %s [%d, %d %s]\n", rec_header_ascii(rec), rec->h.size, rec->h.records_count, rec->h.records_count == 1 ? "part" : "parts");
-				break;
-			case REC_ARCHIVE:
-				rec->h.size = be32toh(ha->size);
-				rec->h.name = h->name;
-				rec->h.records_count = be32toh(ha->records_count);
-				rec->h.offsets = (uint32_t *)(rec->ptr + sizeof(struct header_archive));
-				info(depth, "archive %s [%d, %d %s]\n", rec->ptr, rec->h.size, rec->h.records_count, rec->h.records_count == 1 ? "part" : "parts");
-				break;
-			case REC_ARCHIVE_PART:
-				rec->h.size = be32toh(hap->content_size);
-				info(depth, "decompress archive part %s [%d]\n", rec_header_ascii(rec), rec->h.size);
-				break;
-			case REC_XPLF:
-				rec->h.size = be32toh(hx->size);
-				rec->h.records_count = be32toh(hx->records_count);
-				rec->h.name = hx->name;
-				rec->h.offsets = (uint32_t *)(rec->ptr + sizeof(struct header_xplf));
-				info(depth, "xplf %s %.*s [%d, %d %s]\n", rec_header_ascii(rec), HEADER_XPLF_NAME_LEN, rec->h.name, rec->h.size, rec->h.records_count, rec->h.records_count == 1 ? "part" : "parts");
-				break;
-			case REC_BLOB:
-				rec->h.name = hb->name;
-				info(depth, "blob %s %.*s\n", rec_header_ascii(rec), HEADER_XPLF_NAME_LEN, rec->h.name);
-				break;
-			case REC_RPDO:
-				rec->h.name = hb->name;
-				info(depth, "decompress rpdo %s\n", rec_header_ascii(rec));
-				break;
-			case REC_RAW:
-				rec->h.size = rec->size;
-				rec->h.records_count = 1;
-				break;
-			case REC_VEP:
-				break;
-			}
-			extract_res = m->handler(rec);
+	/* call handler based on magic or type, the format of carved records is already known */
+	if (rec->carve) {
+		info(depth, "%s at 0x%lx [%lu]\n", rec->carve->name, rec->ptr - rec->parent->content, rec->size);
+		stats->carved++;
+		if (conf.profile)
+			prof_begin();
+		extract_res = rec->carve->handler(rec);
+		if (conf.profile)
+			prof_end(prof_carver(rec->carve), rec->size, rec->content_size);
+	} else if ((m = dispatch_lookup(magic, type))) {
+		rec->rec_type = m->rec;
+		switch (m->rec) {
+		case REC_NORMAL:
+			rec->h.name = h->name;
+			rec->h.size = be32toh(h->size);
+			rec->h.type = be32toh(h->type);
+			rec->h.records_count = be32toh(h->records_count);
+			rec->h.offsets = (uint32_t *)(rec->ptr + sizeof(struct header_rec));
+			info(depth, "record %s [%d, %d %s]\n", rec_header_ascii(rec), rec->h.size, rec->h.records_count, rec->h.records_count == 1 ? "part" : "parts");
+			break;
+		case REC_ARCHIVE:
+			rec->h.size = be32toh(ha->size);
+			rec->h.name = h->name;
+			rec->h.records_count = be32toh(ha->records_count);
+			rec->h.offsets = (uint32_t *)(rec->ptr + sizeof(struct header_archive));
+			info(depth, "archive %s [%d, %d %s]\n", rec->ptr, rec->h.size, rec->h.records_count, rec->h.records_count == 1 ? "part" : "parts");
+			break;
+		case REC_ARCHIVE_PART:
+			rec->h.size = be32toh(hap->content_size);
+			info(depth, "decompress archive part %s [%d]\n", rec_header_ascii(rec), rec->h.size);
+			break;
+		case REC_XPLF:
+			rec->h.size = be32toh(hx->size);
+			rec->h.records_count = be32toh(hx->records_count);
+			rec->h.name = hx->name;
+			rec->h.offsets = (uint32_t *)(rec->ptr + sizeof(struct header_xplf));
+			info(depth, "xplf %s %.*s [%d, %d %s]\n", rec_header_ascii(rec), HEADER_XPLF_NAME_LEN, rec->h.name, rec->h.size, rec->h.records_count, rec->h.records_count == 1 ? "part" : "parts");
+			break;
+		case REC_BLOB:
+			rec->h.name = hb->name;
+			info(depth, "blob %s %.*s\n", rec_header_ascii(rec), HEADER_XPLF_NAME_LEN, rec->h.name);
+			break;
+		case REC_RPDO:
+			rec->h.name = hb->name;
+			info(depth, "decompress rpdo %s\n", rec_header_ascii(rec));
+			break;
+		case REC_RAW:
+			rec->h.size = rec->size;
+			rec->h.records_count = 1;
+			break;
+		case REC_VEP:
 			break;
 		}
+		if (conf.profile)
+			prof_begin();
+		extract_res = m->handler(rec);
+		if (conf.profile)
+			prof_end(prof_handler(m->handler), rec->size, rec->content_size);
 	}
 
+	if (conf.events)
+		event_record(rec, rec->carve ? NULL : m, extract_res);
+
 	switch (extract_res) {
 	case EXTRACT_FAILED_NO_HANDLER:
 		info(depth, "unknown %s [%d], no handler found\n", rec_header_ascii(rec), rec->size);
-		stats.unknown_records++;
-		if (!rec->parent || !rec->parent->out_filename_full) {
+		stats->unknown_records++;
+		/* content of the parent is already in it's output file, or scanned by the carver when only listing */
+		if (!rec->parent || !(rec->parent->out_filename_full || (conf.carve && rec->parent->content))) {
 			rec_out_filename(rec, rec_header_ascii(rec), 0, NULL);
 			rec_write(rec, 0, rec->ptr, rec->size);
-			binwalk.recs[binwalk.count] = rec;
-			binwalk.count++;
+			binwalk_add(rec);
 		}
 		break;
 
@@ -681,7 +2365,12 @@ rec_extract(struct record *rec, unsigned int depth)
 				part_size = rec->h.size - be32toh(rec->h.offsets[n]) - CRC_LEN * 2;
 			else
 				part_size = be32toh(rec->h.offsets[n+1]) - be32toh(rec->h.offsets[n]);
-			if (extract_res == EXTRACT_PARTS_RECORDS)
+			if (extract_res == EXTRACT_PARTS_RECORDS && worker) {
+				/* extract parts as tasks, other workers can steal them */
+				struct record *new = rec_new(rec, n, part, part_size);
+				new->depth = depth+1;
+				sched_push(task_extract, new);
+			} else if (extract_res == EXTRACT_PARTS_RECORDS)
 				rec_extract_new(rec, n, part, part_size, depth+1);
 			else
 				rec_write(rec, n, part, part_size);
@@ -690,31 +2379,65 @@ rec_extract(struct record *rec, unsigned int depth)
 		break;
 
 	case EXTRACT_USE_BINWALK:
-		binwalk.recs[binwalk.count] = rec;
-		binwalk.count++;
+		binwalk_add(rec);
 		break;
 
 	case EXTRACT_DONE:
 		break;
 	}
 
+	if (conf.profile)
+		prof_end(PROF_EXTRACT, rec->size, 0);
 	return extract_res;
 }
 
 enum extract_res
 rec_extract_new(struct record *rec, int part, uint8_t *ptr, size_t size, unsigned int depth)
 {
-	struct record *new;
+	return rec_extract(rec_new(rec, part, ptr, size), depth);
+}
+
+/* allocate a new record and attach it to it's parent */
+struct record *
+rec_new(struct record *rec, int part, uint8_t *ptr, size_t size)
+{
+	struct record *new, **childs;
 
-	new = xmalloc(sizeof(struct record));
+	new = arena_rec();
 	new->ptr = ptr;
 	new->size = size;
 	new->parent = rec;
 	new->part = part;
+	new->index = rec->childs_count;
+	new->round = rec->round;
+	if (rec->src_path && ptr >= rec->ptr && ptr + size <= rec->ptr + rec->size) {
+		new->src_path = rec->src_path;
+		new->src_off = rec->src_off + (ptr - rec->ptr);
+	}
+	/* location of the record for the index, in the decoded content of an ancestor */
+	new->base_off = -1;
+	if (ptr >= rec->ptr && ptr + size <= rec->ptr + rec->size) {
+		new->base = rec->base;
+		if (rec->base_off != -1)
+			new->base_off = rec->base_off + (ptr - rec->ptr);
+	} else if (rec->extract.seq_buf && ptr >= rec->extract.seq_buf && ptr + size <= rec->extract.seq_buf + rec->extract.seq_size) {
+		new->base = rec;
+		new->base_off = ptr - rec->extract.seq_buf;
+	} else if (rec->extract.buf && ptr >= rec->extract.buf && ptr + size <= rec->extract.buf + rec->extract.size) {
+		new->base = rec;
+		new->base_off = ptr - rec->extract.buf;
+	}
+	if (rec->childs_count == rec->childs_alloc) {
+		rec->childs_alloc = rec->childs_alloc ? rec->childs_alloc * 2 : 4;
+		childs = arena_alloc(rec->childs_alloc * sizeof(struct record *));
+		if (rec->childs_count)
+			memcpy(childs, rec->childs, rec->childs_count * sizeof(struct record *));
+		rec->childs = childs;
+	}
 	rec->childs[rec->childs_count] = new;
 	rec->childs_count++;
 
-	return rec_extract(new, depth);
+	return new;
 }
 
 enum extract_res
@@ -726,7 +2449,7 @@ rec_handler_zfj(struct record *rec)
 	info(rec->depth, "zfj %s [%d]\n", rec_header_ascii(rec), rec->h.size);
 	rec_out_filename(rec, "ZFJ_file_info", 0, "txt");
 	rec_write(rec, 0, rec->ptr + 3*sizeof(uint32_t), size - 3*sizeof(uint32_t) - CRC_LEN);
-	stats.zfj = rec;
+	stats->zfj = rec;
 
 	return EXTRACT_DONE;
 }
@@ -735,7 +2458,7 @@ enum extract_res
 rec_handler_ucf(struct record *rec)
 {
 	rec_out_filename(rec, "UCF_upgrade_control_file", 0, "xml");
-	stats.ucf = rec;
+	stats->ucf = rec;
 
 	return EXTRACT_PARTS_DUMP;
 }
@@ -744,7 +2467,7 @@ enum extract_res
 rec_handler_met(struct record *rec)
 {
 	rec_out_filename(rec, "MET_metadata", 0, "xml");
-	stats.met = rec;
+	stats->met = rec;
 
 	return EXTRACT_PARTS_DUMP;
 }
@@ -780,8 +2503,17 @@ rec_handler_blob(struct record *rec)
 {
 	struct header_blob *h = (struct header_blob *)rec->ptr;
 
+	uint8_t *content = rec->ptr + sizeof(struct header_blob);
+	size_t content_size = rec->size - sizeof(struct header_blob);
+
 	rec_out_filename(rec, h->name, HEADER_XPLF_NAME_LEN, "blob");
-	rec_write(rec, 0, rec->ptr + sizeof(struct header_blob), rec->size - sizeof(struct header_blob));
+	rec_write(rec, 0, content, content_size);
+	/* xz content is decoded and parsed here instead of by binwalk */
+	if (content_size >= 6 && !memcmp(content, "\xfd" "7zXZ\0", 6)) {
+		rec_extract_new(rec, -1, content, content_size, rec->depth+1);
+		if (rec->childs[rec->childs_count-1]->extract.buf)
+			return EXTRACT_DONE;
+	}
 
 	return EXTRACT_USE_BINWALK;
 }
@@ -792,7 +2524,7 @@ rec_handler_rpdo(struct record *rec)
 	uint8_t *z_beg = rec->ptr + sizeof(struct header_rpdo);
 	uint8_t *z_end = rec->ptr + rec->size - 4;
 	uint8_t *name_limit = rec->ptr + rec->size - 64;
-	size_t z_len = z_end - z_beg, size;
+	size_t z_len = z_end - z_beg, size, z_used;
 	uint8_t *p, *buf;
 	char *name = NULL;
 
@@ -806,8 +2538,9 @@ rec_handler_rpdo(struct record *rec)
 
 	if (name)
 		rec_out_filename(rec, name, HEADER_XPLF_NAME_LEN, "rpdo");
-	buf = z_inflate(z_beg, z_len, &size);
+	buf = z_inflate(z_beg, z_len, 0, -1, 0, &size, &z_used);
 	if (buf) {
+		verb(rec->depth+1, "RPDO inflated %zu bytes from %zu of %zu compressed bytes\n", size, z_used, z_len);
 		rec_write(rec, 0, buf, size);
 		free(buf);
 	}
@@ -825,6 +2558,64 @@ rec_handler_lmclist(struct record *rec)
 	return EXTRACT_DONE;
 }
 
+/* xz stream, decompressed directly to it's output file and parsed as records */
+enum extract_res
+rec_handler_xz(struct record *rec)
+{
+	char out_filepath[PATH_MAX], key[CACHE_KEY_LEN];
+	size_t size, used;
+	uint8_t *buf = NULL;
+	int fd;
+
+	info(rec->depth, "decompress xz %s [%lu]\n", rec_header_ascii(rec), rec->size);
+	rec_out_filename(rec, "xz", 0, NULL);
+	fd = rec_open(rec, 0, out_filepath);
+	if (conf.cache_dir || conf.dedup) {
+		cache_key("xz", rec->ptr, rec->size, key);
+		used = rec->size;
+	}
+	if (conf.dedup && !rec->shadowed)
+		buf = dedup_get(rec, key, &fd, out_filepath, &size);
+	if (!buf && conf.cache_dir)
+		buf = cache_get(key, fd, &size);
+	if (!buf) {
+		buf = xz_decode(rec->ptr, rec->size, 0, fd, &size, &used);
+		if (!buf) {
+			if (fd != -1)
+				close(fd);
+			return EXTRACT_FAILED_DECOMPRESSION;
+		}
+		if (conf.cache_dir && used == rec->size)
+			cache_put(key, buf, size, fd);
+	}
+	if (conf.dedup && fd != -1 && !rec->shadowed && used == rec->size)
+		dedup_add(key, out_filepath, rec);
+	if (used != rec->size)
+		verb(rec->depth, "xz used %zu of %zu compressed bytes\n", used, rec->size);
+
+	rec->extract.buf = buf;
+	rec->extract.size = size;
+	rec->extract.mapped = (fd != -1 && size > 0);
+	if (fd != -1) {
+		/* the mapping stays valid without it's descriptor */
+		close(fd);
+		info(rec->depth+1, "part %d: writing file %s [%lu]\n", 0, out_filepath, size);
+		if (manifest.f)
+			manifest_output_add(rec, out_filepath, buf, size, crc32_z(0, buf, size));
+		if (conf.events)
+			event_file(rec, out_filepath, size);
+		stats->extract_ok++;
+	}
+	rec->content = buf;
+	rec->content_size = size;
+	if (rec_extract_new(rec, -1, buf, size, rec->depth+1) != EXTRACT_FAILED_NO_HANDLER)
+		return EXTRACT_DONE;
+	if (rec->extract.mapped)
+		madvise(buf, size, MADV_DONTNEED);
+
+	return EXTRACT_USE_BINWALK;
+}
+
 enum extract_res
 rec_handler_archive(struct record *rec)
 {
@@ -834,10 +2625,16 @@ rec_handler_archive(struct record *rec)
 enum extract_res
 rec_handler_archive_part(struct record *rec)
 {
-	size_t uncompressed_size_expected, uncompressed_size_result, z_len;
+	size_t uncompressed_size_expected, uncompressed_size_result, z_len, z_used;
 	struct header_archive_part *h = (struct header_archive_part *)rec->ptr;
 	uint8_t *z_begin, *z_end, *buf;
+	char out_filepath[PATH_MAX], key[CACHE_KEY_LEN];
+	enum extract_res extract_res;
+	int reassembly, fd = -1;
 
+	/* the magic of archive parts is short, it is only trusted in an archive, which gives the name of the part */
+	if (!rec->parent || rec->parent->rec_type != REC_ARCHIVE || !rec->parent->h.name)
+		return EXTRACT_FAILED_NO_HANDLER;
 	z_len = be32toh(h->content_size);
 	uncompressed_size_expected = be32toh(h->decompressed_size);
 	
@@ -845,24 +2642,73 @@ rec_handler_archive_part(struct record *rec)
 	z_end = z_begin + z_len;
 	verb(rec->depth, "uncompress zbeg=%x zbeg+1=%x zend=%x zlen=%zu uncompressed_size_expected=%zu\n", *z_begin, *(z_begin+1), *z_end, z_len, uncompressed_size_expected);
 
-	buf = z_inflate(z_begin, z_len, &uncompressed_size_result);
+	/* parts not waiting for reassembly are decompressed directly to their output file */
+	reassembly = rec->parent->h.name[7] >= 'A' && rec->parent->h.name[7] <= 'Z';
+	if (!reassembly) {
+		rec_out_filename(rec, rec->parent->h.name, HEADER_ARCHIVE_NAME_LEN, NULL);
+		fd = rec_open(rec, 0, out_filepath);
+	}
+
+	buf = NULL;
+	if (conf.cache_dir || conf.dedup) {
+		cache_key("z", z_begin, z_len, key);
+		z_used = z_len;
+	}
+	if (conf.dedup && !rec->shadowed)
+		buf = dedup_get(rec, key, &fd, out_filepath, &uncompressed_size_result);
+	if (!buf && conf.cache_dir)
+		buf = cache_get(key, fd, &uncompressed_size_result);
+	if (!buf) {
+		buf = z_inflate(z_begin, z_len, uncompressed_size_expected, fd, 0, &uncompressed_size_result, &z_used);
+		if (!buf) {
+			if (fd != -1)
+				close(fd);
+			return EXTRACT_FAILED_DECOMPRESSION;
+		}
+		/* only regular streams are cached, so that hits do not hide warnings */
+		if (conf.cache_dir && uncompressed_size_result == uncompressed_size_expected && z_used == z_len)
+			cache_put(key, buf, uncompressed_size_result, fd);
+	}
+	if (conf.dedup && fd != -1 && !rec->shadowed && uncompressed_size_result == uncompressed_size_expected && z_used == z_len)
+		dedup_add(key, out_filepath, rec);
 	if (uncompressed_size_result != uncompressed_size_expected) {
-		xwarnx("uncompressed size %zd != from expected uncompressed size %zd\n", uncompressed_size_result, uncompressed_size_expected);
+		xwarnx("uncompressed size %zu != from expected uncompressed size %zu, %zu of %zu compressed bytes used\n",
+				uncompressed_size_result, uncompressed_size_expected, z_used, z_len);
+	} else if (z_used != z_len) {
+		verb(rec->depth, "uncompress used %zu of %zu compressed bytes\n", z_used, z_len);
 	}
 
 	rec->extract.buf = buf;
 	rec->extract.size = uncompressed_size_result;
+	rec->extract.mapped = (fd != -1 && uncompressed_size_result > 0);
+	if (fd != -1)
+		close(fd);
 	verb(rec->depth, "archive_part head %s\n", ascii(buf, 32));
 
-	if (rec->parent->h.name[7] >= 'A' && rec->parent->h.name[7] <= 'Z') {
+	if (reassembly) {
 		info(rec->depth+1, "storing in reassembly list\n");
-		reassembly.recs[reassembly.count] = rec;
-		reassembly.count++;
+		reassembly_add(rec);
 		return EXTRACT_DONE;
 	} else {
-		rec_out_filename(rec, rec->parent->h.name, HEADER_ARCHIVE_NAME_LEN, NULL);
-		rec_write(rec, 0, rec->extract.buf, rec->extract.size);
-		rec_extract_new(rec, -1, rec->extract.buf, rec->extract.size, rec->depth+1);
+		if (fd != -1) {
+			info(rec->depth+1, "part %d: writing file %s [%lu]\n", 0, out_filepath, rec->extract.size);
+			if (manifest.f)
+				manifest_output_add(rec, out_filepath, rec->extract.buf, rec->extract.size,
+						crc32_z(0, rec->extract.buf, rec->extract.size));
+			if (conf.events)
+				event_file(rec, out_filepath, rec->extract.size);
+			stats->extract_ok++;
+			rec->content = rec->extract.buf;
+			rec->content_size = rec->extract.size;
+		} else
+			rec_write(rec, 0, rec->extract.buf, rec->extract.size);
+		extract_res = rec_extract_new(rec, -1, rec->extract.buf, rec->extract.size, rec->depth+1);
+		if (rec->extract.mapped) {
+			/* content is in the output file, drop it from memory until something reads it again */
+			madvise(rec->extract.buf, rec->extract.size, MADV_DONTNEED);
+		}
+		if (conf.carve && extract_res != EXTRACT_FAILED_NO_HANDLER)
+			return EXTRACT_DONE; /* content was parsed, unknown records in it are carved on their own */
 		return EXTRACT_USE_BINWALK;
 	}
 }
@@ -874,11 +2720,38 @@ rec_handler_raw(struct record *rec)
 	return EXTRACT_PARTS_RECORDS;
 }
 
+/* printable name of a record, as found in it's header. m is the record type if it has one */
+void
+rec_name(struct record *rec, struct magic *m, char *name, size_t size)
+{
+	size_t len;
+
+	if (!rec->parent) {
+		snprintf(name, size, "%s", rec->filename);
+	} else if (rec->carve) {
+		snprintf(name, size, "%s", rec->carve->name);
+	} else if (m && rec->h.name && m->rec != REC_RPDO) {
+		len = (m->rec == REC_XPLF || m->rec == REC_BLOB) ? HEADER_XPLF_NAME_LEN : 8;
+		snprintf(name, size, "%.*s", (int)len, rec->h.name);
+		for (len = strlen(name); len > 0 && name[len-1] == ' '; len--)
+			name[len-1] = '\0';
+	} else if (rec->size >= 24) {
+		snprintf(name, size, "%s", rec_header_ascii(rec));
+	} else if (rec->size >= 4) {
+		snprintf(name, size, "%.32s", ascii(rec->ptr, 4));
+	} else
+		name[0] = '\0';
+	for (len = 0; name[len]; len++) {
+		if (!isprint((uint8_t)name[len]))
+			name[len] = '?';
+	}
+}
+
 /* use some empiric rules to get a printable name from a header's start */
 char *
 rec_header_ascii(struct record *rec)
 {
-	static char buf[255];
+	static __thread char buf[255];
 	char *p = buf;
 	size_t len;
 
@@ -921,217 +2794,4215 @@ rec_header_ascii(struct record *rec)
 void
 rec_write(struct record *rec, unsigned int n, uint8_t *start, size_t size)
 {
-	struct record *rec2;
-	char out_filepath[PATH_MAX], num[4];
-	unsigned int out_filepath_len, len;
-	FILE *f;
+	if (!conf.profile) {
+		rec_write_file(rec, n, start, size);
+		return;
+	}
+	prof_begin();
+	rec_write_file(rec, n, start, size);
+	prof_end(PROF_WRITE, size, conf.only_list ? 0 : size);
+}
 
+void
+rec_write_file(struct record *rec, unsigned int n, uint8_t *start, size_t size)
+{
+	char out_filepath[PATH_MAX], key[CACHE_KEY_LEN], *src;
+	uint32_t crc = 0;
+	int fd, dfd;
+
+	if (n == 0) {
+		rec->content = start;
+		rec->content_size = size;
+	}
 	if (conf.only_list)
 		return;
 
-	/* build file name by concatenating parent records out_filename, separated by "_" */
-	rec2 = rec;
-	out_filepath_len = 0;
-	do {
-		if (rec2->out_filename) {
-			len = strlen(rec2->out_filename);
-			if (out_filepath_len + len + 1 >= sizeof(out_filepath)) {
-				xwarnx("rec_write: path too long: %d + %d\n", out_filepath_len, len);
-				break;
-			}
-			if (out_filepath_len > 0) {
-				memmove(out_filepath+len+1, out_filepath, out_filepath_len+1);
-			}
-			strcpy(out_filepath, rec2->out_filename);
-			if (out_filepath_len > 0) {
-				out_filepath[len] = '_';
-				len++;
-			}
-			out_filepath_len += len;
-			if (rec2->part > 0) {
-				len = snprintf(num, sizeof(num), "%d", rec2->part);
-				if (out_filepath_len > 0)
-					memmove(out_filepath+len+1, out_filepath, out_filepath_len+1);
-				strcpy(out_filepath, num);
-				out_filepath[len] = '-';
-				out_filepath_len += len + 1;
+	if (manifest.f) {
+		crc = crc32_z(0, start, size);
+		rec_out_path(rec, n, out_filepath);
+		if (manifest_unchanged(out_filepath, size, crc) && output_claim(rec, out_filepath, NULL)) {
+			info(rec->depth+1, "part %d: keeping unchanged file %s [%lu]\n", n, out_filepath, size);
+			if (conf.dedup) {
+				cache_key("f", start, size, key);
+				dedup_add(key, out_filepath, rec);
+			}
+			manifest_output_add(rec, out_filepath, start, size, crc);
+			if (conf.events)
+				event_file(rec, out_filepath, size);
+			stats->extract_ok++;
+			return;
+		}
+	}
+
+	fd = rec_open(rec, n, out_filepath);
+	info(rec->depth+1, "part %d: writing file %s [%lu]\n", n, out_filepath, size);
+	if (fd == -1)
+		return;
+	if (rec->shadowed) {
+		close(fd);
+		stats->extract_ok++;
+		return;
+	}
+
+	if (conf.dedup) {
+		cache_key("f", start, size, key);
+		if ((src = dedup_find(key))) {
+			dfd = dedup_link(rec, src, fd, out_filepath);
+			free(src);
+			if (dfd != -1) {
+				close(dfd);
+				if (manifest.f)
+					manifest_output_add(rec, out_filepath, start, size, crc);
+				if (conf.events)
+					event_file(rec, out_filepath, size);
+				stats->deduplicated++;
+				stats->extract_ok++;
+				return;
+			}
+		}
+	}
+
+	if (writer.ring != -1) {
+		writer_queue(rec, fd, start, size, out_filepath);
+		if (conf.dedup)
+			dedup_add(key, out_filepath, rec);
+		if (manifest.f)
+			manifest_output_add(rec, out_filepath, start, size, crc);
+		if (conf.events)
+			event_file(rec, out_filepath, size);
+		return;
+	}
+
+	/* slices of a file are copied by the kernel, anything else is written from memory */
+	if (rec_copy(rec, fd, start, size) == -1) {
+		if (file_write(fd, start, size) == -1) {
+			xwarnx("error writing file %s: %s\n", out_filepath, strerror(errno));
+			stats->extract_errors++;
+			close(fd);
+			return;
+		}
+	}
+	close(fd);
+	if (conf.dedup)
+		dedup_add(key, out_filepath, rec);
+	if (manifest.f)
+		manifest_output_add(rec, out_filepath, start, size, crc);
+	if (conf.events)
+		event_file(rec, out_filepath, size);
+
+	stats->extract_ok++;
+}
+
+/*
+ * copy a slice of src_fd to the start of the empty file out_fd.
+ * on CoW filesystems the slice is cloned when aligned on blocks, which shares the extents with the source file,
+ * otherwise copy_file_range() copies it without going through user space.
+ * returns -1 if nothing could be copied, in which case the caller has to write the data itself.
+ */
+int
+file_copy(int out_fd, int src_fd, off_t off, size_t size)
+{
+	struct file_clone_range clone = { .src_fd = src_fd, .src_offset = off, .src_length = size, .dest_offset = 0 };
+	loff_t in_off = off, out_off = 0;
+	struct stat st;
+	ssize_t len;
+
+	if (fstat(out_fd, &st) == 0 && off % st.st_blksize == 0
+			&& ioctl(out_fd, FICLONERANGE, &clone) == 0)
+		return 0;
+	while (size > 0) {
+		len = copy_file_range(src_fd, &in_off, out_fd, &out_off, size, 0);
+		if (len <= 0) {
+			/* let the caller write the whole slice from memory */
+			if (out_off > 0 && ftruncate(out_fd, 0) == -1)
+				err(1, "ftruncate");
+			return -1;
+		}
+		size -= len;
+	}
+	return 0;
+}
+
+/*
+ * copy the slice start of the source file of rec to the empty file out_fd, as file_copy() does.
+ * the source file is only open during the copy, and only used if it is still the file that was mapped.
+ * returns -1 if nothing was copied.
+ */
+int
+rec_copy(struct record *rec, int out_fd, uint8_t *start, size_t size)
+{
+	struct record *root = rec_root(rec);
+	struct stat st;
+	int fd, res = -1;
+
+	if (!rec->src_path || start < rec->ptr || start + size > rec->ptr + rec->size)
+		return -1;
+	if ((fd = open(rec->src_path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &st) == 0 && st.st_ino == root->src_ino
+			&& st.st_mtim.tv_sec == root->src_mtime.tv_sec && st.st_mtim.tv_nsec == root->src_mtime.tv_nsec)
+		res = file_copy(out_fd, fd, rec->src_off + (start - rec->ptr), size);
+	close(fd);
+	return res;
+}
+
+/* start the output writer, unless io_uring is not available */
+void
+writer_run(void)
+{
+	struct io_uring_params p;
+	struct rlimit rl;
+
+	/* queued files keep their descriptor open until the writer closes them */
+	writer.files_max = WRITER_FILES;
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < writer.files_max)
+		writer.files_max = rl.rlim_cur / 4 > 0 ? rl.rlim_cur / 4 : 1;
+	bzero(&p, sizeof(p));
+	writer.ring = syscall(SYS_io_uring_setup, WRITER_ENTRIES, &p);
+	if (writer.ring == -1) {
+		verb(0, "[+] io_uring not available, writing output files directly: %s\n", strerror(errno));
+		return;
+	}
+	/* IORING_OP_WRITE and IORING_OP_CLOSE came with IORING_FEAT_RW_CUR_POS in linux 5.6 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		verb(0, "[+] io_uring too old, writing output files directly\n");
+		close(writer.ring);
+		writer.ring = -1;
+		return;
+	}
+	writer.sq_map_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	writer.cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (writer.cq_map_size > writer.sq_map_size)
+			writer.sq_map_size = writer.cq_map_size;
+		writer.cq_map_size = 0;
+	}
+	writer.sq_map = mmap(NULL, writer.sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, writer.ring, IORING_OFF_SQ_RING);
+	if (writer.sq_map == MAP_FAILED)
+		err(1, "mmap io_uring");
+	writer.cq_map = writer.sq_map;
+	if (writer.cq_map_size) {
+		writer.cq_map = mmap(NULL, writer.cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, writer.ring, IORING_OFF_CQ_RING);
+		if (writer.cq_map == MAP_FAILED)
+			err(1, "mmap io_uring");
+	}
+	writer.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	writer.sqes = mmap(NULL, writer.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, writer.ring, IORING_OFF_SQES);
+	if (writer.sqes == MAP_FAILED)
+		err(1, "mmap io_uring");
+	writer.sq_tail = (uint32_t *)(writer.sq_map + p.sq_off.tail);
+	writer.sq_mask = (uint32_t *)(writer.sq_map + p.sq_off.ring_mask);
+	writer.sq_array = (uint32_t *)(writer.sq_map + p.sq_off.array);
+	writer.cq_head = (uint32_t *)(writer.cq_map + p.cq_off.head);
+	writer.cq_tail = (uint32_t *)(writer.cq_map + p.cq_off.tail);
+	writer.cq_mask = (uint32_t *)(writer.cq_map + p.cq_off.ring_mask);
+	writer.cqes = (struct io_uring_cqe *)(writer.cq_map + p.cq_off.cqes);
+	if (pthread_create(&writer.thread, NULL, writer_serve, NULL) != 0)
+		err(1, "pthread_create");
+}
+
+/* tell the writer that extraction is done, and wait for the files queued to be written */
+void
+writer_wait(void)
+{
+	unsigned int n;
+
+	if (writer.ring == -1)
+		return;
+	pthread_mutex_lock(&writer.lock);
+	writer.closed = 1;
+	pthread_cond_signal(&writer.wake);
+	pthread_mutex_unlock(&writer.lock);
+	pthread_join(writer.thread, NULL);
+	munmap(writer.sqes, writer.sqes_size);
+	if (writer.cq_map != writer.sq_map)
+		munmap(writer.cq_map, writer.cq_map_size);
+	munmap(writer.sq_map, writer.sq_map_size);
+	close(writer.ring);
+	writer.ring = -1;
+	for (n=0; n<packages.count; n++)
+		stats_add(&packages.list[n].stats, &packages.list[n].writer_stats);
+}
+
+/*
+ * queue the write of start to the new output file fd, and it's close. the content of records stays in memory until
+ * the end of the run and is written from where it is, other buffers are copied. waits while the bytes queued
+ * and not written yet would exceed WRITER_BUDGET, or the files queued and not closed yet would hold too many descriptors.
+ */
+void
+writer_queue(struct record *rec, int fd, uint8_t *start, size_t size, char *path)
+{
+	struct write_req *req;
+
+	pthread_mutex_lock(&writer.lock);
+	while ((writer.inflight > 0 && writer.inflight + size > WRITER_BUDGET) || writer.files >= writer.files_max)
+		pthread_cond_wait(&writer.done, &writer.lock);
+	writer.inflight += size;
+	writer.files++;
+	rec->writes++;
+	pthread_mutex_unlock(&writer.lock);
+
+	req = xmalloc(sizeof(struct write_req));
+	bzero(req, sizeof(struct write_req));
+	req->fd = fd;
+	req->size = size;
+	req->rec = rec;
+	req->path = strdup(path);
+	if (start >= rec->ptr && start + size <= rec->ptr + rec->size) {
+		req->buf = start;
+		req->copy = rec->src_path != NULL;
+	} else if (rec->extract.buf && start >= rec->extract.buf && start + size <= rec->extract.buf + rec->extract.size) {
+		req->buf = start;
+	} else {
+		req->buf = xmalloc(size + 1);
+		memcpy(req->buf, start, size);
+		req->owned = 1;
+	}
+
+	pthread_mutex_lock(&writer.lock);
+	*writer.queue_tail = req;
+	writer.queue_tail = &req->next;
+	pthread_cond_signal(&writer.wake);
+	pthread_mutex_unlock(&writer.lock);
+}
+
+/* wait for the output files of rec to be written, before something reads them */
+void
+writer_wait_rec(struct record *rec)
+{
+	if (writer.ring == -1)
+		return;
+	pthread_mutex_lock(&writer.lock);
+	while (rec->writes > 0)
+		pthread_cond_wait(&writer.done, &writer.lock);
+	pthread_mutex_unlock(&writer.lock);
+}
+
+/*
+ * writer thread: submit the files queued, at most WRITER_ENTRIES at a time, and the next step of those completed.
+ * slices of a file are copied by the kernel here, before their close is submitted.
+ */
+void *
+writer_serve(void *arg)
+{
+	struct write_req *ready = NULL, *req, **tail;
+	struct io_uring_cqe *cqe;
+	unsigned int pending = 0, unsubmitted = 0, head, cq_tail;
+	int res, closed;
+
+	for (;;) {
+		pthread_mutex_lock(&writer.lock);
+		while (!writer.queue && !ready && pending == 0 && !writer.closed)
+			pthread_cond_wait(&writer.wake, &writer.lock);
+		for (tail = &ready; *tail; tail = &(*tail)->next);
+		*tail = writer.queue;
+		writer.queue = NULL;
+		writer.queue_tail = &writer.queue;
+		closed = writer.closed;
+		pthread_mutex_unlock(&writer.lock);
+		if (closed && !ready && pending == 0)
+			break;
+
+		for (; ready && pending < WRITER_ENTRIES; pending++, unsubmitted++) {
+			req = ready;
+			ready = req->next;
+			if (req->copy && rec_copy(req->rec, req->fd, req->buf, req->size) == 0)
+				req->done = req->size;
+			req->copy = 0;
+			writer_prep(req);
+		}
+		res = syscall(SYS_io_uring_enter, writer.ring, unsubmitted, pending > 0 ? 1 : 0, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (res == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			err(1, "io_uring_enter");
+		if (res > 0)
+			unsubmitted -= res;
+
+		head = *writer.cq_head;
+		cq_tail = __atomic_load_n(writer.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != cq_tail; head++) {
+			cqe = &writer.cqes[head & *writer.cq_mask];
+			req = (struct write_req *)(uintptr_t)cqe->user_data;
+			pending--;
+			if (writer_complete(req, cqe->res)) {
+				req->next = ready;
+				ready = req;
+			}
+		}
+		__atomic_store_n(writer.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/* fill a submission queue entry with the next step of req, a write of what remains or it's close */
+void
+writer_prep(struct write_req *req)
+{
+	uint32_t tail = *writer.sq_tail, idx = tail & *writer.sq_mask;
+	struct io_uring_sqe *sqe = &writer.sqes[idx];
+
+	bzero(sqe, sizeof(struct io_uring_sqe));
+	sqe->fd = req->fd;
+	sqe->user_data = (uintptr_t)req;
+	if (req->done < req->size) {
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->addr = (uintptr_t)(req->buf + req->done);
+		sqe->len = (req->size - req->done > WRITER_CHUNK) ? WRITER_CHUNK : req->size - req->done;
+		sqe->off = req->done;
+	} else {
+		sqe->opcode = IORING_OP_CLOSE;
+		req->closing = 1;
+	}
+	writer.sq_array[idx] = idx;
+	__atomic_store_n(writer.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* handle the result of a step of req, returns 1 if it has another one to submit, 0 once it is closed and released */
+int
+writer_complete(struct write_req *req, int res)
+{
+	stats = &rec_root(req->rec)->package->writer_stats;
+	if (!req->closing) {
+		if (res <= 0) {
+			xwarnx("error writing file %s: %s\n", req->path, strerror(res < 0 ? -res : EIO));
+			req->error = 1;
+			req->done = req->size;
+		} else
+			req->done += res;
+		return 1;
+	}
+	if (res < 0 && !req->error) {
+		xwarnx("error writing file %s: %s\n", req->path, strerror(-res));
+		req->error = 1;
+	}
+	if (req->error)
+		stats->extract_errors++;
+	else
+		stats->extract_ok++;
+	if (req->owned)
+		free(req->buf);
+
+	pthread_mutex_lock(&writer.lock);
+	writer.inflight -= req->size;
+	writer.files--;
+	req->rec->writes--;
+	pthread_cond_broadcast(&writer.done);
+	pthread_mutex_unlock(&writer.lock);
+	free(req->path);
+	free(req);
+	return 0;
+}
+
+/* write buffers to a file descriptor, looping on partial writes */
+int
+file_writev(int fd, struct iovec *iov, int count)
+{
+	ssize_t len;
+
+	while (count > 0) {
+		len = writev(fd, iov, count > IOV_MAX ? IOV_MAX : count);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (count > 0 && (size_t)len >= iov->iov_len) {
+			len -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + len;
+			iov->iov_len -= len;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The cache stores, across runs, the decompressed content of archive parts and xz streams in <cache>/data,
+ * and the results of binwalk in <cache>/binwalk, keyed by a hash of their input.
+ * Entries are touched when used, and the least recently used ones are removed at the end of a run
+ * until the cache fits in it's maximum size.
+ */
+
+/* key of some content: crc64, crc32 and size, prefixed by the kind of entry */
+void
+cache_key(char *kind, uint8_t *ptr, size_t size, char *key)
+{
+	snprintf(key, CACHE_KEY_LEN, "%s-%016lx%08lx-%zx", kind, lzma_crc64(ptr, size, 0), crc32_z(0, ptr, size), size);
+}
+
+/*
+ * get decompressed content from the cache, into the output file fd if != -1 or in memory.
+ * returns a buffer like z_inflate() does, or NULL if the content is not cached.
+ */
+uint8_t *
+cache_get(char *key, int fd, size_t *out_size)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint8_t *buf;
+	size_t done = 0;
+	ssize_t len;
+	int cfd;
+
+	snprintf(path, sizeof(path), "%s/data/%s", conf.cache_dir, key);
+	cfd = open(path, O_RDONLY);
+	if (cfd == -1)
+		return NULL;
+	if (fstat(cfd, &st) == -1) {
+		close(cfd);
+		return NULL;
+	}
+	futimens(cfd, NULL);
+	*out_size = st.st_size;
+	if (st.st_size == 0) {
+		close(cfd);
+		return xmalloc(1);
+	}
+	if (fd != -1 && file_copy(fd, cfd, 0, st.st_size) == 0)
+		done = st.st_size;
+	buf = z_grow(NULL, 0, st.st_size, fd);
+	while (done < (size_t)st.st_size) {
+		len = pread(cfd, buf + done, st.st_size - done, done);
+		if (len <= 0) {
+			if (fd != -1)
+				munmap(buf, st.st_size);
+			else
+				free(buf);
+			buf = NULL;
+			break;
+		}
+		done += len;
+	}
+	close(cfd);
+	if (buf)
+		stats->cache_hits++;
+	return buf;
+}
+
+/* store decompressed content, from the output file fd if != -1 or from memory */
+void
+cache_put(char *key, uint8_t *buf, size_t size, int fd)
+{
+	static unsigned int seq = 0;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	int tfd;
+
+	snprintf(path, sizeof(path), "%s/data/%s", conf.cache_dir, key);
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp.%d.%u", path, getpid(), __atomic_add_fetch(&seq, 1, __ATOMIC_SEQ_CST)) >= (int)sizeof(tmp))
+		return;
+	tfd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (tfd == -1) {
+		verb(0, "cache: could not create %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	if ((fd == -1 || file_copy(tfd, fd, 0, size) == -1) && file_write(tfd, buf, size) == -1) {
+		verb(0, "cache: could not write %s: %s\n", tmp, strerror(errno));
+		close(tfd);
+		unlink(tmp);
+		return;
+	}
+	close(tfd);
+	if (rename(tmp, path) == -1)
+		unlink(tmp);
+}
+
+/* restore binwalk results of a file in the extract directory, returns -1 if they are not cached */
+int
+cache_get_binwalk(char *key, char *dir, char *filename)
+{
+	char path[PATH_MAX], from[PATH_MAX], to[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/binwalk/%s", conf.cache_dir, key);
+	if (stat(path, &st) == -1)
+		return -1;
+	utimensat(AT_FDCWD, path, NULL, 0);
+	if (snprintf(from, sizeof(from), "%s/log", path) >= (int)sizeof(from)
+			|| snprintf(to, sizeof(to), "%s/_%s.binwalk.log", dir, filename) >= (int)sizeof(to)
+			|| tree_copy(from, to, 0) == -1)
+		return -1;
+	if (snprintf(from, sizeof(from), "%s/extracted", path) >= (int)sizeof(from)
+			|| snprintf(to, sizeof(to), "%s/_%s.extracted", dir, filename) >= (int)sizeof(to))
+		return -1;
+	if (stat(from, &st) == 0 && tree_copy(from, to, 0) == -1)
+		return -1;
+	stats->cache_hits++;
+	return 0;
+}
+
+/* store binwalk results of a file in the extract directory */
+void
+cache_put_binwalk(char *key, char *dir, char *filename)
+{
+	char path[PATH_MAX], tmp[PATH_MAX], from[PATH_MAX], to[PATH_MAX];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/binwalk/%s", conf.cache_dir, key);
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid()) >= (int)sizeof(tmp) || mkdir(tmp, 0700) == -1)
+		return;
+	if (snprintf(from, sizeof(from), "%s/_%s.binwalk.log", dir, filename) >= (int)sizeof(from)
+			|| snprintf(to, sizeof(to), "%s/log", tmp) >= (int)sizeof(to)
+			|| tree_copy(from, to, 0) == -1)
+		goto fail;
+	if (snprintf(from, sizeof(from), "%s/_%s.extracted", dir, filename) >= (int)sizeof(from)
+			|| snprintf(to, sizeof(to), "%s/extracted", tmp) >= (int)sizeof(to))
+		goto fail;
+	if (lstat(from, &st) == 0 && tree_copy(from, to, 0) == -1)
+		goto fail;
+	if (rename(tmp, path) == 0)
+		return;
+fail:
+	verb(0, "cache: could not store binwalk results of %s\n", filename);
+	tree_remove(tmp);
+}
+
+/* cache entry, for eviction */
+struct cache_entry {
+	char path[PATH_MAX];
+	time_t mtime;
+	off_t size;
+};
+
+int
+cache_entry_cmp(const void *a, const void *b)
+{
+	const struct cache_entry *ea = a, *eb = b;
+
+	return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* remove the least recently used entries until the cache fits in conf.cache_max */
+void
+cache_evict(void)
+{
+	static const char *kinds[] = { "data", "binwalk", NULL };
+	struct cache_entry *entries = NULL;
+	size_t n, count = 0, alloc = 0;
+	off_t total = 0;
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	const char **kind;
+	DIR *d;
+
+	for (kind = kinds; *kind; kind++) {
+		snprintf(path, sizeof(path), "%s/%s", conf.cache_dir, *kind);
+		d = opendir(path);
+		if (!d)
+			continue;
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] == '.' || strstr(de->d_name, ".tmp."))
+				continue;
+			if (count == alloc) {
+				alloc = alloc ? alloc * 2 : 256;
+				entries = realloc(entries, alloc * sizeof(struct cache_entry));
+				if (!entries)
+					err(1, "realloc");
+			}
+			if (snprintf(entries[count].path, PATH_MAX, "%s/%s", path, de->d_name) >= PATH_MAX
+					|| lstat(entries[count].path, &st) == -1)
+				continue;
+			entries[count].mtime = st.st_mtime;
+			entries[count].size = tree_size(entries[count].path);
+			total += entries[count].size;
+			count++;
+		}
+		closedir(d);
+	}
+	qsort(entries, count, sizeof(struct cache_entry), cache_entry_cmp);
+	for (n = 0; n < count && total > conf.cache_max; n++) {
+		verb(0, "cache: evicting %s [%ld]\n", entries[n].path, entries[n].size);
+		tree_remove(entries[n].path);
+		total -= entries[n].size;
+	}
+	verb(0, "[+] cache size %ld bytes in %lu entries\n", total, count - n);
+	free(entries);
+}
+
+/* copy a file or a directory tree, hardlinking files if possible when hardlink is set */
+int
+tree_copy(char *from, char *to, int hardlink)
+{
+	char from_path[PATH_MAX], to_path[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	ssize_t len;
+	int in, out, res = 0;
+	uint8_t *buf;
+	DIR *d;
+
+	if (lstat(from, &st) == -1)
+		return -1;
+	if (S_ISLNK(st.st_mode)) {
+		len = readlink(from, from_path, sizeof(from_path) - 1);
+		if (len == -1)
+			return -1;
+		from_path[len] = '\0';
+		return symlink(from_path, to);
+	}
+	if (S_ISDIR(st.st_mode)) {
+		if (mkdir(to, st.st_mode & 07777) == -1 && errno != EEXIST)
+			return -1;
+		d = opendir(from);
+		if (!d)
+			return -1;
+		while (res == 0 && (de = readdir(d)) != NULL) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			snprintf(from_path, sizeof(from_path), "%s/%s", from, de->d_name);
+			snprintf(to_path, sizeof(to_path), "%s/%s", to, de->d_name);
+			res = tree_copy(from_path, to_path, hardlink);
+		}
+		closedir(d);
+		return res;
+	}
+	if (!S_ISREG(st.st_mode))
+		return 0;
+	unlink(to);
+	if (hardlink && link(from, to) == 0)
+		return 0;
+	in = open(from, O_RDONLY);
+	if (in == -1)
+		return -1;
+	out = open(to, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+	if (out == -1) {
+		close(in);
+		return -1;
+	}
+	if (st.st_size > 0 && file_copy(out, in, 0, st.st_size) == -1) {
+		buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in, 0);
+		if (buf == MAP_FAILED || file_write(out, buf, st.st_size) == -1)
+			res = -1;
+		if (buf != MAP_FAILED)
+			munmap(buf, st.st_size);
+	}
+	close(in);
+	close(out);
+	return res;
+}
+
+/* remove a file or a directory tree */
+void
+tree_remove(char *path)
+{
+	char child[PATH_MAX];
+	struct dirent *de;
+	DIR *d;
+
+	if (unlink(path) == 0 || (errno != EISDIR && errno != EPERM))
+		return;
+	d = opendir(path);
+	if (d) {
+		while ((de = readdir(d)) != NULL) {
+			if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+				continue;
+			snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+			tree_remove(child);
+		}
+		closedir(d);
+	}
+	rmdir(path);
+}
+
+/* disk usage of a file or a directory tree */
+off_t
+tree_size(char *path)
+{
+	char child[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	off_t size;
+	DIR *d;
+
+	if (lstat(path, &st) == -1)
+		return 0;
+	size = st.st_blocks * 512;
+	if (!S_ISDIR(st.st_mode))
+		return size;
+	d = opendir(path);
+	if (!d)
+		return size;
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		snprintf(child, sizeof(child), "%s/%s", path, de->d_name);
+		size += tree_size(child);
+	}
+	closedir(d);
+	return size;
+}
+
+/*
+ * path of a file already written in this run with the content of key, NULL if none. to be freed
+ * the file is ignored once it's path was taken over by a later record.
+ */
+char *
+dedup_find(char *key)
+{
+	struct dedup_entry *e;
+	struct record *rec = NULL;
+	char *path = NULL;
+
+	pthread_mutex_lock(&dedup.lock);
+	if (dedup.buckets) {
+		for (e = dedup.buckets[dedup_hash(key)]; e; e = e->next) {
+			if (!strcmp(e->key, key)) {
+				path = strdup(e->path);
+				rec = e->rec;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&dedup.lock);
+	if (path && output_owner(path) != rec) {
+		free(path);
+		return NULL;
+	}
+	if (rec)
+		writer_wait_rec(rec);
+	return path;
+}
+
+/* remember the file written by rec with the content of key, the first one is kept while rec owns it's path */
+void
+dedup_add(char *key, char *path, struct record *rec)
+{
+	struct dedup_entry *e;
+	uint32_t h = dedup_hash(key);
+
+	pthread_mutex_lock(&dedup.lock);
+	if (!dedup.buckets) {
+		dedup.buckets = calloc(DEDUP_BUCKETS, sizeof(struct dedup_entry *));
+		if (!dedup.buckets)
+			err(1, "calloc");
+	}
+	for (e = dedup.buckets[h]; e; e = e->next) {
+		if (!strcmp(e->key, key))
+			break;
+	}
+	if (e && output_owner(e->path) != e->rec) {
+		free(e->path);
+		e->path = strdup(path);
+		e->rec = rec;
+	} else if (!e) {
+		e = xmalloc(sizeof(struct dedup_entry));
+		strcpy(e->key, key);
+		e->path = strdup(path);
+		e->rec = rec;
+		e->next = dedup.buckets[h];
+		dedup.buckets[h] = e;
+	}
+	pthread_mutex_unlock(&dedup.lock);
+}
+
+void
+dedup_free(void)
+{
+	struct dedup_entry *e, *next;
+	size_t n;
+
+	for (n=0; dedup.buckets && n<DEDUP_BUCKETS; n++) {
+		for (e = dedup.buckets[n]; e; e = next) {
+			next = e->next;
+			free(e->path);
+			free(e);
+		}
+	}
+	free(dedup.buckets);
+}
+
+uint32_t
+dedup_hash(char *key)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *key; key++)
+		hash = (hash ^ (uint8_t)*key) * 16777619u;
+	return hash % DEDUP_BUCKETS;
+}
+
+/*
+ * dedup_link - give the empty output file fd at path the content of src
+ * src is cloned into it on CoW filesystems, otherwise path is replaced by a hardlink to src.
+ * returns a descriptor of the output, which replaces fd, or -1 if nothing was done.
+ */
+int
+dedup_link(struct record *rec, char *src, int fd, char *path)
+{
+	struct output_entry *e;
+	char tmp[PATH_MAX];
+	uint32_t h;
+	int sfd, res;
+
+	sfd = open(src, O_RDONLY);
+	if (sfd == -1)
+		return -1;
+	res = ioctl(fd, FICLONE, sfd);
+	close(sfd);
+	if (res == 0)
+		return fd;
+	if (snprintf(tmp, sizeof(tmp), "%s.dedup", path) >= (int)sizeof(tmp))
+		return -1;
+	/* the path is replaced under the lock of the outputs table, unless a later record took it over meanwhile */
+	h = dedup_hash(path);
+	pthread_mutex_lock(&outputs.locks[h % OUTPUT_LOCKS]);
+	res = -1;
+	for (e = outputs.buckets[h]; e; e = e->next) {
+		if (!strcmp(e->path, path)) {
+			if (e->rec == rec && link(src, tmp) == 0) {
+				res = rename(tmp, path);
+				if (res == -1)
+					unlink(tmp);
+				else if ((res = open(path, O_RDWR)) == -1)
+					err(1, "open %s", path);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&outputs.locks[h % OUTPUT_LOCKS]);
+	if (res == -1)
+		return -1;
+	close(fd);
+	return res;
+}
+
+/*
+ * get decompressed content from an identical output file written earlier in this run.
+ * on success *fd is replaced by the linked output, and the content is returned mapped like z_inflate() does.
+ */
+uint8_t *
+dedup_get(struct record *rec, char *key, int *fd, char *path, size_t *out_size)
+{
+	struct stat st;
+	char *src;
+	int nfd;
+
+	if (*fd == -1 || !(src = dedup_find(key)))
+		return NULL;
+	nfd = dedup_link(rec, src, *fd, path);
+	free(src);
+	if (nfd == -1)
+		return NULL;
+	*fd = nfd;
+	if (fstat(nfd, &st) == -1)
+		err(1, "fstat");
+	stats->deduplicated++;
+	*out_size = st.st_size;
+	if (st.st_size == 0)
+		return xmalloc(1);
+	return z_grow(NULL, 0, st.st_size, nfd);
+}
+
+/*
+ * With -r, the manifest of the extract directory records each source file with it's size, mtime and crc64,
+ * and the files extracted from it with their offset in the source file when copied from it, size and crc32.
+ * It is a journal appended to while extracting, so that an interrupted run can be resumed from it,
+ * and is rewritten compacted at the end of the run. Lines are tab separated:
+ *   S source size mtime crc64		source extracted again, it's previous outputs are dropped
+ *   O source path offset size crc32	file written
+ *   W path							file handed to binwalk
+ *   B path							binwalk went through on the file
+ *   Q source prefix				source contains parts of the multi-part archives named prefix*
+ *   D source						extraction of the source went through
+ * Unchanged sources which outputs are all still there are skipped. Sources containing parts of the same
+ * archives are extracted again together, and unchanged files are not written again.
+ */
+
+/* load the manifest of the extract directory and open it to append to it */
+void
+manifest_open(void)
+{
+	char path[PATH_MAX], *line = NULL;
+	size_t line_size = 0;
+	FILE *f;
+
+	manifest.sources = calloc(DEDUP_BUCKETS, sizeof(struct manifest_source *));
+	manifest.outputs = calloc(DEDUP_BUCKETS, sizeof(struct manifest_output *));
+	if (!manifest.sources || !manifest.outputs)
+		err(1, "calloc");
+	manifest.sources_tail = &manifest.sources_list;
+	manifest.outputs_tail = &manifest.outputs_list;
+	if (snprintf(path, sizeof(path), "%s/.ericstract.manifest", conf.extract_dir_base) >= (int)sizeof(path))
+		errx(1, "manifest path too long");
+	if ((f = fopen(path, "r"))) {
+		while (getline(&line, &line_size, f) != -1)
+			manifest_apply(line);
+		free(line);
+		fclose(f);
+	}
+	manifest.f = fopen(path, "a");
+	if (!manifest.f)
+		err(1, "could not open manifest %s", path);
+	setvbuf(manifest.f, NULL, _IOLBF, 0);
+}
+
+/* rewrite the manifest with only the current state of the sources of this run */
+void
+manifest_close(void)
+{
+	struct manifest_source *src, *src_next;
+	struct manifest_output *out, *out_next;
+	char path[PATH_MAX], tmp[PATH_MAX], *p;
+	FILE *f;
+
+	if (!manifest.f)
+		return;
+	fclose(manifest.f);
+	manifest.f = NULL;
+	snprintf(path, sizeof(path), "%s/.ericstract.manifest", conf.extract_dir_base);
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp) || !(f = fopen(tmp, "w"))) {
+		xwarnx("could not write manifest %s\n", tmp);
+		f = NULL;
+	}
+	if (f) {
+		fprintf(f, "# ericstract manifest\n");
+		for (src = manifest.sources_list; src; src = src->list_next) {
+			if (!src->present)
+				continue;
+			fprintf(f, "S\t%s\t%ld\t%ld.%09ld\t%016lx\n", src->name, src->size, src->mtime.tv_sec, src->mtime.tv_nsec, src->crc);
+			for (p = src->seqs; p && *p; p += 8)
+				fprintf(f, "Q\t%s\t%.7s\n", src->name, p);
+		}
+		for (out = manifest.outputs_list; out; out = out->list_next) {
+			if (!out->src->present || out->gen != out->src->gen)
+				continue;
+			fprintf(f, "O\t%s\t%s\t%ld\t%ld\t%08x\n", out->src->name, out->path, out->offset, out->size, out->crc);
+			if (out->binwalk)
+				fprintf(f, "W\t%s\n", out->path);
+			if (out->binwalk_done)
+				fprintf(f, "B\t%s\n", out->path);
+		}
+		for (src = manifest.sources_list; src; src = src->list_next) {
+			if (src->present && src->done)
+				fprintf(f, "D\t%s\n", src->name);
+		}
+		if (fclose(f) == EOF || rename(tmp, path) == -1)
+			xwarnx("could not write manifest %s\n", path);
+	}
+
+	for (src = manifest.sources_list; src; src = src_next) {
+		src_next = src->list_next;
+		free(src->name);
+		free(src->seqs);
+		free(src);
+	}
+	for (out = manifest.outputs_list; out; out = out_next) {
+		out_next = out->list_next;
+		free(out->path);
+		free(out);
+	}
+	free(manifest.sources);
+	free(manifest.outputs);
+}
+
+/* apply a manifest line to the tables, lines with an unknown format are ignored */
+void
+manifest_apply(char *line)
+{
+	struct manifest_source *src;
+	struct manifest_output *out;
+	char *f[6], *p = line;
+	off_t size;
+	uint32_t crc;
+	int n;
+
+	line[strcspn(line, "\n")] = '\0';
+	for (n=0; n<6 && (f[n] = strsep(&p, "\t")); n++);
+
+	if (n == 5 && !strcmp(f[0], "S")) {
+		src = manifest_source_get(f[1], 1);
+		src->size = strtoll(f[2], NULL, 10);
+		if (sscanf(f[3], "%ld.%ld", &src->mtime.tv_sec, &src->mtime.tv_nsec) != 2)
+			bzero(&src->mtime, sizeof(src->mtime));
+		src->crc = strtoull(f[4], NULL, 16);
+		src->gen++;
+		src->done = 0;
+		free(src->seqs);
+		src->seqs = NULL;
+	} else if (n == 6 && !strcmp(f[0], "O")) {
+		src = manifest_source_get(f[1], 1);
+		out = manifest_output_get(f[2], 1);
+		size = strtoll(f[4], NULL, 10);
+		crc = strtoul(f[5], NULL, 16);
+		if (out->size != size || out->crc != crc)
+			out->binwalk_done = 0;
+		out->src = src;
+		out->gen = src->gen;
+		out->offset = strtoll(f[3], NULL, 10);
+		out->size = size;
+		out->crc = crc;
+		out->binwalk = 0;
+	} else if (n == 2 && !strcmp(f[0], "W")) {
+		if ((out = manifest_output_get(f[1], 0)))
+			out->binwalk = 1;
+	} else if (n == 2 && !strcmp(f[0], "B")) {
+		if ((out = manifest_output_get(f[1], 0)))
+			out->binwalk_done = 1;
+	} else if (n == 3 && !strcmp(f[0], "Q") && strlen(f[2]) == 7) {
+		src = manifest_source_get(f[1], 1);
+		n = src->seqs ? strlen(src->seqs) : 0;
+		for (p = src->seqs; p && *p && strncmp(p, f[2], 7); p += 8);
+		if (!p || !*p) {
+			src->seqs = realloc(src->seqs, n + 9);
+			if (!src->seqs)
+				err(1, "realloc");
+			snprintf(src->seqs + n, 9, "%s\n", f[2]);
+		}
+	} else if (n == 2 && !strcmp(f[0], "D")) {
+		src = manifest_source_get(f[1], 1);
+		src->done = 1;
+	}
+}
+
+/* append a line to the manifest and apply it */
+void
+manifest_log(char *fmt, ...)
+{
+	char line[PATH_MAX * 2 + 128];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line), fmt, ap);
+	va_end(ap);
+	if (len < 0 || len >= (int)sizeof(line))
+		return;
+	pthread_mutex_lock(&manifest.lock);
+	if (manifest.f) {
+		if (fputs(line, manifest.f) == EOF)
+			err(1, "could not write manifest");
+		manifest_apply(line);
+	}
+	pthread_mutex_unlock(&manifest.lock);
+}
+
+struct manifest_source *
+manifest_source_get(char *name, int create)
+{
+	struct manifest_source *src;
+	uint32_t h = dedup_hash(name);
+
+	for (src = manifest.sources[h]; src; src = src->next) {
+		if (!strcmp(src->name, name))
+			return src;
+	}
+	if (!create)
+		return NULL;
+	src = xmalloc(sizeof(struct manifest_source));
+	src->name = strdup(name);
+	src->next = manifest.sources[h];
+	manifest.sources[h] = src;
+	*manifest.sources_tail = src;
+	manifest.sources_tail = &src->list_next;
+	return src;
+}
+
+struct manifest_output *
+manifest_output_get(char *path, int create)
+{
+	struct manifest_output *out;
+	uint32_t h = dedup_hash(path);
+
+	for (out = manifest.outputs[h]; out; out = out->next) {
+		if (!strcmp(out->path, path))
+			return out;
+	}
+	if (!create)
+		return NULL;
+	out = xmalloc(sizeof(struct manifest_output));
+	out->path = strdup(path);
+	out->next = manifest.outputs[h];
+	manifest.outputs[h] = out;
+	*manifest.outputs_tail = out;
+	manifest.outputs_tail = &out->list_next;
+	return out;
+}
+
+/*
+ * manifest_check - find the source files to extract in this run
+ * skipped files are freed and removed from recs, returns the number of files left to extract.
+ */
+unsigned int
+manifest_check(struct record **recs, unsigned int count)
+{
+	struct manifest_source *src, *src2;
+	struct manifest_output *out;
+	char path[PATH_MAX];
+	struct stat st;
+	unsigned int n, kept;
+	int changed, seqs_changed = 0;
+	uint64_t crc;
+
+	for (n=0; n<count; n++) {
+		src = manifest_source_get(recs[n]->filename, 1);
+		src->present = 1;
+		/* the members of a container have it's modification time */
+		src->changed = src->gen == 0 || (off_t)recs[n]->size != src->size
+			|| ((recs[n]->src_mtime.tv_sec != src->mtime.tv_sec || recs[n]->src_mtime.tv_nsec != src->mtime.tv_nsec)
+				&& lzma_crc64(recs[n]->ptr, recs[n]->size, 0) != src->crc);
+		src->mtime = recs[n]->src_mtime;
+		src->extract = src->changed || !src->done;
+		/* parts of a new file, or of a modified one that had some, can belong to any multi-part archive */
+		if (src->changed && (src->gen == 0 || src->seqs))
+			seqs_changed = 1;
+	}
+
+	/* a source is extracted again when one of it's outputs is missing or was not handed to binwalk yet */
+	for (out = manifest.outputs_list; out; out = out->list_next) {
+		src = out->src;
+		if (!src->present || src->extract || out->gen != src->gen)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", conf.extract_dir_base, out->path) >= (int)sizeof(path)
+				|| lstat(path, &st) == -1 || st.st_size != out->size
+				|| (out->binwalk && !out->binwalk_done && !conf.no_binwalk)) {
+			verb(0, "[+] %s from %s is missing, extracting it again\n", out->path, src->name);
+			src->extract = 1;
+		}
+	}
+
+	/* archive parts are reassembled with the other parts of their sequence, extract them together */
+	do {
+		changed = 0;
+		for (src = manifest.sources_list; src; src = src->list_next) {
+			if (!src->present || !src->extract)
+				continue;
+			for (src2 = manifest.sources_list; src2; src2 = src2->list_next) {
+				if (src2->present && !src2->extract && src2->seqs
+						&& (seqs_changed || (src->seqs && manifest_seqs_shared(src->seqs, src2->seqs)))) {
+					src2->extract = 1;
+					changed = 1;
+				}
+			}
+		}
+	} while (changed);
+
+	for (n=0, kept=0; n<count; n++) {
+		src = manifest_source_get(recs[n]->filename, 0);
+		if (!src->extract) {
+			info(0, "file %s unchanged, skipping\n", recs[n]->filename);
+			manifest.unchanged++;
+			rec_release(recs[n]);
+			continue;
+		}
+		crc = lzma_crc64(recs[n]->ptr, recs[n]->size, 0);
+		manifest_log("S\t%s\t%zu\t%ld.%09ld\t%016lx\n", recs[n]->filename, recs[n]->size, src->mtime.tv_sec, src->mtime.tv_nsec, crc);
+		recs[kept++] = recs[n];
+	}
+	return kept;
+}
+
+/* whether two lists of archive prefixes have one in common */
+int
+manifest_seqs_shared(char *a, char *b)
+{
+	char *p;
+
+	for (; *a; a += 8) {
+		for (p = b; *p; p += 8) {
+			if (!strncmp(a, p, 7))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/* mark the extracted source files as done, unless some output could not be written */
+void
+manifest_done(struct record **recs, unsigned int count)
+{
+	unsigned int n;
+
+	if (stats->extract_errors > 0)
+		return;
+	for (n=0; n<count; n++)
+		manifest_log("D\t%s\n", recs[n]->filename);
+}
+
+/* record a file written at path from the content start of rec */
+void
+manifest_output_add(struct record *rec, char *path, uint8_t *start, size_t size, uint32_t crc)
+{
+	struct record *root = rec_root(rec);
+	off_t offset = -1;
+
+	if (rec->src_path && rec->src_path == root->src_path && root->base_off != -1 && start >= rec->ptr && start + size <= rec->ptr + rec->size)
+		offset = rec->src_off + (start - rec->ptr);
+	manifest_log("O\t%s\t%s\t%ld\t%zu\t%08x\n", root->filename, manifest_relpath(path), offset, size, crc);
+}
+
+/* whether the file at path is still the one the manifest records with this size and crc32 */
+int
+manifest_unchanged(char *path, size_t size, uint32_t crc)
+{
+	struct manifest_output *out;
+	struct stat st;
+	int res;
+
+	pthread_mutex_lock(&manifest.lock);
+	out = manifest_output_get(manifest_relpath(path), 0);
+	res = out && out->size == size && out->crc == crc;
+	pthread_mutex_unlock(&manifest.lock);
+	return res && lstat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size == size;
+}
+
+/* whether binwalk went through on the current content of the file path, in the extract directory dir */
+int
+manifest_binwalk_done(char *dir, char *path)
+{
+	struct manifest_output *out;
+	char log[PATH_MAX];
+	struct stat st;
+	int res;
+
+	pthread_mutex_lock(&manifest.lock);
+	out = manifest_output_get(path, 0);
+	res = out && out->binwalk_done;
+	pthread_mutex_unlock(&manifest.lock);
+	if (!res || snprintf(log, sizeof(log), "%s/_%s.binwalk.log", dir, path) >= (int)sizeof(log))
+		return 0;
+	return stat(log, &st) == 0;
+}
+
+/* path of an output file relative to the extract directory */
+char *
+manifest_relpath(char *path)
+{
+	size_t len = strlen(conf.extract_dir_base);
+
+	if (!strncmp(path, conf.extract_dir_base, len) && path[len] == '/')
+		return path + len + 1;
+	return path;
+}
+
+/* write a buffer to a file descriptor, looping on partial writes */
+int
+file_write(int fd, uint8_t *buf, size_t size)
+{
+	ssize_t len;
+
+	while (size > 0) {
+		len = write(fd, buf, size);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += len;
+		size -= len;
+	}
+	return 0;
+}
+
+/*
+ * open the output file of a record part for writing, returns -1 on error.
+ * an existing file is unlinked first, as it could still be mapped by a previous record.
+ * when the path belongs to a record extracted later in a serial run, a memory file is returned instead
+ * and rec->shadowed is set, the content is still decoded to it but does not reach the output directory.
+ */
+int
+rec_open(struct record *rec, unsigned int n, char *out_filepath)
+{
+	int fd;
+
+	if (conf.only_list)
+		return -1;
+
+	rec_out_path(rec, n, out_filepath);
+	if (!output_claim(rec, out_filepath, &fd)) {
+		verb(rec->depth+1, "part %d: %s is written by a later record\n", n, out_filepath);
+		if ((fd = memfd_create("shadowed", 0)) == -1)
+			err(1, "memfd_create");
+		return fd;
+	}
+	if (fd == -1) {
+		xwarnx("error writing file %s: %s\n", out_filepath, strerror(errno));
+		stats->extract_errors++;
+	}
+	return fd;
+}
+
+/*
+ * take the ownership of an output path for rec, unless a record extracted after it in a serial run has it.
+ * returns 0 and sets rec->shadowed in that case. when fd is set, the file is also created there under the lock,
+ * so that the last owner of a path is the last one to create it.
+ */
+int
+output_claim(struct record *rec, char *path, int *fd)
+{
+	struct output_entry *e;
+	uint32_t h = dedup_hash(path);
+
+	pthread_mutex_lock(&outputs.locks[h % OUTPUT_LOCKS]);
+	for (e = outputs.buckets[h]; e && strcmp(e->path, path); e = e->next);
+	if (e && e->rec != rec && rec_after(e->rec, rec)) {
+		pthread_mutex_unlock(&outputs.locks[h % OUTPUT_LOCKS]);
+		rec->shadowed = 1;
+		return 0;
+	}
+	if (!e) {
+		e = xmalloc(sizeof(struct output_entry));
+		e->path = strdup(path);
+		e->next = outputs.buckets[h];
+		outputs.buckets[h] = e;
+	}
+	e->rec = rec;
+	if (fd) {
+		unlink(path);
+		*fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+	}
+	pthread_mutex_unlock(&outputs.locks[h % OUTPUT_LOCKS]);
+	rec->shadowed = 0;
+	return 1;
+}
+
+/*
+ * whether a is extracted after b in a serial run: records of reassembled archives after the others,
+ * round by round, and in tree order within a round, a parent before it's childs.
+ */
+int
+rec_after(struct record *a, struct record *b)
+{
+	struct record *r;
+
+	if (a->round != b->round)
+		return a->round > b->round;
+	for (r = b->parent; r; r = r->parent) {
+		if (r == a)
+			return 0;
+	}
+	for (r = a->parent; r; r = r->parent) {
+		if (r == b)
+			return 1;
+	}
+	return rec_cmp_tree(&a, &b) > 0;
+}
+
+/* record owning an output path of this run, NULL if none */
+struct record *
+output_owner(char *path)
+{
+	struct output_entry *e;
+	struct record *rec = NULL;
+	uint32_t h = dedup_hash(path);
+
+	pthread_mutex_lock(&outputs.locks[h % OUTPUT_LOCKS]);
+	for (e = outputs.buckets[h]; e; e = e->next) {
+		if (!strcmp(e->path, path)) {
+			rec = e->rec;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&outputs.locks[h % OUTPUT_LOCKS]);
+	return rec;
+}
+
+void
+outputs_free(void)
+{
+	struct output_entry *e, *next;
+	size_t n;
+
+	for (n=0; n<DEDUP_BUCKETS; n++) {
+		for (e = outputs.buckets[n]; e; e = next) {
+			next = e->next;
+			free(e->path);
+			free(e);
+		}
+	}
+}
+
+/* build the output path of a record part in out_filepath, of size PATH_MAX, and save it in the record */
+int
+rec_out_path(struct record *rec, unsigned int n, char *out_filepath)
+{
+	struct record *rec2;
+	char num[16], *dir;
+	unsigned int out_filepath_len, len;
+
+	/* build file name by concatenating parent records out_filename, separated by "_" */
+	rec2 = rec;
+	out_filepath_len = 0;
+	out_filepath[0] = '\0';
+	do {
+		if (rec2->out_filename) {
+			len = strlen(rec2->out_filename);
+			if (out_filepath_len + len + 1 >= PATH_MAX) {
+				xwarnx("rec_write: path too long: %d + %d\n", out_filepath_len, len);
+				break;
+			}
+			if (out_filepath_len > 0) {
+				memmove(out_filepath+len+1, out_filepath, out_filepath_len+1);
+			}
+			strcpy(out_filepath, rec2->out_filename);
+			if (out_filepath_len > 0) {
+				out_filepath[len] = '_';
+				len++;
+			}
+			out_filepath_len += len;
+			if (rec2->part > 0) {
+				snprintf(num, sizeof(num), "%d", rec2->part);
+				len = strlen(num);
+				if (out_filepath_len > 0)
+					memmove(out_filepath+len+1, out_filepath, out_filepath_len+1);
+				strcpy(out_filepath, num);
+				out_filepath[len] = '-';
+				out_filepath_len += len + 1;
 			}
 		}
 		//verb(rec->depth, "rec_write filename %s = %s [%d]\n", out_filepath, ascii((uint8_t *)out_filepath, out_filepath_len), out_filepath_len);
 	} while ((rec2 = rec2->parent) != NULL);
 
-	/* append part number and extension, if available */
-	if (n > 0) {
-		out_filepath_len += snprintf(num, sizeof(num), "-%d", n);
-		strcat(out_filepath, num);
+	/* append part number and extension, if available */
+	if (n > 0) {
+		snprintf(num, sizeof(num), "-%u", n);
+		strcat(out_filepath, num);
+		out_filepath_len += strlen(num);
+	}
+	if (rec->out_fileext) {
+		strcat(out_filepath, ".");
+		strcat(out_filepath, rec->out_fileext);
+		out_filepath_len += strlen(rec->out_fileext) + 1;
+	}
+	verb(rec->depth+1, "rec_write path %s\n", out_filepath);
+
+	/* save full filename in the record */
+	rec->out_filename_full = arena_strdup(out_filepath);
+
+	/* prepend the output directory of the package */
+	dir = rec_root(rec)->package->dir;
+	len = strlen(dir);
+	memmove(out_filepath+len+1, out_filepath, out_filepath_len+1);
+	strcpy(out_filepath, dir);
+	out_filepath[len] = '/';
+
+	return out_filepath_len + len + 1;
+}
+
+/* release the mappings and buffers held by a record, it's memory stays in the arena */
+void
+rec_release(struct record *rec)
+{
+	if (rec->size && !rec->parent && rec->ptr) {
+		/* no parent means file based, the members of a container are released with it */
+		if (!rec->package || !rec->package->container)
+			munmap(rec->ptr, rec->size);
+		rec->ptr = NULL;
+	}
+	if (rec->extract.seq_buf) {
+		munmap(rec->extract.seq_buf, rec->extract.seq_size);
+		rec->extract.seq_buf = NULL;
+	}
+	if (rec->extract.buf && rec->extract.mapped)
+		munmap(rec->extract.buf, rec->extract.size);
+	else if (rec->extract.buf)
+		free(rec->extract.buf);
+	rec->extract.buf = NULL;
+}
+
+/* allocate zeroed memory from the arena of the current thread */
+void *
+arena_alloc(size_t size)
+{
+	struct arena_chunk *c = arena->chunks;
+	void *p;
+
+	size = (size + 15) & ~(size_t)15;
+	if (!c || c->used + size > c->size) {
+		if (size > ARENA_CHUNK_SIZE / 4) {
+			/* large allocation, in it's own chunk behind the one being filled */
+			c = arena_chunk_new(NULL, size);
+			c->used = size;
+			if (arena->chunks) {
+				c->next = arena->chunks->next;
+				arena->chunks->next = c;
+			} else
+				arena->chunks = c;
+			return c->data;
+		}
+		c = arena->chunks = arena_chunk_new(arena->chunks, ARENA_CHUNK_SIZE);
+	}
+	p = c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+char *
+arena_strdup(const char *s)
+{
+	size_t len = strlen(s) + 1;
+
+	return memcpy(arena_alloc(len), s, len);
+}
+
+/* allocate a zeroed record from the arena of the current thread */
+struct record *
+arena_rec(void)
+{
+	struct arena_chunk *c = arena->recs;
+	struct record *rec;
+
+	if (!c || c->used == c->size)
+		c = arena->recs = arena_chunk_new(arena->recs, ARENA_CHUNK_RECS * sizeof(struct record));
+	rec = (struct record *)(c->data + c->used);
+	c->used += sizeof(struct record);
+	return rec;
+}
+
+struct arena_chunk *
+arena_chunk_new(struct arena_chunk *next, size_t size)
+{
+	struct arena_chunk *c;
+
+	/* calloc() of large sizes gets fresh zero pages from mmap(), without clearing them */
+	c = calloc(1, sizeof(struct arena_chunk) + size);
+	if (!c)
+		err(1, "calloc");
+	c->next = next;
+	c->size = size;
+	return c;
+}
+
+/* move the chunks of an arena to another, after the chunks being filled */
+void
+arena_merge(struct arena *to, struct arena *from)
+{
+	struct arena_chunk **lists[2][2] = { { &to->chunks, &from->chunks }, { &to->recs, &from->recs } };
+	struct arena_chunk *c;
+	int n;
+
+	for (n=0; n<2; n++) {
+		if (!*lists[n][1])
+			continue;
+		if (*lists[n][0]) {
+			for (c = *lists[n][1]; c->next; c = c->next)
+				;
+			c->next = (*lists[n][0])->next;
+			(*lists[n][0])->next = *lists[n][1];
+		} else
+			*lists[n][0] = *lists[n][1];
+		*lists[n][1] = NULL;
+	}
+}
+
+/* release the resources of all the records, then the memory of the arena */
+void
+arena_free(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+	size_t n;
+
+	for (c = a->recs; c; c = next) {
+		for (n = 0; n < c->used; n += sizeof(struct record))
+			rec_release((struct record *)(c->data + n));
+		next = c->next;
+		free(c);
+	}
+	for (c = a->chunks; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	a->recs = a->chunks = NULL;
+}
+
+/* record of the source file a record was extracted from */
+struct record *
+rec_root(struct record *rec)
+{
+	while (rec->parent)
+		rec = rec->parent;
+	return rec;
+}
+
+/*
+ * filename: string that can be freed
+ * ext: static string
+ */
+void
+rec_out_filename(struct record *rec, const char *filename, size_t filename_max, const char *ext)
+{
+	char buf[NAME_MAX];
+	char *p = buf, *s = buf;
+
+	/* names which do not fit a path component, as found in carved data, are truncated */
+	if (filename_max == 0)
+		filename_max = strnlen(filename, NAME_MAX - 1);
+	else if (filename_max > NAME_MAX - 1)
+		filename_max = NAME_MAX - 1;
+	/* format filename: replace '/' by '-' and remove spaces */
+	strncpy(buf, filename, filename_max);
+	buf[filename_max] = '\0';
+	do {
+		while (*p == ' ' && *(p+1) == ' ')
+			++p;
+		if (*p == '/')
+			*p = '-';
+		else if (*p == ' ') {
+			if (!*(p+1))
+				++p;
+			else
+				*p = '_';
+		}
+	} while ((*s++ = *p++));
+	*(s-1) = '\0';
+
+	verb(rec->depth+1, "filename %s ext %s\n", buf, ext);
+	rec->out_filename = arena_strdup(buf);
+	rec->out_fileext = ext;
+}
+
+/*
+ * compare records by their position in the records tree, as they would be reached by a serial extraction:
+ * children come before their parent, which is registered once its handler returned
+ */
+int
+rec_cmp_tree(const void *a, const void *b)
+{
+	struct record *ra = *(struct record **)a, *rb = *(struct record **)b;
+	struct record *r;
+	int da = 0, db = 0;
+
+	for (r = ra; r; r = r->parent)
+		da++;
+	for (r = rb; r; r = r->parent)
+		db++;
+	struct record *pa[da], *pb[db];
+	for (da = 0; ra; ra = ra->parent)
+		pa[da++] = ra;
+	for (db = 0; rb; rb = rb->parent)
+		pb[db++] = rb;
+	while (da > 0 && db > 0 && pa[da-1] == pb[db-1]) {
+		da--;
+		db--;
+	}
+	if (da == 0 || db == 0)
+		return db - da; /* one is the ancestor of the other */
+	return (int)pa[da-1]->index - (int)pb[db-1]->index;
+}
+
+/* write the index of the record tree of the source files to path */
+void
+index_write(char *path, struct record **roots, unsigned int count, char *upgrade_dir)
+{
+	struct index_build b;
+	struct index_header h;
+	struct record *rec;
+	char tmp[PATH_MAX];
+	unsigned int n;
+	size_t pos;
+	FILE *f;
+
+	bzero(&b, sizeof(b));
+	index_string(&b, "", 0);
+	for (n=0; n<count; n++)
+		index_add(&b, roots[n], INDEX_NONE, 0);
+	/* reassembled archives link records of different trees, all positions are known now */
+	for (pos=0; pos<b.count; pos++) {
+		rec = b.order[pos];
+		if (rec->extract.seq_next)
+			b.recs[pos].seq_next = rec->extract.seq_next->pos;
+		if (rec->extract.seq_buf)
+			b.recs[pos].flags |= INDEX_SEQ_START;
+	}
+
+	memcpy(h.magic, INDEX_MAGIC, sizeof(h.magic));
+	h.records_count = b.count;
+	h.upgrade_dir = index_string(&b, upgrade_dir, strlen(upgrade_dir));
+	h.strings_off = sizeof(h) + b.count * sizeof(struct index_rec);
+	h.strings_size = b.strings_size;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp) || !(f = fopen(tmp, "w")))
+		err(1, "could not write index %s", path);
+	if (fwrite(&h, sizeof(h), 1, f) != 1
+			|| fwrite(b.recs, sizeof(struct index_rec), b.count, f) != b.count
+			|| fwrite(b.strings, 1, b.strings_size, f) != b.strings_size
+			|| fclose(f) == EOF || rename(tmp, path) == -1)
+		err(1, "could not write index %s", path);
+	verb(0, "[+] index of %zu records written to %s\n", b.count, path);
+
+	free(b.recs);
+	free(b.order);
+	free(b.strings);
+}
+
+/* add a record and it's childs to the index, in tree order */
+void
+index_add(struct index_build *b, struct record *rec, uint32_t parent, uint32_t source)
+{
+	struct index_rec *ir;
+	struct magic *m = NULL;
+	char name[HEADER_XPLF_NAME_LEN+1];
+	uint32_t pos = b->count;
+	unsigned int n;
+
+	if (b->count == b->alloc) {
+		b->alloc = b->alloc ? b->alloc * 2 : 1024;
+		b->recs = realloc(b->recs, b->alloc * sizeof(struct index_rec));
+		b->order = realloc(b->order, b->alloc * sizeof(struct record *));
+		if (!b->recs || !b->order)
+			err(1, "realloc");
+	}
+	rec->pos = pos;
+	b->order[pos] = rec;
+	ir = &b->recs[b->count++];
+	bzero(ir, sizeof(struct index_rec));
+	ir->parent = parent;
+	ir->source = (parent == INDEX_NONE) ? pos : source;
+	ir->base = rec->base ? rec->base->pos : INDEX_NONE;
+	ir->seq_next = INDEX_NONE;
+	ir->depth = rec->depth;
+	ir->offset = rec->base_off;
+	ir->size = rec->size;
+	if (rec->size >= sizeof(uint32_t))
+		ir->magic = be32toh(*(uint32_t *)rec->ptr);
+	if (rec->size >= sizeof(struct header_rec))
+		ir->type = be32toh(((struct header_rec *)rec->ptr)->type);
+	if (rec->parent && !rec->carve && rec->size >= sizeof(uint32_t))
+		m = dispatch_lookup(ir->magic, ir->type);
+
+	rec_name(rec, m, name, sizeof(name));
+	ir->name = index_string(b, name, strlen(name));
+	if (rec->out_filename_full)
+		ir->out_filename = index_string(b, rec->out_filename_full, strlen(rec->out_filename_full));
+
+	/* how to get it's decoded content */
+	if (m)
+		ir->rec_type = m->rec;
+	if (rec->carve && rec->carve->probe && rec->extract.buf) {
+		ir->comp = INDEX_CARVE;
+		ir->carver = (rec->carve == &carver_lzma) ? INDEX_CARVER_LZMA : rec->carve - carvers;
+		ir->comp_size = rec->size;
+		ir->decomp_size = rec->extract.size;
+	} else if (m && m->handler == rec_handler_archive_part) {
+		ir->comp = INDEX_ARCHIVE_PART;
+		ir->comp_size = rec->h.size;
+		ir->decomp_size = rec->extract.size;
+	} else if (m && m->handler == rec_handler_xz) {
+		ir->comp = INDEX_XZ;
+		ir->comp_size = rec->size;
+		ir->decomp_size = rec->extract.size;
+	} else if (m && m->handler == rec_handler_rpdo && rec->size > sizeof(struct header_rpdo) + 4) {
+		ir->comp = INDEX_RPDO;
+		ir->comp_size = rec->size - sizeof(struct header_rpdo) - 4;
+		ir->decomp_size = rec->content_size;
+	} else
+		ir->decomp_size = rec->size;
+
+	/* ir moves when the table grows */
+	source = ir->source;
+	for (n=0; n < rec->childs_count; n++)
+		index_add(b, rec->childs[n], pos, source);
+}
+
+/* append a string to the strings table, returns it's offset */
+uint32_t
+index_string(struct index_build *b, const char *s, size_t len)
+{
+	uint32_t off = b->strings_size;
+
+	if (b->strings_size + len + 1 > b->strings_alloc) {
+		b->strings_alloc = (b->strings_size + len + 1) * 2;
+		b->strings = realloc(b->strings, b->strings_alloc);
+		if (!b->strings)
+			err(1, "realloc");
+	}
+	memcpy(b->strings + b->strings_size, s, len);
+	b->strings[b->strings_size + len] = '\0';
+	b->strings_size += len + 1;
+	return off;
+}
+
+/*
+ * index_query - list the records of the index which name or output file name contains name
+ * with dump, the decoded content of the first one is written to stdout, and the list to stderr.
+ * only the records on the way from it's source file are read and decoded.
+ * returns 0 if a record was found.
+ */
+int
+index_query(char *path, char *name, int dump)
+{
+	struct index_map ix;
+	struct index_rec *r;
+	struct stat st;
+	uint32_t n, i, chain[REC_DEPTH_MAX+2];
+	FILE *out = dump ? stderr : stdout;
+	uint8_t *buf;
+	size_t size;
+	int fd, depth, found = 0, container;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1)
+		err(1, "could not open index %s", path);
+	ix.size = st.st_size;
+	ix.map = mmap(NULL, ix.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ix.size < sizeof(struct index_header) || ix.map == MAP_FAILED)
+		errx(1, "invalid index %s", path);
+	close(fd);
+	ix.h = (struct index_header *)ix.map;
+	if (!index_valid(&ix))
+		errx(1, "invalid index %s", path);
+	container = stat(ix.strings + ix.h->upgrade_dir, &st) == 0 && S_ISREG(st.st_mode);
+
+	for (n=0; n<ix.h->records_count; n++) {
+		r = &ix.recs[n];
+		if (!strstr(ix.strings + r->name, name) && !strstr(ix.strings + r->out_filename, name))
+			continue;
+		/* path of the record from it's source file */
+		for (depth = 0, i = n; i != INDEX_NONE && depth < REC_DEPTH_MAX+2; i = ix.recs[i].parent)
+			chain[depth++] = i;
+		while (depth-- > 0)
+			fprintf(out, "%s%s", ix.strings + ix.recs[chain[depth]].name, depth > 0 ? " / " : "\n");
+		if (r->offset == (uint64_t)-1)
+			fprintf(out, "    location unknown [%lu]\n", r->size);
+		else if (r->base == INDEX_NONE && container)
+			fprintf(out, "    in %s at 0x%lx [%lu]\n", ix.strings + ix.h->upgrade_dir, r->offset, r->size);
+		else if (r->base == INDEX_NONE)
+			fprintf(out, "    in %s/%s at 0x%lx [%lu]\n", ix.strings + ix.h->upgrade_dir, ix.strings + ix.recs[r->source].name, r->offset, r->size);
+		else
+			fprintf(out, "    in decoded %s at 0x%lx [%lu]\n", ix.strings + ix.recs[r->base].name, r->offset, r->size);
+		if (r->comp != INDEX_RAW)
+			fprintf(out, "    %s, %lu compressed bytes, %lu decoded bytes\n", index_comp_names[r->comp], r->comp_size, r->decomp_size);
+		if (r->out_filename)
+			fprintf(out, "    output %s\n", ix.strings + r->out_filename);
+		if (dump && !found) {
+			buf = index_content(&ix, n, &size);
+			if (!buf)
+				errx(1, "could not read the content of %s", ix.strings + r->name);
+			if (file_write(STDOUT_FILENO, buf, size) == -1)
+				err(1, "write");
+			free(buf);
+		}
+		found++;
+	}
+	munmap(ix.map, ix.size);
+	return found ? 0 : 1;
+}
+
+/*
+ * check the header of a mapped index, and that the strings and records referenced by it's records are in it,
+ * so that queries can follow them without further checks. sets ix->recs and ix->strings. returns 1 if valid.
+ */
+int
+index_valid(struct index_map *ix)
+{
+	struct index_rec *r;
+	uint32_t n, count;
+
+	if (memcmp(ix->h->magic, INDEX_MAGIC, sizeof(ix->h->magic))
+			|| ix->h->strings_off != sizeof(struct index_header) + (uint64_t)ix->h->records_count * sizeof(struct index_rec)
+			|| ix->h->strings_off > ix->size || ix->h->strings_size > ix->size - ix->h->strings_off
+			|| ix->h->strings_size == 0)
+		return 0;
+	ix->recs = (struct index_rec *)(ix->map + sizeof(struct index_header));
+	ix->strings = (char *)ix->map + ix->h->strings_off;
+	if (ix->strings[ix->h->strings_size - 1] != '\0' || ix->h->upgrade_dir >= ix->h->strings_size)
+		return 0;
+	/* records are in tree order, parents come first */
+	count = ix->h->records_count;
+	for (n=0; n<count; n++) {
+		r = &ix->recs[n];
+		if (r->name >= ix->h->strings_size || r->out_filename >= ix->h->strings_size
+				|| (r->parent != INDEX_NONE && r->parent >= n) || r->source > n
+				|| (r->base != INDEX_NONE && r->base >= n) || (r->seq_next != INDEX_NONE && r->seq_next >= count)
+				|| r->comp >= sizeof(index_comp_names) / sizeof(index_comp_names[0]))
+			return 0;
+	}
+	return 1;
+}
+
+/* decoded content of an index record, the whole archive for the first part of a reassembled archive. to be freed */
+uint8_t *
+index_content(struct index_map *ix, uint32_t n, size_t *size)
+{
+	uint8_t *buf = NULL, *part;
+	size_t part_size;
+	uint32_t i, count = 0;
+
+	if (!(ix->recs[n].flags & INDEX_SEQ_START))
+		return index_decode(ix, n, size);
+	*size = 0;
+	for (i = n; i != INDEX_NONE; i = ix->recs[i].seq_next) {
+		if (i >= ix->h->records_count || count++ == ix->h->records_count || !(part = index_decode(ix, i, &part_size))) {
+			free(buf);
+			return NULL;
+		}
+		buf = realloc(buf, *size + part_size + 1);
+		if (!buf)
+			err(1, "realloc");
+		memcpy(buf + *size, part, part_size);
+		*size += part_size;
+		free(part);
+	}
+	return buf;
+}
+
+/* content of an index record decoded from it's bytes. to be freed */
+uint8_t *
+index_decode(struct index_map *ix, uint32_t n, size_t *size)
+{
+	struct index_rec *r = &ix->recs[n];
+	struct header_archive_part *hap;
+	struct carver *c;
+	uint8_t *bytes, *buf = NULL;
+	size_t used;
+
+	bytes = index_bytes(ix, n);
+	if (!bytes)
+		return NULL;
+	switch (r->comp) {
+	case INDEX_RAW:
+		*size = r->size;
+		return bytes;
+	case INDEX_ARCHIVE_PART:
+		hap = (struct header_archive_part *)bytes;
+		if (r->size >= sizeof(struct header_archive_part) && r->comp_size <= r->size - sizeof(struct header_archive_part))
+			buf = z_inflate(bytes + sizeof(struct header_archive_part), r->comp_size, be32toh(hap->decompressed_size), -1, 1, size, &used);
+		break;
+	case INDEX_XZ:
+		buf = xz_decode(bytes, r->size, 0, -1, size, &used);
+		break;
+	case INDEX_RPDO:
+		if (r->size >= sizeof(struct header_rpdo) && r->comp_size <= r->size - sizeof(struct header_rpdo))
+			buf = z_inflate(bytes + sizeof(struct header_rpdo), r->comp_size, 0, -1, 1, size, &used);
+		break;
+	case INDEX_CARVE:
+		if (r->carver == INDEX_CARVER_LZMA || r->carver < sizeof(carvers) / sizeof(carvers[0]) - 1) {
+			c = (r->carver == INDEX_CARVER_LZMA) ? &carver_lzma : &carvers[r->carver];
+			c->probe(bytes, r->size, &buf, size);
+		}
+		break;
+	}
+	free(bytes);
+	return buf;
+}
+
+/* bytes of an index record, read from it's source file or from the decoded content of it's base. to be freed */
+uint8_t *
+index_bytes(struct index_map *ix, uint32_t n)
+{
+	struct index_rec *r = &ix->recs[n];
+	char path[PATH_MAX];
+	struct stat st;
+	uint8_t *buf, *content;
+	size_t size;
+	ssize_t len;
+	int fd;
+
+	if (r->offset == (uint64_t)-1 || (r->base != INDEX_NONE && r->base >= n))
+		return NULL;
+	buf = xmalloc(r->size + 1);
+	if (r->base == INDEX_NONE) {
+		/* the sources of a container are at their offset in it */
+		if (stat(ix->strings + ix->h->upgrade_dir, &st) == 0 && S_ISREG(st.st_mode))
+			len = snprintf(path, sizeof(path), "%s", ix->strings + ix->h->upgrade_dir);
+		else
+			len = snprintf(path, sizeof(path), "%s/%s", ix->strings + ix->h->upgrade_dir, ix->strings + ix->recs[r->source].name);
+		if (len >= (ssize_t)sizeof(path) || (fd = open(path, O_RDONLY)) == -1) {
+			warn("could not open %s", path);
+			free(buf);
+			return NULL;
+		}
+		for (size = 0; size < r->size; size += len) {
+			len = pread(fd, buf + size, r->size - size, r->offset + size);
+			if (len <= 0) {
+				warn("could not read %s", path);
+				close(fd);
+				free(buf);
+				return NULL;
+			}
+		}
+		close(fd);
+		return buf;
+	}
+	content = index_content(ix, r->base, &size);
+	if (!content || r->size > size || r->offset > size - r->size) {
+		free(content);
+		free(buf);
+		return NULL;
+	}
+	memcpy(buf, content + r->offset, r->size);
+	free(content);
+	return buf;
+}
+
+/* build the tables of the table driven kernels, and select the hardware ones */
+void
+crc_init(void)
+{
+	uint32_t c;
+	int n, k;
+
+	for (n = 0; n < 256; n++) {
+		for (c = n, k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc.table_castagnoli[n] = c;
+		for (c = (uint32_t)n << 24, k = 0; k < 8; k++)
+			c = c & 0x80000000 ? (c << 1) ^ 0x04c11db7 : c << 1;
+		crc.table_msb[n] = c;
+	}
+	crc.castagnoli = crc_castagnoli_table;
+#ifdef CRC_SIMD
+	if (__builtin_cpu_supports("sse4.2"))
+		crc.castagnoli = crc_castagnoli_sse42;
+	crc.pclmul = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+
+/* update the register of an algorithm with len bytes, the checksum is then reg ^ xorout */
+uint32_t
+crc_update(unsigned int algo, uint32_t reg, const uint8_t *p, size_t len)
+{
+	switch (crc_algos[algo].kernel) {
+	case CRC_REFLECTED:
+		return crc_reflected(reg, p, len);
+	case CRC_CASTAGNOLI:
+		return crc.castagnoli(reg, p, len);
+	case CRC_MSB:
+		return crc_msb(reg, p, len);
+	case CRC_ADLER:
+		return adler32_z(reg, p, len);
+	}
+	return reg;
+}
+
+/* crc32 polynomial, folding 64 bytes at a time with carry-less multiplications when available */
+uint32_t
+crc_reflected(uint32_t reg, const uint8_t *p, size_t len)
+{
+	size_t chunk;
+
+#ifdef CRC_SIMD
+	if (crc.pclmul && len >= 64) {
+		chunk = len & ~(size_t)15;
+		reg = crc_reflected_pclmul(reg, p, chunk);
+		p += chunk;
+		len -= chunk;
+	}
+#else
+	(void)chunk;
+#endif
+	/* zlib takes and returns the final value, not the register */
+	return ~crc32_z(~reg, p, len);
+}
+
+uint32_t
+crc_castagnoli_table(uint32_t reg, const uint8_t *p, size_t len)
+{
+	while (len--)
+		reg = (reg >> 8) ^ crc.table_castagnoli[(reg ^ *p++) & 0xff];
+	return reg;
+}
+
+uint32_t
+crc_msb(uint32_t reg, const uint8_t *p, size_t len)
+{
+	while (len--)
+		reg = (reg << 8) ^ crc.table_msb[(reg >> 24) ^ *p++];
+	return reg;
+}
+
+#ifdef CRC_SIMD
+/* crc32c using the SSE 4.2 instruction, 8 bytes at a time */
+__attribute__((target("sse4.2"))) uint32_t
+crc_castagnoli_sse42(uint32_t reg, const uint8_t *p, size_t len)
+{
+	uint64_t r = reg, v;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&v, p, 8);
+		r = _mm_crc32_u64(r, v);
+	}
+	reg = r;
+	while (len--)
+		reg = _mm_crc32_u8(reg, *p++);
+	return reg;
+}
+
+/*
+ * crc32 of len bytes, len being a multiple of 16 and at least 64, by folding 4 blocks of 16 bytes in parallel
+ * then reducing with a Barrett reduction. constants are the ones of the reflected crc32 polynomial from
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel 2009.
+ */
+__attribute__((target("pclmul,sse4.1"))) uint32_t
+crc_reflected_pclmul(uint32_t reg, const uint8_t *p, size_t len)
+{
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((__m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((__m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((__m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((__m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(reg));
+	x0 = _mm_load_si128((__m128i *)k1k2);
+	p += 64;
+	len -= 64;
+
+	/* fold 4 blocks into the next 4 */
+	for (; len >= 64; p += 64, len -= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((__m128i *)(p + 0x00));
+		y6 = _mm_loadu_si128((__m128i *)(p + 0x10));
+		y7 = _mm_loadu_si128((__m128i *)(p + 0x20));
+		y8 = _mm_loadu_si128((__m128i *)(p + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+	}
+
+	/* fold the 4 blocks into one, then the remaining blocks */
+	x0 = _mm_load_si128((__m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+	for (; len >= 16; p += 16, len -= 16) {
+		x2 = _mm_loadu_si128((__m128i *)p);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	}
+
+	/* fold 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((__m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((__m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
+#endif
+
+/*
+ * call fn on the records with a size and a CRC pair that are readable without decoding: source files and
+ * the normal, archive and xplf records found in their parts. stops when fn returns non zero.
+ */
+int
+crc_walk(struct record *root, uint8_t *ptr, size_t size, unsigned int depth, int (*fn)(struct record *, uint8_t *, size_t, size_t))
+{
+	struct magic *m;
+	uint32_t *offsets, off, next;
+	size_t hsize, header, start, count, n;
+
+	if (size < sizeof(struct header_rec) || depth > REC_DEPTH_MAX)
+		return 0;
+	m = dispatch_lookup(be32toh(((uint32_t *)ptr)[0]), be32toh(((struct header_rec *)ptr)->type));
+	if (depth == 1 || (m && m->rec == REC_NORMAL)) {
+		hsize = be32toh(((struct header_rec *)ptr)->size);
+		count = be32toh(((struct header_rec *)ptr)->records_count);
+		header = sizeof(struct header_rec);
+	} else if (m && m->rec == REC_ARCHIVE && size >= sizeof(struct header_archive)) {
+		hsize = be32toh(((struct header_archive *)ptr)->size);
+		count = be32toh(((struct header_archive *)ptr)->records_count);
+		header = sizeof(struct header_archive);
+	} else if (m && m->rec == REC_XPLF && size >= sizeof(struct header_xplf)) {
+		hsize = be32toh(((struct header_xplf *)ptr)->size);
+		count = be32toh(((struct header_xplf *)ptr)->records_count);
+		header = sizeof(struct header_xplf);
+	} else
+		return 0;
+	if (hsize > size || hsize < header + CRC_LEN * 2 || count > (hsize - header - CRC_LEN * 2) / sizeof(uint32_t))
+		return 0;
+	offsets = (uint32_t *)(ptr + header);
+	start = header + count * sizeof(uint32_t);
+	if (count > 0 && be32toh(offsets[0]) >= start && be32toh(offsets[0]) <= hsize - CRC_LEN * 2)
+		start = be32toh(offsets[0]);
+	if (fn(root, ptr, hsize, start))
+		return 1;
+	for (n = 0; n < count; n++) {
+		off = be32toh(offsets[n]);
+		next = n == count - 1 ? hsize - CRC_LEN * 2 : be32toh(offsets[n+1]);
+		if (off < header || next > hsize - CRC_LEN * 2 || next <= off)
+			continue;
+		if (crc_walk(root, ptr + off, next - off, depth+1, fn))
+			return 1;
+	}
+	return 0;
+}
+
+/* count the candidates matching the CRCs of a record, until enough records are seen */
+int
+crc_sample(struct record *root, uint8_t *ptr, size_t size, size_t start)
+{
+	uint32_t regs[CRC_ALGOS], values[CRC_COVERAGES], stored;
+	unsigned int a, a2, c, pos;
+
+	for (a = 0; a < CRC_ALGOS; a++) {
+		/* algorithms differing only by their final xor share the register */
+		for (a2 = 0; a2 < a; a2++)
+			if (crc_algos[a2].kernel == crc_algos[a].kernel && crc_algos[a2].init == crc_algos[a].init)
+				break;
+		regs[a] = a2 < a ? regs[a2] : crc_update(a, crc_algos[a].init, ptr, size - CRC_LEN * 2);
+		values[0] = regs[a] ^ crc_algos[a].xorout;
+		values[1] = crc_update(a, crc_algos[a].init, ptr + start, size - CRC_LEN * 2 - start) ^ crc_algos[a].xorout;
+		values[2] = crc_update(a, regs[a], ptr + size - CRC_LEN * 2, CRC_LEN) ^ crc_algos[a].xorout;
+		for (pos = 0; pos < 2; pos++) {
+			memcpy(&stored, ptr + size - CRC_LEN * (2 - pos), CRC_LEN);
+			/* the first crc can not cover itself */
+			for (c = 0; c < (pos == 0 ? 2 : CRC_COVERAGES); c++) {
+				if (values[c] == be32toh(stored))
+					crc.counts[pos][a][c][0]++;
+				if (values[c] == le32toh(stored))
+					crc.counts[pos][a][c][1]++;
+			}
+		}
+	}
+	return ++crc.samples == CRC_DISCOVER_RECORDS;
+}
+
+/* check the CRCs of a record with the algorithms found by crc_discover() */
+int
+crc_check(struct record *root, uint8_t *ptr, size_t size, size_t start)
+{
+	struct crc_match *cm;
+	uint32_t value, stored, prev_reg = 0;
+	size_t cstart, cend;
+	int pos;
+
+	for (pos = 0; pos < 2; pos++) {
+		cm = &crc.match[pos];
+		if (!cm->found)
+			continue;
+		cstart = cm->coverage == 1 ? start : 0;
+		cend = size - CRC_LEN * (cm->coverage == 2 ? 1 : 2);
+		if (pos == 1 && crc.match[0].found && crc.match[0].algo == cm->algo && crc.match[0].coverage == 0 && cm->coverage != 1) {
+			/* continue from the register of the first crc instead of reading the record again */
+			value = cm->coverage == 0 ? prev_reg : crc_update(cm->algo, prev_reg, ptr + size - CRC_LEN * 2, CRC_LEN);
+		} else
+			value = crc_update(cm->algo, crc_algos[cm->algo].init, ptr + cstart, cend - cstart);
+		if (pos == 0)
+			prev_reg = value;
+		value ^= crc_algos[cm->algo].xorout;
+		memcpy(&stored, ptr + size - CRC_LEN * (2 - pos), CRC_LEN);
+		stored = cm->le ? le32toh(stored) : be32toh(stored);
+		stats->crc_checked++;
+		if (value != stored) {
+			stats->crc_errors++;
+			xwarnx("crc %d mismatch in %s at 0x%lx [%zu]: stored %08x, computed %08x\n", pos+1, root->filename, ptr - root->ptr, size, stored, value);
+		} else
+			verb(1, "crc %d ok in %s at 0x%lx [%zu]: %08x\n", pos+1, root->filename, ptr - root->ptr, size, value);
+	}
+	return 0;
+}
+
+/* find which checksum, range and byte order produce each of the 2 CRCs, on the first records */
+void
+crc_discover(struct record **recs, unsigned int count)
+{
+	struct crc_match *cm;
+	unsigned int n, pos, a, c, le, total;
+
+	for (n = 0; n < count; n++)
+		if (crc_walk(recs[n], recs[n]->ptr, recs[n]->size, 1, crc_sample))
+			break;
+	info(0, "[+] searching crc algorithm on %u records\n", crc.samples);
+	for (pos = 0; pos < 2; pos++) {
+		cm = &crc.match[pos];
+		total = 0;
+		for (a = 0; a < CRC_ALGOS; a++) {
+			for (c = 0; c < CRC_COVERAGES; c++) {
+				for (le = 0; le < 2; le++) {
+					n = crc.counts[pos][a][c][le];
+					if (n > 0)
+						verb(1, "crc %u: %s of %s, %s endian, %u/%u records\n", pos+1, crc_algos[a].name,
+							crc_coverage_names[c], le ? "little" : "big", n, crc.samples);
+					if (n > cm->count) {
+						cm->algo = a;
+						cm->coverage = c;
+						cm->le = le;
+						cm->count = n;
+					}
+					total += n;
+				}
+			}
+		}
+		/* a match on some records only is a coincidence */
+		cm->found = cm->count * 2 > crc.samples;
+		if (cm->found)
+			info(0, "crc %u: %s of %s, %s endian, %u/%u records\n", pos+1, crc_algos[cm->algo].name,
+				crc_coverage_names[cm->coverage], cm->le ? "little" : "big", cm->count, crc.samples);
+		else
+			info(0, "crc %u: no known algorithm matches\n", pos+1);
+	}
+}
+
+/* find the algorithm of the CRCs and check them on all records, returns -1 when no algorithm matches */
+int
+crc_verify(struct record **recs, unsigned int count)
+{
+	unsigned int n;
+
+	crc_init();
+	crc_discover(recs, count);
+	if (!crc.match[0].found && !crc.match[1].found) {
+		xwarnx("crc algorithm not found, nothing to verify\n");
+		return -1;
+	}
+	verb(0, "[+] verifying records\n");
+	if (conf.jobs > 1) {
+		sched_files(recs, count, task_verify);
+	} else {
+		for (n = 0; n < count; n++) {
+			stats = &recs[n]->package->stats;
+			task_verify(recs[n]);
+		}
+		stats = &stats_total;
+	}
+
+	return 0;
+}
+
+void
+reassembly_add(struct record *rec)
+{
+	/* sequences are linked by the name of the archive holding each part */
+	if (!rec->parent || rec->parent->rec_type != REC_ARCHIVE || !rec->parent->h.name) {
+		xwarnx("reassembly: %s is not in an archive, ignored\n", rec_header_ascii(rec));
+		return;
+	}
+	pthread_mutex_lock(&sched.lists_lock);
+	if (reassembly.count == reassembly.alloc) {
+		reassembly.alloc = reassembly.alloc ? reassembly.alloc * 2 : 64;
+		reassembly.recs = realloc(reassembly.recs, reassembly.alloc * sizeof(struct record *));
+		if (!reassembly.recs)
+			err(1, "realloc");
+	}
+	reassembly.recs[reassembly.count] = rec;
+	reassembly.count++;
+	pthread_mutex_unlock(&sched.lists_lock);
+	if (manifest.f)
+		manifest_log("Q\t%s\t%.7s\n", rec_root(rec)->filename, rec->parent->h.name);
+}
+
+/*
+ * link archive parts of the reassembly list, starting at 'from', in sequences.
+ * parts are indexed by the first 7 letters of their archive name, so that each part is only compared to
+ * parts named like it instead of the whole list.
+ */
+void
+reassembly_link(size_t from)
+{
+	struct record **recs = reassembly.recs + from, *rec, *rec2;
+	size_t count = reassembly.count - from, buckets, n, i;
+	size_t *heads, *tails, *nexts;
+
+	for (buckets = 16; buckets < count * 2; buckets *= 2);
+	heads = xmalloc(buckets * sizeof(size_t));
+	tails = xmalloc(buckets * sizeof(size_t));
+	nexts = xmalloc(count * sizeof(size_t));
+	memset(heads, 0xff, buckets * sizeof(size_t));
+
+	for (n=0; n<count; n++) {
+		/* parts are chained in list order */
+		nexts[n] = SIZE_MAX;
+		i = reassembly_hash(recs[n]->parent->h.name) & (buckets - 1);
+		if (heads[i] == SIZE_MAX)
+			heads[i] = n;
+		else
+			nexts[tails[i]] = n;
+		tails[i] = n;
+	}
+
+	for (n=0; n<count; n++) {
+		rec = recs[n];
+		for (i = heads[reassembly_hash(rec->parent->h.name) & (buckets - 1)]; i != SIZE_MAX; i = nexts[i]) {
+			if (i == n)
+				continue;
+			rec2 = recs[i];
+			if (!strncmp(rec2->parent->h.name, rec->parent->h.name, 7)
+					&& (rec2->parent->h.name[7] == rec->parent->h.name[7] + 1)
+					&& (rec2->extract.size < 5 || memcmp(rec2->extract.buf, "XPLF", 5) != 0)
+					&& (!packages.batch || rec_root(rec2)->package == rec_root(rec)->package)) {
+				/* archive name start by the same 7 letters
+				 * and filename 8th letter is +1 (like in B=A+1), mark as next in sequence
+				 * and the content does not start by an XPLF header
+				 * and both come from the same package */
+				verb(1, "file sequence detected: %s is followed by %s\n", rec->parent->h.name, rec2->parent->h.name);
+				rec2->extract.seq_prev = rec;
+				rec->extract.seq_next = rec2;
+				break;
+			}
+		}
+	}
+
+	free(heads);
+	free(tails);
+	free(nexts);
+}
+
+/* FNV-1a hash of the first 7 letters of an archive name */
+uint32_t
+reassembly_hash(char *name)
+{
+	uint32_t hash = 2166136261u;
+	int n;
+
+	for (n=0; n<7; n++)
+		hash = (hash ^ (uint8_t)name[n]) * 16777619u;
+	return hash;
+}
+
+/*
+ * reassemble a sequence of archive parts from it's first part, and extract the result.
+ * parts are written with a single writev() to the output file, or to a memory file when only listing,
+ * and the file is then mapped to parse the archive, so the parts are never concatenated in memory.
+ */
+void
+reassembly_run(struct record *rec)
+{
+	struct record *first = rec;
+	struct iovec *iov;
+	char out_filepath[PATH_MAX] = "";
+	size_t buf_size = 0;
+	int n, count = 0, fd = -1;
+	uint32_t crc;
+	uint8_t *buf;
+
+	if (conf.profile)
+		prof_begin();
+	if (!rec->extract.seq_next) {
+		xwarnx("reassembly: orphaned archive found: %s\n", rec->parent->h.name);
+	}
+	info(0, "reassembling archive %s\n", rec->parent->h.name);
+	rec->depth = 0;
+	rec->round = rec->parent->round + 1;
+	rec_out_filename(rec, rec->parent->h.name, HEADER_ARCHIVE_NAME_LEN, NULL);
+	for (; rec; rec = rec->extract.seq_next)
+		count++;
+	iov = xmalloc(count * sizeof(struct iovec));
+	for (n = 0, rec = first; rec; rec = rec->extract.seq_next, n++) {
+		info(1, "concat %s\n", rec->parent->h.name);
+		iov[n].iov_base = rec->extract.buf;
+		iov[n].iov_len = rec->extract.size;
+		buf_size += rec->extract.size;
+	}
+	rec = first;
+
+	if (!conf.only_list)
+		fd = rec_open(rec, 0, out_filepath);
+	if (fd != -1)
+		info(rec->depth+1, "part %d: writing file %s [%lu]\n", 0, out_filepath, buf_size);
+	else if ((fd = memfd_create("reassembly", 0)) == -1)
+		err(1, "memfd_create");
+	if (file_writev(fd, iov, count) == -1) {
+		xwarnx("error writing file %s: %s\n", out_filepath, strerror(errno));
+		stats->extract_errors++;
+		close(fd);
+		free(iov);
+		if (conf.profile)
+			prof_end(PROF_REASSEMBLY, buf_size, 0);
+		return;
+	}
+	if (!conf.only_list)
+		stats->extract_ok++;
+	if (manifest.f && !conf.only_list && !rec->shadowed) {
+		for (n = 0, crc = 0; n < count; n++)
+			crc = crc32_z(crc, iov[n].iov_base, iov[n].iov_len);
+		manifest_output_add(rec, out_filepath, NULL, buf_size, crc);
+	}
+	if (conf.events && !conf.only_list && !rec->shadowed)
+		event_file(rec, out_filepath, buf_size);
+	free(iov);
+
+	/* parts content is now in the file */
+	for (rec = first; rec; rec = rec->extract.seq_next) {
+		free(rec->extract.buf);
+		rec->extract.buf = NULL;
+	}
+	rec = first;
+	if (conf.profile)
+		prof_end(PROF_REASSEMBLY, buf_size, buf_size);
+	if (buf_size == 0) {
+		close(fd);
+		return;
+	}
+	buf = mmap(NULL, buf_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (buf == MAP_FAILED)
+		err(1, "mmap");
+	close(fd);
+
+	/* kept until the end, tasks extracting it's parts can still be running when we return */
+	rec->extract.seq_buf = buf;
+	rec->extract.seq_size = buf_size;
+	rec_extract_new(rec, 0, buf, buf_size, 1);
+}
+
+void
+binwalk_add(struct record *rec)
+{
+	int found;
+
+	/* formats known by the carver are extracted here, binwalk only gets what remains */
+	if (conf.carve && rec->content) {
+		if (conf.profile)
+			prof_begin();
+		found = carve(rec);
+		if (conf.profile)
+			prof_end(PROF_CARVE, rec->content_size, 0);
+		if (!found)
+			return;
+	}
+	pthread_mutex_lock(&sched.lists_lock);
+	if (binwalk.count == binwalk.alloc) {
+		binwalk.alloc = binwalk.alloc ? binwalk.alloc * 2 : 64;
+		binwalk.recs = realloc(binwalk.recs, binwalk.alloc * sizeof(struct record *));
+		if (!binwalk.recs)
+			err(1, "realloc");
+	}
+	binwalk.recs[binwalk.count] = rec;
+	binwalk.count++;
+	rec_root(rec)->package->binwalk_count++;
+	pthread_mutex_unlock(&sched.lists_lock);
+	if (manifest.f && rec->out_filename_full)
+		manifest_log("W\t%s\n", rec->out_filename_full);
+	binwalk_wake();
+}
+
+/* start the binwalk job server, records are handed to it by binwalk_add() as soon as they are written */
+void
+binwalk_run(void)
+{
+	binwalk.log = logbuf_new();
+	binwalk.efd = eventfd(0, EFD_CLOEXEC);
+	if (binwalk.efd < 0)
+		err(1, "eventfd");
+	if (pthread_create(&binwalk.thread, NULL, binwalk_serve, NULL) != 0)
+		err(1, "pthread_create");
+}
+
+/* tell the job server that extraction is done, wait for the last binwalk processes and print it's log */
+void
+binwalk_wait(void)
+{
+	unsigned int n;
+
+	if (binwalk.efd < 0)
+		return;
+	pthread_mutex_lock(&sched.lists_lock);
+	binwalk.closed = 1;
+	pthread_mutex_unlock(&sched.lists_lock);
+	binwalk_wake();
+	pthread_join(binwalk.thread, NULL);
+	close(binwalk.efd);
+	binwalk.efd = -1;
+	logbuf_print(binwalk.log, stdout);
+	stats_add(stats, &binwalk.stats);
+	for (n=0; n<packages.count; n++)
+		stats_add(&packages.list[n].stats, &packages.list[n].binwalk_stats);
+}
+
+void
+binwalk_wake(void)
+{
+	uint64_t one = 1;
+
+	if (binwalk.efd >= 0 && write(binwalk.efd, &one, sizeof(one)) < 0)
+		err(1, "eventfd write");
+}
+
+/*
+ * binwalk_serve - job server running binwalk on the records of the binwalk list
+ * the largest waiting file is started first, so that large files do not end up running alone at the end.
+ * each process is watched through a pidfd, so an exit can not be missed between two waits.
+ * processes running longer than the timeout are killed with their own children.
+ */
+void *
+binwalk_serve(void *arg)
+{
+	struct binwalk_job *jobs = NULL, *job, *orig;
+	struct pollfd *pfds;
+	struct timespec now;
+	struct stat st;
+	char path[PATH_MAX];
+	size_t *pending = NULL, *running;
+	size_t n, n2, best, first, count = 0, alloc = 0, pending_count = 0, running_count = 0, waiting = 0;
+	unsigned int tasks = conf.binwalk_jobs;
+	double utime = 0, stime = 0;
+	long maxrss = 0;
+	int timeout, left, polled, closed;
+	uint64_t events;
+
+	stats = &binwalk.stats;
+	logbuf = binwalk.log;
+	if (!tasks)
+		tasks = (sysconf(_SC_NPROCESSORS_ONLN) / 2) + 1;
+	running = xmalloc(tasks * sizeof(size_t));
+	pfds = xmalloc((tasks + 1) * sizeof(struct pollfd));
+
+	verb(0, "[+] running binwalk using %d parallel tasks\n", tasks);
+	for (;;) {
+		/* take the records added since last time */
+		pthread_mutex_lock(&sched.lists_lock);
+		closed = binwalk.closed;
+		if (binwalk.count > alloc) {
+			alloc = binwalk.alloc;
+			jobs = realloc(jobs, alloc * sizeof(struct binwalk_job));
+			pending = realloc(pending, alloc * sizeof(size_t));
+			if (!jobs || !pending)
+				err(1, "realloc");
+		}
+		first = count;
+		for (; binwalk.taken < binwalk.count; binwalk.taken++) {
+			job = &jobs[count];
+			job->rec = binwalk.recs[binwalk.taken];
+			job->package = rec_root(job->rec)->package;
+			job->state = BINWALK_PENDING;
+			job->dup_of = -1;
+			job->pid = -1;
+			job->pidfd = -1;
+			job->timed_out = 0;
+			job->status = 0;
+			pending[pending_count++] = count++;
+		}
+		pthread_mutex_unlock(&sched.lists_lock);
+
+		for (n=first; n<count; n++) {
+			stats = &jobs[n].package->binwalk_stats;
+			writer_wait_rec(jobs[n].rec);
+			snprintf(path, sizeof(path), "%s/%s", jobs[n].package->dir, jobs[n].rec->out_filename_full);
+			jobs[n].size = (stat(path, &st) == 0) ? st.st_size : 0;
+			jobs[n].key[0] = '\0';
+			if (conf.cache_dir || conf.dedup)
+				binwalk_key(&jobs[n], path);
+		}
+		while (running_count < tasks && pending_count > 0) {
+			best = 0;
+			for (n=1; n<pending_count; n++) {
+				if (jobs[pending[n]].size > jobs[pending[best]].size)
+					best = n;
+			}
+			job = &jobs[pending[best]];
+			pending[best] = pending[--pending_count];
+			job->state = BINWALK_DONE;
+			stats = &job->package->binwalk_stats;
+			if (manifest.f && manifest_binwalk_done(job->package->dir, job->rec->out_filename_full)) {
+				info(0, "binwalk results for %s/%s kept from previous run\n", job->package->dir, job->rec->out_filename_full);
+				manifest_log("B\t%s\n", job->rec->out_filename_full);
+				continue;
+			}
+			if (conf.dedup && job->key[0] && (orig = binwalk_orig(jobs, count, job))) {
+				/* identical content, results are linked once binwalk is done on it */
+				job->dup_of = orig - jobs;
+				job->state = BINWALK_RUNNING;
+				if (orig->state == BINWALK_DONE)
+					binwalk_dedup(orig, job);
+				continue;
+			}
+			if (conf.cache_dir && job->key[0] && cache_get_binwalk(job->key, job->package->dir, job->rec->out_filename_full) == 0) {
+				info(0, "binwalk results for %s/%s found in cache\n", job->package->dir, job->rec->out_filename_full);
+				if (manifest.f)
+					manifest_log("B\t%s\n", job->rec->out_filename_full);
+				continue;
+			}
+			binwalk_start(job, job->package->dir);
+			if (job->pid > 0) {
+				job->state = BINWALK_RUNNING;
+				running[running_count++] = job - jobs;
+			}
+		}
+		if (closed && running_count == 0)
+			break;
+		if (closed && pending_count == 0 && running_count != waiting) {
+			waiting = running_count;
+			info(0, "waiting for %d binwalk instances to finish\n", waiting);
+		}
+
+		/* sleep until a process exits, a record is added or the next timeout, processes without pidfd are polled */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		pfds[0].fd = binwalk.efd;
+		pfds[0].events = POLLIN;
+		pfds[0].revents = 0;
+		timeout = -1;
+		polled = 0;
+		for (n=0; n<running_count; n++) {
+			job = &jobs[running[n]];
+			pfds[n+1].fd = job->pidfd;
+			pfds[n+1].events = POLLIN;
+			pfds[n+1].revents = 0;
+			if (job->pidfd < 0)
+				polled = 1;
+			if (conf.binwalk_timeout && !job->timed_out) {
+				left = (conf.binwalk_timeout - timespec_elapsed(&job->start, &now)) * 1000;
+				if (left < 0)
+					left = 0;
+				if (timeout < 0 || left < timeout)
+					timeout = left;
+			}
+		}
+		if (polled && (timeout < 0 || timeout > 100))
+			timeout = 100;
+		if (poll(pfds, running_count + 1, timeout) < 0 && errno != EINTR)
+			err(1, "poll");
+		if (pfds[0].revents & POLLIN && read(binwalk.efd, &events, sizeof(events)) < 0)
+			err(1, "eventfd read");
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (n=0; n<running_count; ) {
+			job = &jobs[running[n]];
+			if (wait4(job->pid, &job->status, WNOHANG, &job->ru) == job->pid) {
+				stats = &job->package->binwalk_stats;
+				verb(0, "[+] binwalk done on %s in %.2fs, user %.2fs, system %.2fs, max rss %ld KB\n",
+					job->rec->out_filename_full, timespec_elapsed(&job->start, &now),
+					TIMEVAL_SEC(job->ru.ru_utime), TIMEVAL_SEC(job->ru.ru_stime), job->ru.ru_maxrss);
+				utime += TIMEVAL_SEC(job->ru.ru_utime);
+				stime += TIMEVAL_SEC(job->ru.ru_stime);
+				if (job->ru.ru_maxrss > maxrss)
+					maxrss = job->ru.ru_maxrss;
+				if (job->pidfd >= 0)
+					close(job->pidfd);
+				job->state = BINWALK_DONE;
+				if (conf.cache_dir && job->key[0] && !job->timed_out && job->status == 0)
+					cache_put_binwalk(job->key, job->package->dir, job->rec->out_filename_full);
+				if (manifest.f && !job->timed_out && job->status == 0)
+					manifest_log("B\t%s\n", job->rec->out_filename_full);
+				if (conf.events)
+					binwalk_event(job, timespec_elapsed(&job->start, &now));
+				if (conf.profile) {
+					struct prof_counter *c = &stats->prof[PROF_BINWALK];
+					uint64_t wall = timespec_elapsed(&job->start, &now) * 1e9;
+
+					c->calls++;
+					c->wall_ns += wall;
+					c->self_ns += wall;
+					c->cpu_ns += (TIMEVAL_SEC(job->ru.ru_utime) + TIMEVAL_SEC(job->ru.ru_stime)) * 1e9;
+					c->bytes_in += job->size;
+					c->hist[prof_bucket(job->size)]++;
+				}
+				for (n2=0; conf.dedup && n2<count; n2++) {
+					if (jobs[n2].dup_of == (size_t)(job - jobs))
+						binwalk_dedup(job, &jobs[n2]);
+				}
+				running[n] = running[--running_count];
+				continue;
+			}
+			if (conf.binwalk_timeout && !job->timed_out && timespec_elapsed(&job->start, &now) >= conf.binwalk_timeout) {
+				/* binwalk runs extraction tools, kill the whole process group */
+				kill(-job->pid, SIGKILL);
+				job->timed_out = 1;
+			}
+			n++;
+		}
+	}
+	verb(0, "[+] binwalk ran on %lu files, user %.2fs, system %.2fs, max rss %ld KB\n", count, utime, stime, maxrss);
+
+	/* report in the order of a serial extraction, whatever the order records were added in */
+	if (count > 0)
+		qsort(jobs, count, sizeof(struct binwalk_job), binwalk_job_cmp_tree);
+	for (n=0; n<count; n++) {
+		job = &jobs[n];
+		stats = &job->package->binwalk_stats;
+		if (job->timed_out)
+			xwarnx("binwalk killed after %ds timeout on %s\n", conf.binwalk_timeout, job->rec->out_filename_full);
+		else if (WIFSIGNALED(job->status))
+			xwarnx("binwalk killed by signal %d on %s\n", WTERMSIG(job->status), job->rec->out_filename_full);
+		else if (WEXITSTATUS(job->status) != 0)
+			xwarnx("binwalk exited with error %d on %s\n", WEXITSTATUS(job->status), job->rec->out_filename_full);
+	}
+
+	free(pfds);
+	free(running);
+	free(pending);
+	free(jobs);
+	logbuf = NULL;
+	return NULL;
+}
+
+/* first job started on the same content as job, NULL if none */
+struct binwalk_job *
+binwalk_orig(struct binwalk_job *jobs, size_t count, struct binwalk_job *job)
+{
+	size_t n;
+
+	for (n=0; n<count; n++) {
+		if (&jobs[n] != job && jobs[n].state != BINWALK_PENDING && jobs[n].dup_of == (size_t)-1
+				&& !strcmp(jobs[n].key, job->key))
+			return &jobs[n];
+	}
+	return NULL;
+}
+
+/* link the results of binwalk on orig to job, run on identical content */
+void
+binwalk_dedup(struct binwalk_job *orig, struct binwalk_job *job)
+{
+	char from[PATH_MAX], to[PATH_MAX];
+	struct stat st;
+
+	info(0, "binwalk results of %s linked to %s\n", orig->rec->out_filename_full, job->rec->out_filename_full);
+	job->status = orig->status;
+	job->timed_out = orig->timed_out;
+	job->state = BINWALK_DONE;
+	stats = &job->package->binwalk_stats;
+	stats->deduplicated++;
+	snprintf(from, sizeof(from), "%s/_%s.binwalk.log", orig->package->dir, orig->rec->out_filename_full);
+	snprintf(to, sizeof(to), "%s/_%s.binwalk.log", job->package->dir, job->rec->out_filename_full);
+	if (lstat(from, &st) == 0 && tree_copy(from, to, 1) == -1)
+		xwarnx("could not link %s to %s\n", from, to);
+	snprintf(from, sizeof(from), "%s/_%s.extracted", orig->package->dir, orig->rec->out_filename_full);
+	snprintf(to, sizeof(to), "%s/_%s.extracted", job->package->dir, job->rec->out_filename_full);
+	if (lstat(from, &st) == 0 && tree_copy(from, to, 1) == -1)
+		xwarnx("could not link %s to %s\n", from, to);
+	if (manifest.f && !job->timed_out && job->status == 0)
+		manifest_log("B\t%s\n", job->rec->out_filename_full);
+}
+
+/* cache key of the file binwalk runs on */
+void
+binwalk_key(struct binwalk_job *job, char *path)
+{
+	uint8_t *buf = NULL;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	if (job->size > 0) {
+		buf = mmap(NULL, job->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf == MAP_FAILED) {
+			close(fd);
+			return;
+		}
+	}
+	cache_key("bw", buf, job->size, job->key);
+	if (buf)
+		munmap(buf, job->size);
+	close(fd);
+}
+
+/*
+ * spawn binwalk for a job, logging to a file next to the extracted file.
+ * posix_spawn() does not copy the mappings of the extraction still running, unlike fork().
+ */
+void
+binwalk_start(struct binwalk_job *job, char *dir)
+{
+	char path[PATH_MAX], log[PATH_MAX];
+	char *argv[] = { "binwalk", "-eMv", job->rec->out_filename_full, NULL };
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	int res;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, job->rec->out_filename_full);
+	snprintf(log, sizeof(log), "%s/_%s.binwalk.log", dir, job->rec->out_filename_full);
+	posix_spawn_file_actions_init(&actions);
+	/* log path is relative to the current directory, file path to the extract directory binwalk extracts to */
+	posix_spawn_file_actions_addopen(&actions, 1, log, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	posix_spawn_file_actions_adddup2(&actions, 1, 2);
+	posix_spawn_file_actions_addchdir_np(&actions, dir);
+	posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+	/* own process group, to kill the extraction tools binwalk runs with it */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+	posix_spawnattr_setpgroup(&attr, 0);
+	res = posix_spawnp(&job->pid, "binwalk", &actions, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	if (res != 0) {
+		xwarnx("could not run binwalk on %s: %s\n", job->rec->out_filename_full, strerror(res));
+		job->pid = -1;
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+#ifdef SYS_pidfd_open
+	job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+#endif
+	info(0, "running binwalk on %s\n", path);
+}
+
+void
+binwalk_event(struct binwalk_job *job, double elapsed)
+{
+	struct event ev;
+
+	event_begin(&ev, "binwalk", job->rec);
+	event_str(&ev, "path", job->rec->out_filename_full);
+	event_printf(&ev, ",\"seconds\":%.2f", elapsed);
+	event_num(&ev, "status", WIFEXITED(job->status) ? WEXITSTATUS(job->status) : -1);
+	event_num(&ev, "signal", WIFSIGNALED(job->status) ? WTERMSIG(job->status) : 0);
+	event_num(&ev, "timed_out", job->timed_out);
+	event_num(&ev, "max_rss_kb", job->ru.ru_maxrss);
+	event_end(&ev);
+}
+
+int
+binwalk_job_cmp_tree(const void *a, const void *b)
+{
+	const struct binwalk_job *ja = a, *jb = b;
+
+	return rec_cmp_tree(&ja->rec, &jb->rec);
+}
+
+double
+timespec_elapsed(struct timespec *start, struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* build the signatures prefix table */
+void
+carve_init(void)
+{
+	struct carver *c;
+	uint8_t a, b, bucket = 1;
+
+	for (c = carvers; c->name; c++) {
+		a = c->sig[0];
+		b = c->sig[1];
+		if (carve_prefix[a << 8 | b])
+			continue;
+		carve_prefix[a << 8 | b] = 1;
+#ifdef CARVE_SSSE3
+		carve_nibbles[0][a & 0xf] |= bucket;
+		carve_nibbles[1][a >> 4] |= bucket;
+		carve_nibbles[2][b & 0xf] |= bucket;
+		carve_nibbles[3][b >> 4] |= bucket;
+		bucket = bucket == 0x80 ? 1 : bucket << 1;
+#endif
+	}
+#ifdef CARVE_SSSE3
+	if (__builtin_cpu_supports("ssse3"))
+		carve_next = carve_next_ssse3;
+#endif
+}
+
+/* return the next position before end starting with the two first bytes of a signature, or NULL */
+uint8_t *
+carve_next_bytes(uint8_t *p, uint8_t *end)
+{
+	for (; p + 1 < end; p++) {
+		if (carve_prefix[p[0] << 8 | p[1]])
+			return p;
+	}
+	return NULL;
+}
+
+#ifdef CARVE_SSSE3
+/* same as carve_next_bytes(), looking up the nibbles of 16 positions at once */
+__attribute__((target("ssse3"))) uint8_t *
+carve_next_ssse3(uint8_t *p, uint8_t *end)
+{
+	__m128i lo0 = _mm_load_si128((__m128i *)carve_nibbles[0]), hi0 = _mm_load_si128((__m128i *)carve_nibbles[1]);
+	__m128i lo1 = _mm_load_si128((__m128i *)carve_nibbles[2]), hi1 = _mm_load_si128((__m128i *)carve_nibbles[3]);
+	__m128i nibble = _mm_set1_epi8(0xf), zero = _mm_setzero_si128();
+	__m128i v0, v1, r;
+	unsigned int n, mask;
+
+	for (; p + 17 <= end; p += 16) {
+		v0 = _mm_loadu_si128((__m128i *)p);
+		v1 = _mm_loadu_si128((__m128i *)(p + 1));
+		r = _mm_and_si128(_mm_shuffle_epi8(lo0, _mm_and_si128(v0, nibble)),
+				_mm_shuffle_epi8(hi0, _mm_and_si128(_mm_srli_epi16(v0, 4), nibble)));
+		r = _mm_and_si128(r, _mm_shuffle_epi8(lo1, _mm_and_si128(v1, nibble)));
+		r = _mm_and_si128(r, _mm_shuffle_epi8(hi1, _mm_and_si128(_mm_srli_epi16(v1, 4), nibble)));
+		for (mask = _mm_movemask_epi8(_mm_cmpeq_epi8(r, zero)) ^ 0xffff; mask; mask &= mask - 1) {
+			n = __builtin_ctz(mask);
+			if (carve_prefix[p[n] << 8 | p[n+1]])
+				return p + n;
+		}
+	}
+	return carve_next_bytes(p, end);
+}
+#endif
+
+/*
+ * carve - extract formats known by carvers[] from the content of a record, each as a new record.
+ * content is scanned once, positions are first filtered on their two first bytes.
+ * returns 1 when binwalk is still needed: nothing was found in a record that was not carved itself,
+ * or formats only recognised were found.
+ */
+int
+carve(struct record *rec)
+{
+	uint8_t *buf = rec->content, *end = rec->content + rec->content_size, *p, *out;
+	size_t len, out_size;
+	struct carver *c;
+	int found = 0, foreign = 0;
+
+	if (rec->content_size < CARVE_SIZE_MIN)
+		return !rec->carve;
+	for (p = buf; (p = carve_next(p, end - CARVE_SIZE_MIN + 2)) != NULL; p++) {
+		for (c = carvers; c->name; c++) {
+			if ((size_t)(end - p) < c->sig_len || memcmp(p, c->sig, c->sig_len))
+				continue;
+			if (p == buf && c == rec->carve)
+				continue; /* the record itself */
+			if (!c->probe) {
+				verb(rec->depth+1, "carve: %s at 0x%lx left to binwalk\n", c->name, p - buf);
+				foreign++;
+				continue;
+			}
+			out = NULL;
+			out_size = 0;
+			len = c->probe(p, end - p, &out, &out_size);
+			if (len == 0)
+				continue;
+			if (rec->carve && p == buf && len == rec->content_size && c->handler == rec_handler_carve_raw) {
+				/* carved record is this file already, look inside it */
+				found++;
+				continue;
+			}
+			carve_add(rec, c, p, len, out, out_size, NULL, 0);
+			found++;
+			p += len - 1;
+			break;
+		}
+	}
+	return foreign > 0 || (found == 0 && !rec->carve);
+}
+
+/* extract content found by the carver as a new record, named by the name_len first bytes of name if set */
+struct record *
+carve_add(struct record *rec, struct carver *c, uint8_t *ptr, size_t size, uint8_t *out, size_t out_size, const char *name,
+		size_t name_len)
+{
+	struct record *new;
+
+	new = rec_new(rec, 0, ptr, size);
+	new->carve = c;
+	new->extract.buf = out;
+	new->extract.size = out_size;
+	if (name)
+		rec_out_filename(new, name, name_len, c->ext);
+	rec_extract(new, rec->depth+1);
+
+	return new;
+}
+
+/* name carved records by their offset in the parent content, as binwalk does */
+void
+carve_out_filename(struct record *rec)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%lX", rec->ptr - rec->parent->content);
+	rec_out_filename(rec, name, 0, rec->carve->ext);
+}
+
+/* zlib and gzip streams */
+size_t
+carve_probe_zlib(uint8_t *ptr, size_t avail, uint8_t **out, size_t *out_size)
+{
+	uint8_t head[CARVE_PROBE_SIZE];
+	z_stream *strm;
+	size_t used;
+	int res;
+
+	/* most candidates are random bytes, reject them on a small output before decoding the stream */
+	strm = z_stream_get();
+	if (!strm)
+		return 0;
+	strm->next_in = ptr;
+	strm->avail_in = avail;
+	strm->next_out = head;
+	strm->avail_out = sizeof(head);
+	res = inflate(strm, Z_NO_FLUSH);
+	if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR)
+		return 0;
+
+	*out = z_inflate(ptr, avail, Z_CHUNK_SIZE, -1, 1, out_size, &used);
+	if (!*out)
+		return 0;
+	if (*out_size < CARVE_SIZE_MIN) {
+		free(*out);
+		*out = NULL;
+		return 0;
+	}
+	return used;
+}
+
+/* xz streams, checking the header crc before decoding */
+size_t
+carve_probe_xz(uint8_t *ptr, size_t avail, uint8_t **out, size_t *out_size)
+{
+	size_t used;
+
+	if (avail < 12 || crc32(0, ptr + 6, 2) != le32toh(*(uint32_t *)(ptr + 8)))
+		return 0;
+	*out = xz_decode(ptr, avail, 0, -1, out_size, &used);
+	if (!*out)
+		return 0;
+	return used;
+}
+
+/* lzma streams in the legacy .lzma format, found in uImages */
+size_t
+carve_probe_lzma(uint8_t *ptr, size_t avail, uint8_t **out, size_t *out_size)
+{
+	size_t used;
+
+	*out = xz_decode(ptr, avail, 1, -1, out_size, &used);
+	if (!*out)
+		return 0;
+	return used;
+}
+
+/* u-boot images, checking the header crc */
+size_t
+carve_probe_uimage(uint8_t *ptr, size_t avail, uint8_t **out, size_t *out_size)
+{
+	struct header_uimage h;
+	size_t size;
+
+	if (avail < sizeof(struct header_uimage))
+		return 0;
+	memcpy(&h, ptr, sizeof(h));
+	h.hcrc = 0;
+	if (crc32(0, (uint8_t *)&h, sizeof(h)) != be32toh(((struct header_uimage *)ptr)->hcrc))
+		return 0;
+	size = sizeof(struct header_uimage) + be32toh(h.size);
+	if (size > avail)
+		return 0;
+	return size;
+}
+
+/* cpio archives in newc format, up to the end of their trailer */
+size_t
+carve_probe_cpio(uint8_t *ptr, size_t avail, uint8_t **out, size_t *out_size)
+{
+	struct header_cpio *h;
+	size_t off = 0, namesize, filesize, n;
+
+	for (;;) {
+		if (off + sizeof(struct header_cpio) > avail)
+			return 0;
+		h = (struct header_cpio *)(ptr + off);
+		if (memcmp(h->magic, "07070", 5) || (h->magic[5] != '1' && h->magic[5] != '2'))
+			return 0;
+		for (n = 6; n < sizeof(struct header_cpio); n++) {
+			if (!isxdigit(ptr[off + n]))
+				return 0;
+		}
+		namesize = cpio_hex(h->namesize);
+		filesize = cpio_hex(h->filesize);
+		if (namesize == 0 || off + sizeof(struct header_cpio) + namesize > avail)
+			return 0;
+		off += (sizeof(struct header_cpio) + namesize + 3) & ~3;
+		if (filesize > avail - off)
+			return 0;
+		if (namesize == 11 && !memcmp(h + 1, "TRAILER!!!", 11))
+			return off;
+		off += (filesize + 3) & ~3;
+	}
+}
+
+/* ELF files, up to the end of their last section or segment */
+size_t
+carve_probe_elf(uint8_t *ptr, size_t avail, uint8_t **out, size_t *out_size)
+{
+	int is64, be, n;
+	uint64_t phoff, shoff, off, size, end;
+	unsigned int phentsize, phnum, shentsize, shnum, ehsize;
+
+	if (avail < 64 || (ptr[4] != 1 && ptr[4] != 2) || (ptr[5] != 1 && ptr[5] != 2) || ptr[6] != 1)
+		return 0;
+	is64 = ptr[4] == 2;
+	be = ptr[5] == 2;
+	phoff = elf_get(ptr + (is64 ? 32 : 28), is64 ? 8 : 4, be);
+	shoff = elf_get(ptr + (is64 ? 40 : 32), is64 ? 8 : 4, be);
+	ehsize = elf_get(ptr + (is64 ? 52 : 40), 2, be);
+	phentsize = elf_get(ptr + (is64 ? 54 : 42), 2, be);
+	phnum = elf_get(ptr + (is64 ? 56 : 44), 2, be);
+	shentsize = elf_get(ptr + (is64 ? 58 : 46), 2, be);
+	shnum = elf_get(ptr + (is64 ? 60 : 48), 2, be);
+	if (ehsize != (is64 ? 64 : 52)
+			|| (phnum && phentsize != (is64 ? 56 : 32))
+			|| (shnum && shentsize != (is64 ? 64 : 40))
+			|| phoff > avail || shoff > avail
+			|| phoff + phnum * phentsize > avail || shoff + shnum * shentsize > avail)
+		return 0;
+
+	end = ehsize;
+	if (phnum && phoff + phnum * phentsize > end)
+		end = phoff + phnum * phentsize;
+	if (shnum && shoff + shnum * shentsize > end)
+		end = shoff + shnum * shentsize;
+	for (n = 0; n < phnum; n++) {
+		uint8_t *ph = ptr + phoff + n * phentsize;
+		off = elf_get(ph + (is64 ? 8 : 4), is64 ? 8 : 4, be);
+		size = elf_get(ph + (is64 ? 32 : 16), is64 ? 8 : 4, be);
+		if (off + size > end)
+			end = off + size;
+	}
+	for (n = 0; n < shnum; n++) {
+		uint8_t *sh = ptr + shoff + n * shentsize;
+		if (elf_get(sh + 4, 4, be) == 8) /* SHT_NOBITS */
+			continue;
+		off = elf_get(sh + (is64 ? 24 : 16), is64 ? 8 : 4, be);
+		size = elf_get(sh + (is64 ? 32 : 20), is64 ? 8 : 4, be);
+		if (off + size > end)
+			end = off + size;
+	}
+	if (end > avail)
+		return 0;
+	return end;
+}
+
+/* Xilinx FPGA bitstreams, header fields followed by the raw bitstream length */
+size_t
+carve_probe_bit(uint8_t *ptr, size_t avail, uint8_t **out, size_t *out_size)
+{
+	size_t off = 13, len;
+	char key;
+
+	for (key = 'a'; key <= 'd'; key++) {
+		if (off + 3 > avail || ptr[off] != key)
+			return 0;
+		len = be16toh(*(uint16_t *)(ptr + off + 1));
+		off += 3 + len;
+	}
+	if (off + 5 > avail || ptr[off] != 'e')
+		return 0;
+	len = be32toh(*(uint32_t *)(ptr + off + 1));
+	off += 5;
+	if (len > avail - off)
+		return 0;
+	return off + len;
+}
+
+/* carved compressed stream, already decoded by it's probe */
+enum extract_res
+rec_handler_carve_decompress(struct record *rec)
+{
+	uint8_t *p = rec->ptr, *name;
+
+	carve_out_filename(rec);
+	if (p[0] == 0x1f && p[1] == 0x8b && (p[3] & 0x08) && rec->size > 10) {
+		/* gzip original file name */
+		name = p + 10;
+		if (p[3] & 0x04)
+			name += 2 + (name[0] | name[1] << 8);
+		if (name < p + rec->size && *name && memchr(name, 0, p + rec->size - name))
+			rec_out_filename(rec, (char *)name, strnlen((char *)name, NAME_MAX - 1), NULL);
+	}
+	rec_write(rec, 0, rec->extract.buf, rec->extract.size);
+	if (rec_extract_new(rec, -1, rec->extract.buf, rec->extract.size, rec->depth+1) != EXTRACT_FAILED_NO_HANDLER)
+		return EXTRACT_DONE;
+
+	return EXTRACT_USE_BINWALK;
+}
+
+/* carved file copied as is, then scanned for more formats */
+enum extract_res
+rec_handler_carve_raw(struct record *rec)
+{
+	carve_out_filename(rec);
+	rec_write(rec, 0, rec->ptr, rec->size);
+
+	return EXTRACT_USE_BINWALK;
+}
+
+enum extract_res
+rec_handler_uimage(struct record *rec)
+{
+	struct header_uimage *h = (struct header_uimage *)rec->ptr;
+	uint8_t *out;
+	size_t len, out_size;
+
+	info(rec->depth+1, "%.32s, compression %d\n", h->name, h->comp);
+	carve_out_filename(rec);
+	rec_write(rec, 0, rec->ptr, rec->size);
+	/* scan the image data only, and decode lzma that is not found by signature */
+	rec->content = rec->ptr + sizeof(struct header_uimage);
+	rec->content_size = rec->size - sizeof(struct header_uimage);
+	if (h->comp == 3 && (len = carve_probe_lzma(rec->content, rec->content_size, &out, &out_size)) > 0) {
+		carve_add(rec, &carver_lzma, rec->content, len, out, out_size, NULL, 0);
+		return EXTRACT_DONE;
+	}
+
+	return EXTRACT_USE_BINWALK;
+}
+
+/* cpio archive, regular files are extracted as carved records */
+enum extract_res
+rec_handler_cpio(struct record *rec)
+{
+	struct header_cpio *h;
+	size_t off = 0, namesize, namelen, filesize;
+	char *name;
+
+	carve_out_filename(rec);
+	rec_write(rec, 0, rec->ptr, rec->size);
+	while (off < rec->size) {
+		h = (struct header_cpio *)(rec->ptr + off);
+		namesize = cpio_hex(h->namesize);
+		filesize = cpio_hex(h->filesize);
+		name = (char *)(h + 1);
+		namelen = 0;
+		if (namesize > 0 && (uint8_t *)name < rec->ptr + rec->size) {
+			namelen = rec->ptr + rec->size - (uint8_t *)name;
+			namelen = strnlen(name, (namesize - 1 < namelen) ? namesize - 1 : namelen);
+		}
+		off += (sizeof(struct header_cpio) + namesize + 3) & ~3;
+		if ((cpio_hex(h->mode) & S_IFMT) == S_IFREG && filesize > 0) {
+			while (namelen > 0 && (*name == '.' || *name == '/')) {
+				name++;
+				namelen--;
+			}
+			if (namelen > NAME_MAX - 1)
+				namelen = NAME_MAX - 1;
+			if (namelen > 0)
+				carve_add(rec, &carver_cpio_file, rec->ptr + off, filesize, NULL, 0, name, namelen);
+			else
+				carve_add(rec, &carver_cpio_file, rec->ptr + off, filesize, NULL, 0, "file", 0);
+		}
+		off += (filesize + 3) & ~3;
+	}
+
+	return EXTRACT_DONE;
+}
+
+enum extract_res
+rec_handler_cpio_file(struct record *rec)
+{
+	rec_write(rec, 0, rec->ptr, rec->size);
+
+	return EXTRACT_USE_BINWALK;
+}
+
+/* read a cpio header field, checked to be hexadecimal by carve_probe_cpio() */
+size_t
+cpio_hex(char *field)
+{
+	char buf[9];
+
+	memcpy(buf, field, 8);
+	buf[8] = '\0';
+	return strtoul(buf, NULL, 16);
+}
+
+/* read an ELF field of len bytes */
+uint64_t
+elf_get(uint8_t *p, int len, int be)
+{
+	uint64_t v = 0;
+	int n;
+
+	for (n = 0; n < len; n++)
+		v |= (uint64_t)p[be ? n : len - 1 - n] << (8 * (len - 1 - n));
+	return v;
+}
+
+/* prepare conf.jobs workers, tasks can then be queued from the main thread before sched_wait() */
+void
+sched_init(void)
+{
+	unsigned int n;
+
+	sched.count = conf.jobs;
+	sched.workers = xmalloc(sched.count * sizeof(struct worker));
+	for (n=0; n<sched.count; n++) {
+		sched.workers[n].id = n;
+		sched.workers[n].stats = xmalloc(packages.count * sizeof(struct stats));
+		pthread_mutex_init(&sched.workers[n].tasks.lock, NULL);
+	}
+}
+
+/* run the workers until all tasks are done */
+void
+sched_wait(void)
+{
+	struct worker *w;
+	unsigned int n, p;
+
+	worker = NULL;
+	for (n=0; n<sched.count; n++) {
+		if (pthread_create(&sched.workers[n].thread, NULL, sched_worker, &sched.workers[n]) != 0)
+			err(1, "pthread_create");
+	}
+	for (n=0; n<sched.count; n++)
+		pthread_join(sched.workers[n].thread, NULL);
+	for (n=0; n<sched.count; n++) {
+		w = &sched.workers[n];
+		for (p=0; p<packages.count; p++)
+			stats_add(&packages.list[p].stats, &w->stats[p]);
+		free(w->stats);
+		arena_merge(&arena_main, &w->arena);
+		pthread_mutex_destroy(&w->tasks.lock);
+		free(w->tasks.tasks);
+	}
+	free(sched.workers);
+	sched.workers = NULL;
+}
+
+/*
+ * run a task on each source file using conf.jobs threads, to extract or verify them.
+ * when extracting, the parts of their records are queued as tasks too, workers steal tasks from each other
+ * when they run out of work, so that a single large file can use all the workers.
+ * each source file logs to it's own buffer, printed in the original order once all tasks are done.
+ */
+void
+sched_files(struct record **recs, unsigned int count, void (*run)(struct record *))
+{
+	struct record *rec;
+	unsigned int n;
+
+	sched_init();
+	for (n=0; n<count; n++) {
+		rec = recs[n];
+		rec->log = logbuf_new();
+		worker = &sched.workers[n % sched.count];
+		sched_push(run, rec);
+	}
+	sched_wait();
+	for (n=0; n<count; n++) {
+		rec = recs[n];
+		logbuf_print(rec->log, stdout);
+		rec->log = NULL;
+	}
+}
+
+/* reassemble the sequences starting in reassembly list [from, to) in parallel, they are independent */
+void
+sched_reassemble(size_t from, size_t to)
+{
+	struct record *rec;
+	size_t n;
+
+	sched_init();
+	for (n=from; n<to; n++) {
+		rec = reassembly.recs[n];
+		if (rec->extract.seq_prev)
+			continue;
+		rec->log = logbuf_new();
+		worker = &sched.workers[n % sched.count];
+		sched_push(task_reassemble, rec);
+	}
+	sched_wait();
+	for (n=from; n<to; n++) {
+		rec = reassembly.recs[n];
+		if (rec->extract.seq_prev)
+			continue;
+		logbuf_print(rec->log, stdout);
+		rec->log = NULL;
+	}
+}
+
+/* queue a task on the current worker */
+void
+sched_push(void (*run)(struct record *), struct record *rec)
+{
+	struct task task = { run, rec };
+
+	__atomic_add_fetch(&sched.pending, 1, __ATOMIC_SEQ_CST);
+	if (logbuf) {
+		/* output of the task goes at the current position of our log */
+		if (!rec->log)
+			rec->log = logbuf_new();
+		rec->log->pos = ftell(logbuf->f);
+		if (logbuf->childs_last)
+			logbuf->childs_last->next = rec->log;
+		else
+			logbuf->childs = rec->log;
+		logbuf->childs_last = rec->log;
+	}
+	deque_push(&worker->tasks, &task);
+	__atomic_add_fetch(&sched.queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sched.sleeping, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&sched.lock);
+		pthread_cond_signal(&sched.cond);
+		pthread_mutex_unlock(&sched.lock);
+	}
+}
+
+/* take a task from our own deque, or steal one from another worker */
+int
+sched_take(struct task *task)
+{
+	unsigned int n;
+	int found;
+
+	found = deque_pop(&worker->tasks, task);
+	for (n=1; !found && n<sched.count; n++)
+		found = deque_steal(&sched.workers[(worker->id + n) % sched.count].tasks, task);
+	if (found)
+		__atomic_sub_fetch(&sched.queued, 1, __ATOMIC_SEQ_CST);
+	return found;
+}
+
+void *
+sched_worker(void *arg)
+{
+	struct task task;
+
+	worker = arg;
+	arena = &worker->arena;
+	for (;;) {
+		if (sched_take(&task)) {
+			stats = &worker->stats[rec_root(task.rec)->package - packages.list];
+			task.run(task.rec);
+			if (__atomic_sub_fetch(&sched.pending, 1, __ATOMIC_SEQ_CST) == 0) {
+				pthread_mutex_lock(&sched.lock);
+				pthread_cond_broadcast(&sched.cond);
+				pthread_mutex_unlock(&sched.lock);
+			}
+			continue;
+		}
+		pthread_mutex_lock(&sched.lock);
+		__atomic_add_fetch(&sched.sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&sched.queued, __ATOMIC_SEQ_CST) == 0
+				&& __atomic_load_n(&sched.pending, __ATOMIC_SEQ_CST) > 0)
+			pthread_cond_wait(&sched.cond, &sched.lock);
+		__atomic_sub_fetch(&sched.sleeping, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&sched.lock);
+		if (__atomic_load_n(&sched.pending, __ATOMIC_SEQ_CST) == 0)
+			break;
+	}
+	z_stream_free();
+	return NULL;
+}
+
+/* extract a source file or a record part, logging to the record's own buffer */
+void
+task_extract(struct record *rec)
+{
+	logbuf = rec->log;
+	if (packages.batch && rec->package && rec == rec->package->roots[0])
+		info(0, "package %s\n", rec->package->upgrade_dir);
+	if (!rec->parent)
+		info(0, "file %s [%li]\n", rec->filename, rec->size);
+	rec_extract(rec, rec->depth);
+	logbuf = NULL;
+}
+
+void
+task_reassemble(struct record *rec)
+{
+	logbuf = rec->log;
+	reassembly_run(rec);
+	logbuf = NULL;
+}
+
+void
+task_verify(struct record *rec)
+{
+	logbuf = rec->log;
+	verb(0, "file %s [%li]\n", rec->filename, rec->size);
+	crc_walk(rec, rec->ptr, rec->size, 1, crc_check);
+	logbuf = NULL;
+}
+
+void
+deque_push(struct deque *dq, struct task *task)
+{
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail == dq->alloc) {
+		if (dq->head > 0) {
+			memmove(dq->tasks, dq->tasks + dq->head, (dq->tail - dq->head) * sizeof(struct task));
+			dq->tail -= dq->head;
+			dq->head = 0;
+		} else {
+			dq->alloc = dq->alloc ? dq->alloc * 2 : 64;
+			dq->tasks = realloc(dq->tasks, dq->alloc * sizeof(struct task));
+			if (!dq->tasks)
+				err(1, "realloc");
+		}
 	}
-	if (rec->out_fileext) {
-		strcat(out_filepath, ".");
-		strcat(out_filepath, rec->out_fileext);
-		out_filepath_len += strlen(rec->out_fileext) + 1;
+	dq->tasks[dq->tail++] = *task;
+	pthread_mutex_unlock(&dq->lock);
+}
+
+int
+deque_pop(struct deque *dq, struct task *task)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		*task = dq->tasks[--dq->tail];
+		found = 1;
 	}
-	verb(rec->depth+1, "rec_write path %s\n", out_filepath);
+	if (dq->tail == dq->head)
+		dq->head = dq->tail = 0;
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
 
-	/* save full filename in the record */
-	if (rec->out_filename_full)
-		free(rec->out_filename_full);
-	rec->out_filename_full = strdup(out_filepath);
+int
+deque_steal(struct deque *dq, struct task *task)
+{
+	int found = 0;
 
-	/* prepend extract_dir_base directory */
-	len = strlen(conf.extract_dir_base);
-	memmove(out_filepath+len+1, out_filepath, out_filepath_len+1);
-	strcpy(out_filepath, conf.extract_dir_base);
-	out_filepath[len] = '/';
+	pthread_mutex_lock(&dq->lock);
+	if (dq->tail > dq->head) {
+		*task = dq->tasks[dq->head++];
+		found = 1;
+	}
+	if (dq->tail == dq->head)
+		dq->head = dq->tail = 0;
+	pthread_mutex_unlock(&dq->lock);
+	return found;
+}
 
-	info(rec->depth+1, "part %d: writing file %s [%lu]\n", n, out_filepath, size);
+void
+stats_add(struct stats *to, struct stats *from)
+{
+	unsigned int n, b;
 
-	/* write the file */
-	f = fopen(out_filepath, "w");
-	if (!f) {
-		warn("error writing file");
-		stats.extract_errors++;
-		return;
+	to->records_count += from->records_count;
+	to->unknown_records += from->unknown_records;
+	if (from->max_depth > to->max_depth)
+		to->max_depth = from->max_depth;
+	to->extract_ok += from->extract_ok;
+	to->extract_errors += from->extract_errors;
+	if (from->ucf)
+		to->ucf = from->ucf;
+	if (from->met)
+		to->met = from->met;
+	if (from->zfj)
+		to->zfj = from->zfj;
+	to->warnings += from->warnings;
+	to->carved += from->carved;
+	to->cache_hits += from->cache_hits;
+	to->deduplicated += from->deduplicated;
+	to->crc_checked += from->crc_checked;
+	to->crc_errors += from->crc_errors;
+	for (n=0; conf.profile && n<PROF_SLOTS; n++) {
+		to->prof[n].calls += from->prof[n].calls;
+		to->prof[n].wall_ns += from->prof[n].wall_ns;
+		to->prof[n].self_ns += from->prof[n].self_ns;
+		to->prof[n].cpu_ns += from->prof[n].cpu_ns;
+		to->prof[n].bytes_in += from->prof[n].bytes_in;
+		to->prof[n].bytes_out += from->prof[n].bytes_out;
+		for (b=0; b<PROF_BUCKETS; b++)
+			to->prof[n].hist[b] += from->prof[n].hist[b];
 	}
-	fwrite(start, size, 1, f);
-    fclose(f);
+}
+
+uint64_t
+prof_clock(clockid_t clock)
+{
+	struct timespec ts;
 
-	stats.extract_ok++;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
+/* start timing a profiled call, ended by prof_end() in the same thread */
 void
-rec_free(struct record *rec)
+prof_begin(void)
 {
-	if (rec->filename)
-		free(rec->filename);
-	if (rec->out_filename)
-		free(rec->out_filename);
-	if (rec->out_filename_full)
-		free(rec->out_filename_full);
-	if (rec->size && !rec->parent) {
-		/* no parent means file based */
-		munmap(rec->ptr, rec->size);
+	struct prof_frame *f;
+
+	if (prof_depth < PROF_DEPTH) {
+		f = &prof_stack[prof_depth];
+		f->wall = prof_clock(CLOCK_MONOTONIC);
+		f->cpu = prof_clock(CLOCK_THREAD_CPUTIME_ID);
+		f->child_wall = 0;
+		f->child_cpu = 0;
 	}
-	if (rec->extract.buf)
-		free(rec->extract.buf);
-	if (rec->childs_count > 0) {
-		unsigned int n;
+	prof_depth++;
+}
 
-		for (n=0; n < rec->childs_count; n++) {
-			rec_free(rec->childs[n]);
-		}
+/* account the call started by the last prof_begin(), it's time is excluded from the self time of the caller */
+void
+prof_end(enum prof_slot slot, uint64_t bytes_in, uint64_t bytes_out)
+{
+	struct prof_counter *c = &stats->prof[slot];
+	struct prof_frame *f;
+	uint64_t wall, cpu;
+
+	if (--prof_depth >= PROF_DEPTH)
+		return;
+	f = &prof_stack[prof_depth];
+	wall = prof_clock(CLOCK_MONOTONIC) - f->wall;
+	cpu = prof_clock(CLOCK_THREAD_CPUTIME_ID) - f->cpu;
+	c->calls++;
+	c->wall_ns += wall;
+	c->self_ns += wall - f->child_wall;
+	c->cpu_ns += cpu - f->child_cpu;
+	c->bytes_in += bytes_in;
+	c->bytes_out += bytes_out;
+	c->hist[prof_bucket(bytes_in)]++;
+	if (prof_depth > 0) {
+		prof_stack[prof_depth-1].child_wall += wall;
+		prof_stack[prof_depth-1].child_cpu += cpu;
+	}
+}
+
+/* histogram bucket of a size: < 1 KB, < 4 KB, ... < 64 MB, >= 64 MB */
+unsigned int
+prof_bucket(uint64_t size)
+{
+	unsigned int b;
+
+	if (size < 1024)
+		return 0;
+	b = (63 - __builtin_clzll(size) - 10) / 2 + 1;
+	return b < PROF_BUCKETS ? b : PROF_BUCKETS - 1;
+}
+
+enum prof_slot
+prof_handler(enum extract_res (*handler)(struct record *))
+{
+	unsigned int n;
+
+	for (n=0; handler_names[n].name; n++) {
+		if (handler_names[n].handler == handler)
+			return PROF_HANDLERS + n;
 	}
-	free(rec);
+	return PROF_EXTRACT;	/* not reached, magics only use named handlers */
+}
+
+/* carvers sharing a name share a counter, the lzma and cpio file carvers come after the table */
+enum prof_slot
+prof_carver(struct carver *c)
+{
+	unsigned int handlers = sizeof(handler_names) / sizeof(handler_names[0]) - 1;
+	unsigned int count = sizeof(carvers) / sizeof(carvers[0]) - 1, n;
+
+	if (c == &carver_lzma)
+		return PROF_HANDLERS + handlers + count;
+	if (c == &carver_cpio_file)
+		return PROF_HANDLERS + handlers + count + 1;
+	for (n=0; n < count && strcmp(carvers[n].name, c->name); n++);
+	return PROF_HANDLERS + handlers + n;
+}
+
+char *
+prof_name(enum prof_slot slot, char *buf, size_t len)
+{
+	static char *names[] = { "rec_extract", "z_inflate", "xz_decode", "rec_write", "reassembly", "carve", "binwalk" };
+	unsigned int handlers = sizeof(handler_names) / sizeof(handler_names[0]) - 1;
+	unsigned int count = sizeof(carvers) / sizeof(carvers[0]) - 1;
+	unsigned int carver = slot - PROF_HANDLERS - handlers;
+
+	if (slot < PROF_HANDLERS)
+		snprintf(buf, len, "%s", names[slot]);
+	else if (slot < PROF_HANDLERS + handlers)
+		snprintf(buf, len, "handler %s", handler_names[slot - PROF_HANDLERS].name);
+	else if (carver < count)
+		snprintf(buf, len, "carver %s", carvers[carver].name);
+	else
+		snprintf(buf, len, "carver %s", carver == count ? carver_lzma.name : carver_cpio_file.name);
+	return buf;
 }
 
 /*
- * filename: string that can be freed
- * ext: static string
+ * print the profile table after the summary. times of worker threads add up, they can exceed the run time.
+ * binwalk times are those of it's child processes, with cpu time from their resource usage.
  */
 void
-rec_out_filename(struct record *rec, const char *filename, size_t filename_max, const char *ext)
+prof_report(struct stats *st, double elapsed)
 {
-	char buf[NAME_MAX];
-	char *p = buf, *s = buf;
+	static char *buckets[PROF_BUCKETS] = { "<1K", "<4K", "<16K", "<64K", "<256K", "<1M", "<4M", "<16M", "<64M", ">=64M" };
+	struct prof_counter *c;
+	char name[64];
+	unsigned int n, b;
 
-	if (rec->out_filename)
-		free(rec->out_filename);
+	printf("\nprofile, %.3fs elapsed\n", elapsed);
+	printf("%-24s %8s %10s %10s %10s %10s %10s %6s %8s\n", "", "calls", "total ms", "self ms", "cpu ms", "in MB", "out MB", "ratio", "MB/s");
+	for (n=0; n<PROF_SLOTS; n++) {
+		c = &st->prof[n];
+		if (!c->calls)
+			continue;
+		printf("%-24s %8lu %10.1f %10.1f %10.1f %10.2f %10.2f ", prof_name(n, name, sizeof(name)), c->calls,
+			c->wall_ns / 1e6, c->self_ns / 1e6, c->cpu_ns / 1e6, c->bytes_in / 1e6, c->bytes_out / 1e6);
+		if (c->bytes_in && c->bytes_out)
+			printf("%6.2f ", (double)c->bytes_out / c->bytes_in);
+		else
+			printf("%6s ", "-");
+		if (c->self_ns)
+			printf("%8.1f\n", c->bytes_in * 1e3 / c->self_ns);
+		else
+			printf("%8s\n", "-");
+	}
+	printf("\n%-24s", "input sizes");
+	for (b=0; b<PROF_BUCKETS; b++)
+		printf(" %6s", buckets[b]);
+	printf("\n");
+	for (n=0; n<PROF_SLOTS; n++) {
+		c = &st->prof[n];
+		if (!c->calls)
+			continue;
+		printf("%-24s", prof_name(n, name, sizeof(name)));
+		for (b=0; b<PROF_BUCKETS; b++)
+			printf(" %6lu", c->hist[b]);
+		printf("\n");
+	}
+}
 
-	if (filename_max == 0)
-		filename_max = strlen(filename);
-	/* format filename: replace '/' by '-' and remove spaces */
-	strncpy(buf, filename, filename_max);
-	buf[filename_max] = '\0';
-	do {
-		while (*p == ' ' && *(p+1) == ' ')
-			++p;
-		if (*p == '/')
-			*p = '-';
-		else if (*p == ' ') {
-			if (!*(p+1))
-				++p;
-			else
-				*p = '_';
-		}
-	} while ((*s++ = *p++));
-	*(s-1) = '\0';
+/* write the profile counters as JSON, hist_bounds are the exclusive upper bounds of the histogram buckets */
+void
+prof_json(struct stats *st, double elapsed, char *path)
+{
+	struct prof_counter *c;
+	char name[64];
+	unsigned int n, b, first = 1;
+	FILE *f;
 
-	verb(rec->depth+1, "filename %s ext %s\n", buf, ext);
-	rec->out_filename = strdup(buf);
-	rec->out_fileext = ext;
+	f = fopen(path, "w");
+	if (!f) {
+		xwarnx("could not open profile file %s\n", path);
+		return;
+	}
+	fprintf(f, "{\"elapsed_ns\":%lu,\"hist_bounds\":[", (uint64_t)(elapsed * 1e9));
+	for (b=0; b<PROF_BUCKETS - 1; b++)
+		fprintf(f, "%s%lu", b ? "," : "", 1024UL << (b * 2));
+	fprintf(f, "],\"counters\":[");
+	for (n=0; n<PROF_SLOTS; n++) {
+		c = &st->prof[n];
+		if (!c->calls)
+			continue;
+		fprintf(f, "%s\n{\"name\":\"%s\",\"calls\":%lu,\"wall_ns\":%lu,\"self_ns\":%lu,\"cpu_ns\":%lu,\"bytes_in\":%lu,\"bytes_out\":%lu,\"hist\":[",
+			first ? "" : ",", prof_name(n, name, sizeof(name)), c->calls, c->wall_ns, c->self_ns, c->cpu_ns, c->bytes_in, c->bytes_out);
+		for (b=0; b<PROF_BUCKETS; b++)
+			fprintf(f, "%s%lu", b ? "," : "", c->hist[b]);
+		fprintf(f, "]}");
+		first = 0;
+	}
+	fprintf(f, "\n]}\n");
+	if (fclose(f) == EOF)
+		warn("could not write profile file %s", path);
+}
+
+/*
+ * decompress a zlib or gzip stream, quietly when probing for a stream.
+ * size_hint is the expected decompressed size, 0 if unknown: when plausible the output buffer is allocated
+ * once with this size, otherwise it grows geometrically.
+ * with fd != -1, output goes to a shared mapping of this file, sized using ftruncate(). only the head of the
+ * output is kept in memory, written windows are released as soon as they are complete.
+ * the decompressed size and the number of compressed bytes actually consumed are returned in out_size and in_used.
+ */
+uint8_t *
+z_inflate(uint8_t *in, size_t in_size, size_t size_hint, int fd, int quiet, size_t *out_size, size_t *in_used)
+{
+	uint8_t *buf;
+
+	if (!conf.profile)
+		return z_inflate_stream(in, in_size, size_hint, fd, quiet, out_size, in_used);
+	prof_begin();
+	buf = z_inflate_stream(in, in_size, size_hint, fd, quiet, out_size, in_used);
+	prof_end(PROF_INFLATE, *in_used, *out_size);
+	return buf;
 }
 
 uint8_t *
-z_inflate(uint8_t *in, size_t in_size, size_t *out_size)
+z_inflate_stream(uint8_t *in, size_t in_size, size_t size_hint, int fd, int quiet, size_t *out_size, size_t *in_used)
 {
-	uint8_t *buf = NULL, *in_p = in;
-	size_t size = 0, alloc_size = 0;
-	z_stream strm;
+	uint8_t *buf;
+	size_t size = 0, alloc_size, released = Z_STREAM_HEAD, avail;
+	z_stream *strm;
 	int res;
 
-	bzero(&strm, sizeof(strm));
-	if (inflateInit(&strm) != Z_OK)
-        return NULL;
+	*out_size = 0;
+	*in_used = 0;
+	strm = z_stream_get();
+	if (!strm)
+		return NULL;
 
-	do {
-		strm.avail_in = (in + in_size) - in_p;
-		if (strm.avail_in <= 0)
-            break;
-		strm.next_in = in_p;
-		do {
-			alloc_size += Z_CHUNK_SIZE;
-			buf = realloc(buf, alloc_size);
-			strm.avail_out = Z_CHUNK_SIZE;
-			strm.next_out = buf + alloc_size - Z_CHUNK_SIZE;
-			res = inflate(&strm, Z_NO_FLUSH);
-			if (res != Z_OK && res != Z_STREAM_END) {
+	if (size_hint > 0 && size_hint / Z_RATIO_MAX <= in_size)
+		alloc_size = size_hint;
+	else
+		alloc_size = (in_size * 4 > Z_CHUNK_SIZE) ? in_size * 4 : Z_CHUNK_SIZE;
+	buf = z_grow(NULL, 0, alloc_size, fd);
+
+	strm->next_in = in;
+	strm->avail_in = in_size;
+	for (;;) {
+		avail = alloc_size - size;
+		if (fd != -1 && avail > Z_STREAM_WINDOW)
+			avail = Z_STREAM_WINDOW;
+		strm->next_out = buf + size;
+		strm->avail_out = avail;
+		res = inflate(strm, Z_NO_FLUSH);
+		size += avail - strm->avail_out;
+		if (fd != -1 && size >= released + Z_STREAM_WINDOW) {
+			/* written pages are in the file, release them from our memory */
+			madvise(buf + released, size - released, MADV_DONTNEED);
+			released = size & ~(sysconf(_SC_PAGESIZE) - 1);
+		}
+		if (res == Z_STREAM_END)
+			break;
+		if (res != Z_OK && res != Z_BUF_ERROR) {
+			if (!quiet)
 				xwarnx("z_inflate decompression failed, error %d\n", res);
-				inflateEnd(&strm);
+			if (fd != -1)
+				munmap(buf, alloc_size);
+			else
 				free(buf);
-				return NULL;
-			}
-			size += Z_CHUNK_SIZE - strm.avail_out;
-			verb(0, "z_inflate in_size=%d strm.avail_in=%d size=%d\n", in_size, strm.avail_in, size);
-		} while (strm.avail_out == 0); /* no more output */
-		in_p += Z_CHUNK_SIZE;
-	} while (res != Z_STREAM_END); /* done when inflate() says it's done */
+			return NULL;
+		}
+		if (strm->avail_out > 0) {
+			/* input exhausted before the end of stream */
+			verb(0, "z_inflate truncated stream, in_size=%zu size=%zu\n", in_size, size);
+			break;
+		}
+		if (size == alloc_size) {
+			/* size hint was wrong or unknown */
+			buf = z_grow(buf, alloc_size, alloc_size * 2, fd);
+			alloc_size *= 2;
+		}
+	}
+	if (fd != -1 && size < alloc_size && size > 0) {
+		/* shrink the file to it's actual content */
+		buf = z_grow(buf, alloc_size, size, fd);
+	} else if (fd != -1 && size == 0) {
+		/* empty output, return an empty buffer in memory */
+		if (ftruncate(fd, 0) == -1)
+			err(1, "ftruncate");
+		munmap(buf, alloc_size);
+		buf = xmalloc(1);
+	}
 
-	inflateEnd(&strm);
+	*in_used = in_size - strm->avail_in;
 	*out_size = size;
 	return buf;
 }
 
+/* resize a decompression buffer, allocated in memory or as a shared mapping of fd */
+uint8_t *
+z_grow(uint8_t *buf, size_t size, size_t new_size, int fd)
+{
+	if (fd == -1) {
+		buf = realloc(buf, new_size);
+		if (!buf)
+			err(1, "realloc");
+		return buf;
+	}
+	if (ftruncate(fd, new_size) == -1)
+		err(1, "ftruncate");
+	if (!buf)
+		buf = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	else
+		buf = mremap(buf, size, new_size, MREMAP_MAYMOVE);
+	if (buf == MAP_FAILED)
+		err(1, "mmap");
+	return buf;
+}
+
+/*
+ * return the inflate context of the current thread, ready for a new stream.
+ * archive parts are decompressed by the extraction workers, each keeping it's context between parts
+ * instead of allocating zlib state and window again for every part.
+ */
+z_stream *
+z_stream_get(void)
+{
+	if (zstrm) {
+		if (inflateReset(zstrm) == Z_OK)
+			return zstrm;
+		z_stream_free();
+	}
+	zstrm = xmalloc(sizeof(z_stream));
+	if (inflateInit2(zstrm, 15 + 32) != Z_OK) { /* zlib or gzip header */
+		xwarnx("z_inflate could not initialize zlib\n");
+		free(zstrm);
+		zstrm = NULL;
+	}
+	return zstrm;
+}
+
 void
-sigchld_binwalk(int sig)
+z_stream_free(void)
 {
-	int pid;
-	int status;
-	int n = 0;
+	if (!zstrm)
+		return;
+	inflateEnd(zstrm);
+	free(zstrm);
+	zstrm = NULL;
+}
 
-	pid = wait(&status);
-	while (binwalk.pids[n] != pid)
-		n++;
-	binwalk.status[n] = status;
-	binwalk.running--;
+/*
+ * decompress a xz stream, or with alone set a lzma stream in the legacy .lzma format.
+ * with multiple jobs, blocks of xz streams that store their size are decoded in parallel.
+ * with fd != -1, output goes to a shared mapping of this file, as in z_inflate().
+ * returns NULL when the stream is invalid or truncated.
+ */
+uint8_t *
+xz_decode(uint8_t *in, size_t in_size, int alone, int fd, size_t *out_size, size_t *in_used)
+{
+	uint8_t *buf;
+
+	if (!conf.profile)
+		return xz_decode_stream(in, in_size, alone, fd, out_size, in_used);
+	prof_begin();
+	buf = xz_decode_stream(in, in_size, alone, fd, out_size, in_used);
+	prof_end(PROF_XZ, *in_used, *out_size);
+	return buf;
+}
+
+uint8_t *
+xz_decode_stream(uint8_t *in, size_t in_size, int alone, int fd, size_t *out_size, size_t *in_used)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	size_t alloc_size = Z_CHUNK_SIZE, size = 0, released = Z_STREAM_HEAD, avail;
+	unsigned int threads __attribute__((unused));
+	uint8_t *buf;
+	lzma_ret res;
+
+	*out_size = 0;
+	*in_used = 0;
+	if (alone)
+		res = lzma_alone_decoder(&strm, XZ_MEMLIMIT);
+#if LZMA_VERSION >= 50040002
+	else if ((threads = jobs_share()) > 1) {
+		lzma_mt mt = { .threads = threads, .memlimit_threading = XZ_MEMLIMIT, .memlimit_stop = XZ_MEMLIMIT };
+		res = lzma_stream_decoder_mt(&strm, &mt);
+	}
+#endif
+	else
+		res = lzma_stream_decoder(&strm, XZ_MEMLIMIT, 0);
+	if (res != LZMA_OK)
+		return NULL;
+
+	buf = z_grow(NULL, 0, alloc_size, fd);
+	strm.next_in = in;
+	strm.avail_in = in_size;
+	for (;;) {
+		avail = alloc_size - size;
+		if (fd != -1 && avail > Z_STREAM_WINDOW)
+			avail = Z_STREAM_WINDOW;
+		strm.next_out = buf + size;
+		strm.avail_out = avail;
+		res = lzma_code(&strm, LZMA_FINISH);
+		size += avail - strm.avail_out;
+		if (fd != -1 && size >= released + Z_STREAM_WINDOW) {
+			madvise(buf + released, size - released, MADV_DONTNEED);
+			released = size & ~(sysconf(_SC_PAGESIZE) - 1);
+		}
+		if (res == LZMA_STREAM_END)
+			break;
+		if (res != LZMA_OK) {
+			verb(0, "xz_decode failed, error %d, in %zu out %zu\n", res, (size_t)strm.total_in, size);
+			lzma_end(&strm);
+			if (fd != -1)
+				munmap(buf, alloc_size);
+			else
+				free(buf);
+			return NULL;
+		}
+		if (size == alloc_size) {
+			buf = z_grow(buf, alloc_size, alloc_size * 2, fd);
+			alloc_size *= 2;
+		}
+	}
+	*in_used = strm.total_in;
+	lzma_end(&strm);
+	if (fd != -1 && size < alloc_size && size > 0) {
+		buf = z_grow(buf, alloc_size, size, fd);
+	} else if (fd != -1 && size == 0) {
+		if (ftruncate(fd, 0) == -1)
+			err(1, "ftruncate");
+		munmap(buf, alloc_size);
+		buf = xmalloc(1);
+	}
+	*out_size = size;
+
+	return buf;
+}
+
+/*
+ * threads a decoder may use, so that the threads of a pool do not start conf.jobs each:
+ * outside the pools, all the jobs, otherwise an equal share between the busy threads of the pool, at least one
+ */
+unsigned int
+jobs_share(void)
+{
+	unsigned int busy = 1;
+
+	if (worker)
+		busy = sched.count - __atomic_load_n(&sched.sleeping, __ATOMIC_SEQ_CST);
+	else if (__atomic_load_n(&packages.scanning, __ATOMIC_SEQ_CST) > 0)
+		busy = __atomic_load_n(&packages.scanning, __ATOMIC_SEQ_CST);
+	if (busy == 0 || busy > conf.jobs)
+		return 1;
+	return conf.jobs / busy;
+}
+
+struct logbuf *
+logbuf_new(void)
+{
+	struct logbuf *lb;
+
+	lb = xmalloc(sizeof(struct logbuf));
+	lb->f = open_memstream(&lb->buf, &lb->size);
+	if (!lb->f)
+		err(1, "open_memstream");
+	return lb;
 }
 
+/* print a log buffer with the buffers of it's tasks inserted in place, and free them */
+void
+logbuf_print(struct logbuf *lb, FILE *out)
+{
+	struct logbuf *child, *next;
+	size_t pos = 0;
+
+	fclose(lb->f);
+	for (child = lb->childs; child; child = next) {
+		next = child->next;
+		fwrite(lb->buf + pos, child->pos - pos, 1, out);
+		pos = child->pos;
+		logbuf_print(child, out);
+	}
+	fwrite(lb->buf + pos, lb->size - pos, 1, out);
+	free(lb->buf);
+	free(lb);
+}
+
+/* discard a log without printing it, logs of the scan have no childs */
+void
+logbuf_free(struct logbuf *lb)
+{
+	fclose(lb->f);
+	free(lb->buf);
+	free(lb);
+}
+
+/* output stream of the current thread: stdout, or the buffer of the record being extracted */
+FILE *
+logout(void)
+{
+	return logbuf ? logbuf->f : stdout;
+}
+
+/* indentation of a log line, pointing into a static string so that it is never built */
 char *
 indent(int depth)
 {
-	static char buf[REC_DEPTH_MAX*4];
-	
-	memset(buf, ' ', depth*4);
-	buf[depth*4] = '\0';
-	return buf;
+	if (depth > REC_DEPTH_MAX+2)
+		depth = REC_DEPTH_MAX+2;
+	return indent_spaces + sizeof(indent_spaces) - 1 - depth*4;
 }
 
 void
 info(unsigned int depth, char *fmt, ...)
 {
+	FILE *f = logout();
 	va_list argp;
 
-	printf("%s", indent(depth));
+	fputs(indent(depth), f);
 	va_start(argp, fmt);
-	vprintf(fmt, argp);
+	vfprintf(f, fmt, argp);
 	va_end(argp);
 }
 
@@ -1139,27 +7010,159 @@ info(unsigned int depth, char *fmt, ...)
 void
 xwarnx(char *fmt, ...)
 {
+	char msg[PATH_MAX * 2];
 	va_list argp;
 
-	stats.warnings++;
-	printf("warning: ");
+	stats->warnings++;
 	va_start(argp, fmt);
-	vprintf(fmt, argp);
+	vsnprintf(msg, sizeof(msg), fmt, argp);
 	va_end(argp);
+	fprintf(logout(), "warning: %s", msg);
+	if (conf.events)
+		event_warning(msg);
 }
 
+/* called by verb() when verbose logging is enabled */
 void
-verb(unsigned int depth, char *fmt, ...)
+verb_log(unsigned int depth, char *fmt, ...)
 {
+	FILE *f = logout();
 	va_list argp;
 
-	if (conf.verbose == 0)
+	fputs(indent(depth), f);
+	fputs("VERB ", f);
+	va_start(argp, fmt);
+	vfprintf(f, fmt, argp);
+	va_end(argp);
+}
+
+/*
+ * With -e, events are written as NDJSON for other tools: one "record" per record parsed, one "file" per file
+ * written, one "binwalk" per binwalk run, one "warning" per warning and a "summary" at the end.
+ * Events about a record have it's source file and "tree", the positions of the record and it's ancestors
+ * in their parents, as events of parallel extractions come in any order.
+ */
+void
+event_begin(struct event *ev, const char *name, struct record *rec)
+{
+	struct record *r;
+	unsigned int tree[REC_DEPTH_MAX+2];
+	int depth = 0;
+
+	ev->len = 0;
+	event_printf(ev, "{\"event\":\"%s\"", name);
+	if (!rec)
 		return;
+	for (r = rec; r && depth < REC_DEPTH_MAX+2; r = r->parent)
+		tree[depth++] = r->index;
+	event_str(ev, "source", rec_root(rec)->filename);
+	event_printf(ev, ",\"tree\":\"");
+	while (depth-- > 0)
+		event_printf(ev, depth > 0 ? "%u/" : "%u\"", tree[depth]);
+}
+
+void
+event_printf(struct event *ev, const char *fmt, ...)
+{
+	va_list argp;
+	int len;
 
-	printf("%sVERB ", indent(depth));
+	if (ev->len >= sizeof(ev->buf))
+		return;
 	va_start(argp, fmt);
-	vprintf(fmt, argp);
+	len = vsnprintf(ev->buf + ev->len, sizeof(ev->buf) - ev->len, fmt, argp);
 	va_end(argp);
+	if (len < 0 || (size_t)len >= sizeof(ev->buf) - ev->len)
+		ev->len = sizeof(ev->buf);
+	else
+		ev->len += len;
+}
+
+/*
+ * add a string field, bytes which are not printable ascii are escaped. a value too long is cut and ends with "...",
+ * leaving EVENT_TAIL bytes for the fields that follow.
+ */
+void
+event_str(struct event *ev, const char *key, const char *value)
+{
+	const uint8_t *p;
+	char esc[8];
+	int len;
+
+	event_printf(ev, ",\"%s\":\"", key);
+	for (p = (const uint8_t *)value; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			len = snprintf(esc, sizeof(esc), "\\%c", *p);
+		else if (*p < 0x20 || *p >= 0x7f)
+			len = snprintf(esc, sizeof(esc), "\\u%04x", *p);
+		else
+			len = snprintf(esc, sizeof(esc), "%c", *p);
+		if (ev->len + len + 3 + EVENT_TAIL > sizeof(ev->buf)) {
+			event_printf(ev, "...");
+			break;
+		}
+		event_printf(ev, "%s", esc);
+	}
+	event_printf(ev, "\"");
+}
+
+void
+event_num(struct event *ev, const char *key, long value)
+{
+	event_printf(ev, ",\"%s\":%ld", key, value);
+}
+
+void
+event_end(struct event *ev)
+{
+	event_printf(ev, "}\n");
+	if (ev->len < sizeof(ev->buf))
+		fwrite(ev->buf, 1, ev->len, conf.events);
+	else
+		xwarnx("event too long, dropped\n");
+}
+
+void
+event_record(struct record *rec, struct magic *m, enum extract_res res)
+{
+	struct event ev;
+	char name[HEADER_XPLF_NAME_LEN+1];
+
+	rec_name(rec, m, name, sizeof(name));
+	event_begin(&ev, "record", rec);
+	event_str(&ev, "name", name);
+	if (rec->size >= 4)
+		event_str(&ev, "magic", ascii(rec->ptr, 4));
+	event_num(&ev, "depth", rec->depth);
+	if (!rec->base && rec->base_off != -1)
+		event_num(&ev, "offset", rec->base_off);
+	event_num(&ev, "size", rec->size);
+	event_str(&ev, "result", extract_res_names[res]);
+	event_end(&ev);
+}
+
+void
+event_file(struct record *rec, char *path, size_t size)
+{
+	struct event ev;
+
+	event_begin(&ev, "file", rec);
+	event_str(&ev, "path", manifest_relpath(path));
+	event_num(&ev, "size", size);
+	event_end(&ev);
+}
+
+void
+event_warning(char *msg)
+{
+	struct event ev;
+	size_t len = strlen(msg);
+
+	if (len > 0 && msg[len-1] == '\n')
+		msg[len-1] = '\0';
+	event_begin(&ev, "warning", NULL);
+	event_str(&ev, "message", msg);
+	event_end(&ev);
 }
 
 void *
@@ -1177,7 +7180,7 @@ xmalloc(size_t size)
 char *
 ascii(uint8_t *ptr, int len)
 {
-	static char buf[255];
+	static __thread char buf[255];
 	char *p = buf;
 	int n;
 
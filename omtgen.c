@@ -0,0 +1,658 @@
+/*
+ * Copyright (c) 2022, Laurent Ghigonis <ooookiwi@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <err.h>
+#include <limits.h>
+#include <endian.h>
+
+#include "zlib.h"
+
+/*
+ * Generates synthetic Upgrade Packages in OMT format, using the record layouts parsed by ericstract,
+ * to test and benchmark it without a real package.
+ * Each workload exercises mostly one kind of record, 'mixed' contains all of them:
+ * - raw: BDXU normal records nested 'depth' levels, with 'fanout' unknown parts on the last level
+ * - meta: METR and UCFR records of 'fanout' xml parts
+ * - archive: archives of 'fanout' zlib archive parts, in 'depth' levels of decapsulation records
+ * - xplf: an archive part holding a XPLF header of 'fanout' BLOB entries and a lmc list
+ * - rpdo: same with RPDO entries, compressed again
+ * - multipart: a XPLF of 'fanout' BLOB entries split in 4 archives A to D, to be reassembled
+ * Records end with 2 CRCs, both computed as the crc32 of the record up to them.
+ */
+
+#define CRC_LEN 4
+#define NAME_LEN 32
+#define HEADER_REC_LEN 64			/* struct header_rec */
+#define HEADER_ARCHIVE_LEN 52		/* struct header_archive */
+#define HEADER_XPLF_LEN 72			/* struct header_xplf */
+
+struct buf {
+	uint8_t *data;
+	size_t size;
+	size_t alloc;
+};
+
+static struct conf {
+	unsigned int depth;
+	unsigned int fanout;
+	unsigned int files;
+	size_t part_size;
+	uint64_t seed;
+	char *dir;
+} conf;
+
+static size_t total_size;
+static unsigned int total_files;
+
+void usageexit(void);
+void buf_put(struct buf *, const void *, size_t);
+void buf_be32(struct buf *, uint32_t);
+void buf_zero(struct buf *, size_t);
+void buf_name(struct buf *, const char *, size_t, char);
+void buf_crcs(struct buf *, size_t);
+void buf_free(struct buf *);
+uint64_t rnd(void);
+void payload(struct buf *, size_t, const char *);
+void rec_normal(struct buf *, const char *, const char *, struct buf *, unsigned int);
+void rec_decap(struct buf *, const char *, const char *, struct buf *, unsigned int);
+void rec_raw(struct buf *, const char *, unsigned int, unsigned int);
+void archive(struct buf *, const char *, struct buf *, unsigned int);
+void archive_part(struct buf *, const uint8_t *, size_t);
+void xplf(struct buf *, const char *, struct buf *, unsigned int);
+void blob(struct buf *, const char *, size_t);
+void rpdo(struct buf *, const char *, size_t);
+void lmclist(struct buf *, const char *);
+void zfj(struct buf *, const char *);
+void xplf_blobs(struct buf *, unsigned int, unsigned int);
+void write_file(const char *, struct buf *);
+void gen_raw(unsigned int);
+void gen_meta(unsigned int);
+void gen_archive(unsigned int);
+void gen_xplf(unsigned int, int);
+void gen_multipart(unsigned int);
+
+void
+usageexit(void)
+{
+	printf("usage: omtgen [-d <depth>] [-f <fanout>] [-n <files>] [-s <kilobytes>] [-S <seed>] [-w <workload>] <directory>\n");
+	printf("generates a synthetic Upgrade Package in OMT format\n");
+	printf("-d  levels of nested records, default 2\n");
+	printf("-f  parts per record, default 8\n");
+	printf("-n  files generated per kind of record, default 1\n");
+	printf("-s  size of leaf parts in KB, default 64\n");
+	printf("-S  random seed, default 1\n");
+	printf("-w  workload: raw, meta, archive, xplf, rpdo, multipart or mixed, default mixed\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *workload = "mixed";
+	unsigned int n;
+	int ch;
+
+	conf.depth = 2;
+	conf.fanout = 8;
+	conf.files = 1;
+	conf.part_size = 64 * 1024;
+	conf.seed = 1;
+
+	while ((ch = getopt(argc, argv, "d:f:n:s:S:w:")) != -1) {
+		switch (ch) {
+			case 'd':
+				conf.depth = atoi(optarg);
+				if (conf.depth < 1)
+					usageexit();
+				break;
+			case 'f':
+				conf.fanout = atoi(optarg);
+				if (conf.fanout < 1)
+					usageexit();
+				break;
+			case 'n':
+				conf.files = atoi(optarg);
+				if (conf.files < 1 || conf.files > 999)
+					usageexit();
+				break;
+			case 's':
+				conf.part_size = (size_t)atoi(optarg) * 1024;
+				if (conf.part_size == 0)
+					usageexit();
+				break;
+			case 'S':
+				conf.seed = strtoull(optarg, NULL, 0);
+				break;
+			case 'w':
+				workload = optarg;
+				break;
+			default:
+				usageexit();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc < 1)
+		usageexit();
+	conf.dir = argv[0];
+	if (mkdir(conf.dir, 0755) == -1 && errno != EEXIST)
+		err(1, "could not create %s", conf.dir);
+	/* xorshift state must not be zero */
+	conf.seed = conf.seed * 0x9e3779b97f4a7c15ULL | 1;
+
+	for (n = 0; n < conf.files; n++) {
+		if (!strcmp(workload, "raw") || !strcmp(workload, "mixed"))
+			gen_raw(n);
+		if (!strcmp(workload, "meta") || !strcmp(workload, "mixed"))
+			gen_meta(n);
+		if (!strcmp(workload, "archive") || !strcmp(workload, "mixed"))
+			gen_archive(n);
+		if (!strcmp(workload, "xplf") || !strcmp(workload, "mixed"))
+			gen_xplf(n, 0);
+		if (!strcmp(workload, "rpdo") || !strcmp(workload, "mixed"))
+			gen_xplf(n, 1);
+		if (!strcmp(workload, "multipart") || !strcmp(workload, "mixed"))
+			gen_multipart(n);
+	}
+	if (total_files == 0)
+		usageexit();
+	printf("%u files, %zu bytes\n", total_files, total_size);
+
+	return 0;
+}
+
+void
+buf_put(struct buf *b, const void *p, size_t len)
+{
+	if (b->size + len > b->alloc) {
+		while (b->size + len > b->alloc)
+			b->alloc = b->alloc ? b->alloc * 2 : 4096;
+		b->data = realloc(b->data, b->alloc);
+		if (!b->data)
+			err(1, "realloc");
+	}
+	memcpy(b->data + b->size, p, len);
+	b->size += len;
+}
+
+void
+buf_be32(struct buf *b, uint32_t v)
+{
+	v = htobe32(v);
+	buf_put(b, &v, sizeof(v));
+}
+
+void
+buf_zero(struct buf *b, size_t len)
+{
+	static const uint8_t zero[64];
+
+	for (; len > sizeof(zero); len -= sizeof(zero))
+		buf_put(b, zero, sizeof(zero));
+	buf_put(b, zero, len);
+}
+
+/* name in a fixed size field, padded */
+void
+buf_name(struct buf *b, const char *name, size_t len, char pad)
+{
+	size_t n = strlen(name);
+
+	if (n > len)
+		n = len;
+	buf_put(b, name, n);
+	for (; n < len; n++)
+		buf_put(b, &pad, 1);
+}
+
+/* the 2 CRCs ending the record starting at start */
+void
+buf_crcs(struct buf *b, size_t start)
+{
+	uint32_t crc = crc32_z(0, b->data + start, b->size - start);
+
+	buf_be32(b, crc);
+	buf_be32(b, crc);
+}
+
+void
+buf_free(struct buf *b)
+{
+	free(b->data);
+	b->data = NULL;
+	b->size = b->alloc = 0;
+}
+
+/* xorshift64 */
+uint64_t
+rnd(void)
+{
+	conf.seed ^= conf.seed << 13;
+	conf.seed ^= conf.seed >> 7;
+	conf.seed ^= conf.seed << 17;
+	return conf.seed;
+}
+
+/* content compressing to about a third, starting with tag */
+void
+payload(struct buf *b, size_t len, const char *tag)
+{
+	uint8_t chunk[4096];
+	size_t n, i = 0, l;
+
+	if (tag) {
+		l = strlen(tag);
+		buf_put(b, tag, l < len ? l : len);
+		len -= l < len ? l : len;
+	}
+	while (len > 0) {
+		l = len < sizeof(chunk) ? len : sizeof(chunk);
+		for (n = 0; n < l; n++, i++)
+			chunk[n] = i % 7 == 0 ? rnd() : i & 0xff;
+		buf_put(b, chunk, l);
+		len -= l;
+	}
+}
+
+/* normal record: struct header_rec, offsets table relative to the header, parts and CRCs */
+void
+rec_normal(struct buf *b, const char *name, const char *type, struct buf *parts, unsigned int count)
+{
+	size_t start = b->size, off, size;
+	unsigned int n;
+
+	for (n = 0, size = HEADER_REC_LEN + count * sizeof(uint32_t); n < count; n++)
+		size += parts[n].size;
+	size += CRC_LEN * 2;
+	buf_name(b, name, 8, '\0');
+	buf_be32(b, size);
+	buf_put(b, type, 4);
+	buf_be32(b, 0);
+	buf_be32(b, 0xffffffff);
+	buf_be32(b, 2);
+	buf_be32(b, 0);
+	buf_put(b, "87CZ\0\0\0\0", 8);
+	buf_be32(b, 0xffffffff);
+	buf_be32(b, 0);
+	buf_be32(b, 0);
+	buf_be32(b, 0);
+	buf_be32(b, count);
+	buf_be32(b, 0);
+	for (n = 0, off = HEADER_REC_LEN + count * sizeof(uint32_t); n < count; off += parts[n].size, n++)
+		buf_be32(b, off);
+	for (n = 0; n < count; n++)
+		buf_put(b, parts[n].data, parts[n].size);
+	buf_crcs(b, start);
+}
+
+/* 'levels' normal records of a single part around inner, as found around archives */
+void
+rec_decap(struct buf *b, const char *name, const char *type, struct buf *inner, unsigned int levels)
+{
+	struct buf level = { 0 };
+
+	if (levels == 0) {
+		buf_put(b, inner->data, inner->size);
+		return;
+	}
+	rec_decap(&level, name, type, inner, levels - 1);
+	rec_normal(b, name, type, &level, 1);
+	buf_free(&level);
+}
+
+/* BDXU records, nested up to depth, with unknown content parts on the last level */
+void
+rec_raw(struct buf *b, const char *name, unsigned int depth, unsigned int id)
+{
+	struct buf *parts;
+	char tag[32];
+	unsigned int n, count = conf.fanout + 1;
+
+	parts = calloc(count, sizeof(struct buf));
+	if (!parts)
+		err(1, "calloc");
+	/* first part is a VEP record, as in DXPR files */
+	buf_put(&parts[0], "VEP\0", 4);
+	buf_zero(&parts[0], 60);
+	for (n = 1; n < count; n++) {
+		if (depth > 1) {
+			snprintf(tag, sizeof(tag), "DX%02u%04u", depth, (id * count + n) % 10000);
+			rec_raw(&parts[n], tag, depth - 1, id * count + n);
+		} else {
+			snprintf(tag, sizeof(tag), "BIOSBIOS_P_%u", n);
+			payload(&parts[n], conf.part_size + n * 100, tag);
+		}
+	}
+	rec_normal(b, name, "BDXU", parts, count);
+	for (n = 0; n < count; n++)
+		buf_free(&parts[n]);
+	free(parts);
+}
+
+/* archive: struct header_archive, offsets table relative to the header, parts and CRCs */
+void
+archive(struct buf *b, const char *name, struct buf *parts, unsigned int count)
+{
+	size_t start = b->size, header = HEADER_ARCHIVE_LEN + count * sizeof(uint32_t), off, size;
+	unsigned int n;
+
+	for (n = 0, size = header; n < count; n++)
+		size += parts[n].size;
+	size += CRC_LEN * 2;
+	buf_name(b, name, 8, '\0');
+	buf_zero(b, 24);
+	buf_be32(b, 1);
+	buf_zero(b, 8);
+	buf_be32(b, size);
+	buf_be32(b, count);
+	for (n = 0, off = header; n < count; off += parts[n].size, n++)
+		buf_be32(b, off);
+	for (n = 0; n < count; n++)
+		buf_put(b, parts[n].data, parts[n].size);
+	buf_crcs(b, start);
+}
+
+/* archive part: struct header_archive_part and a zlib stream */
+void
+archive_part(struct buf *b, const uint8_t *data, size_t len)
+{
+	uLongf z_len = compressBound(len);
+	uint8_t *z;
+
+	z = malloc(z_len);
+	if (!z)
+		err(1, "malloc");
+	if (compress2(z, &z_len, data, len, 6) != Z_OK)
+		errx(1, "compress2 failed");
+	buf_put(b, "\0\0\x01\x04", 4);
+	buf_be32(b, z_len);
+	buf_be32(b, 0);
+	buf_be32(b, len);
+	buf_zero(b, 12);
+	buf_put(b, z, z_len);
+	free(z);
+}
+
+/* XPLF: struct header_xplf, offsets table relative to the header, parts and CRCs */
+void
+xplf(struct buf *b, const char *name, struct buf *parts, unsigned int count)
+{
+	size_t start = b->size, header = HEADER_XPLF_LEN + count * sizeof(uint32_t), off, size;
+	unsigned int n;
+
+	for (n = 0, size = header; n < count; n++)
+		size += parts[n].size;
+	size += CRC_LEN * 2;
+	buf_put(b, "XPLF", 4);
+	buf_be32(b, 1);
+	buf_be32(b, 0xffff);
+	buf_name(b, name, NAME_LEN, ' ');
+	buf_be32(b, 0);
+	buf_be32(b, 0);
+	buf_be32(b, size);
+	buf_be32(b, 0);
+	buf_be32(b, 0xffffffff);
+	buf_be32(b, 0xffffffff);
+	buf_be32(b, count);
+	for (n = 0, off = header; n < count; off += parts[n].size, n++)
+		buf_be32(b, off);
+	for (n = 0; n < count; n++)
+		buf_put(b, parts[n].data, parts[n].size);
+	buf_crcs(b, start);
+}
+
+/* BLOB entry of a XPLF: struct header_blob and content, starting with an uImage magic */
+void
+blob(struct buf *b, const char *name, size_t len)
+{
+	buf_put(b, "BLOB", 4);
+	buf_be32(b, 0x808a46);
+	buf_be32(b, 80);
+	buf_zero(b, 12);
+	buf_name(b, name, NAME_LEN, ' ');
+	buf_be32(b, 0);
+	buf_zero(b, 32);
+	payload(b, len, "\x27\x05\x19\x56");
+}
+
+/* RPDO entry of a XPLF: struct header_rpdo, a zlib stream, and a CXC name near the end */
+void
+rpdo(struct buf *b, const char *name, size_t len)
+{
+	struct buf content = { 0 };
+	uLongf z_len;
+	uint8_t *z;
+
+	payload(&content, len, NULL);
+	z_len = compressBound(content.size);
+	z = malloc(z_len);
+	if (!z)
+		err(1, "malloc");
+	if (compress2(z, &z_len, content.data, content.size, 6) != Z_OK)
+		errx(1, "compress2 failed");
+	buf_put(b, "RPDO", 4);
+	buf_be32(b, 0);
+	buf_zero(b, 2);
+	buf_put(b, z, z_len);
+	buf_zero(b, 10);
+	buf_put(b, name, strlen(name));
+	buf_zero(b, 8);
+	free(z);
+	buf_free(&content);
+}
+
+void
+lmclist(struct buf *b, const char *xml)
+{
+	buf_put(b, "\x01\0\0\0", 4);
+	buf_put(b, xml, strlen(xml));
+	buf_zero(b, CRC_LEN);
+}
+
+/* ZFJ file info: name, size, text and a CRC */
+void
+zfj(struct buf *b, const char *name)
+{
+	uint32_t crc;
+	unsigned int n;
+
+	buf_name(b, name, 8, '\0');
+	buf_be32(b, 0);
+	for (n = 0; n < 20 * conf.fanout; n++)
+		buf_put(b, "FIF=DEST\nfile info\n", 19);
+	*(uint32_t *)(b->data + 8) = htobe32(b->size + CRC_LEN);
+	crc = htobe32(crc32_z(0, b->data, b->size));
+	buf_put(b, &crc, CRC_LEN);
+}
+
+/* XPLF of 'fanout' BLOB or RPDO entries followed by a lmc list */
+void
+xplf_blobs(struct buf *b, unsigned int id, unsigned int compressed)
+{
+	struct buf *parts;
+	char name[64];
+	unsigned int n;
+
+	parts = calloc(conf.fanout + 1, sizeof(struct buf));
+	if (!parts)
+		err(1, "calloc");
+	for (n = 0; n < conf.fanout; n++) {
+		if (compressed) {
+			snprintf(name, sizeof(name), "CXC_132_%04u/%u_R36AB", id % 10000, n);
+			rpdo(&parts[n], name, conf.part_size);
+		} else {
+			snprintf(name, sizeof(name), "CXC%07u/%-11u R1A01", id, n);
+			blob(&parts[n], name, conf.part_size);
+		}
+	}
+	lmclist(&parts[n], "<lmc>list</lmc>");
+	snprintf(name, sizeof(name), "CXP9013268%%%-11u R63CG", id);
+	xplf(b, name, parts, conf.fanout + 1);
+	for (n = 0; n <= conf.fanout; n++)
+		buf_free(&parts[n]);
+	free(parts);
+}
+
+void
+write_file(const char *name, struct buf *b)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (snprintf(path, sizeof(path), "%s/%s", conf.dir, name) >= (int)sizeof(path))
+		errx(1, "path too long: %s", name);
+	f = fopen(path, "w");
+	if (!f)
+		err(1, "could not create %s", path);
+	if (fwrite(b->data, 1, b->size, f) != b->size || fclose(f) != 0)
+		err(1, "could not write %s", path);
+	total_size += b->size;
+	total_files++;
+}
+
+void
+gen_raw(unsigned int id)
+{
+	struct buf b = { 0 };
+	char name[16];
+
+	snprintf(name, sizeof(name), "DXP%03uCZ", id);
+	rec_raw(&b, name, conf.depth, id);
+	write_file(name, &b);
+	buf_free(&b);
+}
+
+void
+gen_meta(unsigned int id)
+{
+	struct buf b = { 0 }, *parts;
+	char name[16], xml[64];
+	unsigned int n;
+
+	parts = calloc(conf.fanout, sizeof(struct buf));
+	if (!parts)
+		err(1, "calloc");
+	for (n = 0; n < conf.fanout; n++) {
+		snprintf(xml, sizeof(xml), "<xml>meta %u</xml>", n);
+		buf_put(&parts[n], xml, strlen(xml));
+	}
+	snprintf(name, sizeof(name), "METR%04u", id);
+	rec_normal(&b, name, "BMEU", parts, conf.fanout);
+	write_file(name, &b);
+	buf_free(&b);
+	snprintf(name, sizeof(name), "UCFR%04u", id);
+	rec_normal(&b, name, "BUCU", parts, conf.fanout);
+	write_file(name, &b);
+	buf_free(&b);
+	snprintf(name, sizeof(name), "ZFJR%04u", id);
+	zfj(&b, name);
+	write_file(name, &b);
+	buf_free(&b);
+	for (n = 0; n < conf.fanout; n++)
+		buf_free(&parts[n]);
+	free(parts);
+}
+
+/* archive of 'fanout' parts of unknown content */
+void
+gen_archive(unsigned int id)
+{
+	struct buf b = { 0 }, a = { 0 }, content = { 0 }, *parts;
+	char name[16];
+	unsigned int n;
+
+	parts = calloc(conf.fanout, sizeof(struct buf));
+	if (!parts)
+		err(1, "calloc");
+	for (n = 0; n < conf.fanout; n++) {
+		payload(&content, conf.part_size, "CXC 112 3631/4");
+		archive_part(&parts[n], content.data, content.size);
+		buf_free(&content);
+	}
+	snprintf(name, sizeof(name), "CPR0%03u1", id);
+	archive(&a, name, parts, conf.fanout);
+	snprintf(name, sizeof(name), "CPA%03uAZ", id);
+	rec_decap(&b, name, "BCPU", &a, conf.depth);
+	write_file(name, &b);
+	buf_free(&b);
+	buf_free(&a);
+	for (n = 0; n < conf.fanout; n++)
+		buf_free(&parts[n]);
+	free(parts);
+}
+
+/* archive of one part holding a XPLF of BLOB or RPDO entries */
+void
+gen_xplf(unsigned int id, int compressed)
+{
+	struct buf b = { 0 }, a = { 0 }, inner = { 0 }, part = { 0 };
+	char name[16];
+
+	xplf_blobs(&inner, id, compressed);
+	archive_part(&part, inner.data, inner.size);
+	snprintf(name, sizeof(name), "RUS0%03u%u", id, compressed);
+	archive(&a, name, &part, 1);
+	snprintf(name, sizeof(name), "RU%c%03uBZ", compressed ? 'P' : 'X', id);
+	rec_decap(&b, name, "BRUU", &a, conf.depth);
+	write_file(name, &b);
+	buf_free(&b);
+	buf_free(&a);
+	buf_free(&part);
+	buf_free(&inner);
+}
+
+/* XPLF split in 4 archives named A to D, in 4 files */
+void
+gen_multipart(unsigned int id)
+{
+	struct buf b = { 0 }, a = { 0 }, inner = { 0 }, part = { 0 };
+	char name[16];
+	size_t off, len;
+	unsigned int n;
+
+	xplf_blobs(&inner, 1000 + id, 0);
+	for (n = 0; n < 4; n++) {
+		off = inner.size * n / 4;
+		len = inner.size * (n + 1) / 4 - off;
+		archive_part(&part, inner.data + off, len);
+		snprintf(name, sizeof(name), "N2X0%03u%c", id, 'A' + n);
+		archive(&a, name, &part, 1);
+		snprintf(name, sizeof(name), "N2%c%03uCZ", 'A' + n, id);
+		rec_decap(&b, name, "BN2U", &a, conf.depth);
+		write_file(name, &b);
+		buf_free(&b);
+		buf_free(&a);
+		buf_free(&part);
+	}
+	buf_free(&inner);
+}
@@ -15,13 +15,16 @@ do_test() {
 	expect_binwalk=$4
 	expect_extracted=$5
 	up_dir=$6
+	# remaining arguments are extra ericstract options
+	shift 6
 
-	echo "=== testing $up_dir"
+	echo "=== testing $up_dir${*:+ $*}"
 
 	trace rm -rf $EXTRACT_DIR
-	trace ./ericstract -o $EXTRACT_DIR $up_dir -E > $LOG
+	trace ./ericstract -o $EXTRACT_DIR $up_dir -E "$@" > $LOG
 
-	tail -n 13 $LOG > $LOG.sum
+	# last summary of the log, it's length depends on the options
+	awk '/^source upgrade files/ { n = 0 } { l[n++] = $0 } END { for (i = 0; i < n; i++) print l[i] }' $LOG > $LOG.sum
 	cat $LOG.sum
 
 	[ $(grep "source upgrade files" $LOG.sum |cut -d: -f2) == $expect_sources ]     || err "bad number of source files"
@@ -35,6 +38,31 @@ do_test() {
 }
 
 trace make
+trace make omtgen
+
+# synthetic package, see omtgen.c
+trace rm -rf /tmp/ericstract_test_pkg
+trace ./omtgen /tmp/ericstract_test_pkg
+do_test 11 158 72 90 119 /tmp/ericstract_test_pkg
+# parallel extraction gives the same results
+do_test 11 158 72 90 119 /tmp/ericstract_test_pkg -j 8
+# batch mode, the same package twice: the total is doubled
+do_test 22 316 144 180 238 "/tmp/ericstract_test_pkg /tmp/ericstract_test_pkg"
+# the same package read from a tar file
+trace tar -C /tmp -cf /tmp/ericstract_test_pkg.tar ericstract_test_pkg
+do_test 11 158 72 90 119 /tmp/ericstract_test_pkg.tar
+# a leaf part overwritten by a xz stream which decodes to the magic of an archive part, outside of an archive
+trace rm -rf /tmp/ericstract_test_xz
+trace ./omtgen -w raw -d 1 -f 2 -s 4 /tmp/ericstract_test_xz
+printf '\375\067\172\130\132\000\000\004\346\326\264\106\002\000\041\001\026\000\000\000\164\057\345\243\340\000\077\000\012\135\000\000\140\002\211\220\131\241\207\100\000\000\000\000\300\343\351\152\231\211\066\323\000\001\046\100\237\167\204\225\037\266\363\175\001\000\000\000\000\004\131\132' \
+	| dd of=/tmp/ericstract_test_xz/DXP000CZ bs=1 seek=140 conv=notrunc 2>/dev/null
+do_test 1 5 2 2 2 /tmp/ericstract_test_xz
+# the same with a zlib stream found by the carver
+trace rm -rf /tmp/ericstract_test_zlib
+trace ./omtgen -w raw -d 1 -f 2 -s 4 /tmp/ericstract_test_zlib
+printf '\170\234\143\140\140\144\141\240\000\000\000\001\162\000\006' \
+	| dd of=/tmp/ericstract_test_zlib/DXP000CZ bs=1 seek=140 conv=notrunc 2>/dev/null
+do_test 1 6 3 1 3 /tmp/ericstract_test_zlib -c
 
 # from https://www.4shared.com/rar/8eD9pMRTca/Ericsson.html
 #do_test 18 147 0 98 $HOME/doc/telco/ericsson/sw/Ericsson_rar/Ericsson/GSM_BTS_RUS_SW_G16B_R87C_\(OMT_FORMAT\)/